@@ -3,11 +3,27 @@
 REM vulkan paths
 set vki=-I"C:\VulkanSDK\1.3.290.0\Include"
 set vkl=-LIBPATH:"C:\VulkanSDK\1.3.290.0\Lib"
+set glslc="C:\VulkanSDK\1.3.290.0\Bin\glslc.exe"
 
 REM compiler flags
 set cf=-nologo -FC -Z7 -W4 -WX -wd4189 -wd4100 -wd4101
 
 IF NOT EXIST bin mkdir bin
 pushd bin
-cl %cf% ..\main.c %vki% -link %vkl% user32.lib vulkan-1.lib
-popd
\ No newline at end of file
+
+REM SPIR-V as C initializer lists, embedded by shader_registry.h
+%glslc% -mfmt=c ..\shaders\shader.vert -o vert.inc || goto shaders_failed
+%glslc% -mfmt=c ..\shaders\shader.frag -o frag.inc || goto shaders_failed
+%glslc% -mfmt=c ..\shaders\overdraw.frag -o overdraw.inc || goto shaders_failed
+%glslc% -mfmt=c ..\shaders\sdf.frag -o sdf.inc || goto shaders_failed
+%glslc% -mfmt=c ..\shaders\color.vert -o color.inc || goto shaders_failed
+%glslc% -mfmt=c ..\shaders\pull.vert -o pull.inc || goto shaders_failed
+%glslc% -mfmt=c --target-env=vulkan1.2 ..\shaders\cull.comp -o cull.inc || goto shaders_failed
+
+cl %cf% -I. ..\main.c %vki% -link %vkl% user32.lib gdi32.lib vulkan-1.lib
+popd
+exit /b %errorlevel%
+
+:shaders_failed
+popd
+exit /b 1
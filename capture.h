@@ -0,0 +1,402 @@
+/*
+*  Session capture and replay
+*
+*  The capture layer sits on the engine-level calls: vertex buffer
+*  creation, uploads into them, and each frame's draw list as it goes into
+*  the draw queue. Everything is appended to one binary file as a stream of
+*  records, each a CaptureRecordHeader followed by its payload:
+*
+*    CaptureFileHeader
+*    BUFFER / UPLOAD records made at startup
+*    per frame: FRAME, its DRAWs, then its UPLOADs
+*
+*  Handles are not captured. Buffers are referred to by their draw state
+*  table slot and indirect draws by kind, the replaying run supplies its
+*  own objects for both.
+*/
+
+#define CAPTURE_MAGIC 0x50434B56 // "VKCP"
+#define CAPTURE_VERSION 3
+
+typedef enum
+{
+    CAPTURE_RECORD_BUFFER, // CaptureBuffer
+    CAPTURE_RECORD_UPLOAD, // CaptureUpload, then the bytes
+    CAPTURE_RECORD_FRAME, // CaptureFrame
+    CAPTURE_RECORD_DRAW // CaptureDraw
+    
+} CaptureRecordType;
+
+// Modes that select which frame graph and passes a frame used
+#define CAPTURE_FRAME_GPU_CULLING (1 << 0)
+#define CAPTURE_FRAME_DEPTH_PASS (1 << 1)
+#define CAPTURE_FRAME_OVERDRAW (1 << 2)
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u32 width, height; // swapchain extent, a replay's window gets the same
+    u32 sceneLayout; // VertexLayout of the sprite scene, sizes its buffer
+    u32 padding;
+    u64 ticksPerSecond; // of the frame timestamps
+    
+} CaptureFileHeader;
+
+typedef struct
+{
+    u32 type; // CaptureRecordType
+    u32 size; // of the payload that follows
+    
+} CaptureRecordHeader;
+
+typedef struct
+{
+    u32 slot; // DrawStateTable vertex buffer slot
+    u32 usage; // VkBufferUsageFlags
+    u64 size;
+    
+} CaptureBuffer;
+
+typedef struct
+{
+    u32 slot;
+    u32 padding;
+    u64 offset;
+    u64 size;
+    
+} CaptureUpload;
+
+typedef struct
+{
+    u32 frameIndex;
+    u32 flags; // CAPTURE_FRAME_*
+    u64 ticks; // since the capture started
+    Rect2 view;
+    u32 drawCount;
+    u32 padding;
+    
+} CaptureFrame;
+
+// A DrawCommand without its handles, plus the sort key it was pushed with
+typedef struct
+{
+    u64 key;
+    u32 kind;
+    u32 pipeline;
+    u32 descriptorSet;
+    u32 vertexBuffer;
+    u32 vertexCount;
+    u32 firstVertex;
+    u32 maxDrawCount;
+    u32 padding;
+    PushConstants pushConstants;
+    
+} CaptureDraw;
+
+/*
+*  Writing
+*/
+
+typedef struct
+{
+    FILE *file; // NULL when not capturing, every call is then a no-op
+    LARGE_INTEGER startTicks;
+    
+} CaptureWriter;
+
+void
+capture_write_record(CaptureWriter *writer, CaptureRecordType type,
+                     void *payload, u32 payloadSize,
+                     void *data, u64 dataSize)
+{
+    CaptureRecordHeader header = { type, payloadSize + (u32)dataSize };
+    fwrite(&header, sizeof(header), 1, writer->file);
+    fwrite(payload, payloadSize, 1, writer->file);
+    
+    if (dataSize)
+    {
+        fwrite(data, (size_t)dataSize, 1, writer->file);
+    }
+}
+
+bool
+capture_begin(CaptureWriter *writer, char *fileName, VkExtent2D extent,
+              VertexLayout sceneLayout)
+{
+    fopen_s(&writer->file, fileName, "wb");
+    if (!writer->file)
+    {
+        return false;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&writer->startTicks);
+    
+    CaptureFileHeader header =
+    {
+        CAPTURE_MAGIC,
+        CAPTURE_VERSION,
+        extent.width, extent.height,
+        (u32)sceneLayout, 0,
+        (u64)frequency.QuadPart
+    };
+    
+    fwrite(&header, sizeof(header), 1, writer->file);
+    
+    return true;
+}
+
+void
+capture_buffer(CaptureWriter *writer, u32 slot, VkBufferUsageFlags usage,
+               u64 size)
+{
+    if (writer->file)
+    {
+        CaptureBuffer buffer = { slot, usage, size };
+        capture_write_record(writer, CAPTURE_RECORD_BUFFER,
+                             &buffer, sizeof(buffer), NULL, 0);
+    }
+}
+
+void
+capture_upload(CaptureWriter *writer, u32 slot, u64 offset, void *data,
+               u64 size)
+{
+    if (writer->file)
+    {
+        CaptureUpload upload = { slot, 0, offset, size };
+        capture_write_record(writer, CAPTURE_RECORD_UPLOAD,
+                             &upload, sizeof(upload), data, size);
+    }
+}
+
+// Call once the frame's draw queue is built, then capture its uploads
+void
+capture_frame(CaptureWriter *writer, u32 frameIndex, u32 flags, Rect2 view,
+              DrawQueue *queue)
+{
+    if (!writer->file)
+    {
+        return;
+    }
+    
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    
+    CaptureFrame frame =
+    {
+        frameIndex,
+        flags,
+        (u64)(now.QuadPart - writer->startTicks.QuadPart),
+        view,
+        queue->count,
+        0
+    };
+    
+    capture_write_record(writer, CAPTURE_RECORD_FRAME,
+                         &frame, sizeof(frame), NULL, 0);
+    
+    for (u32 i = 0; i < queue->count; i++)
+    {
+        DrawSortEntry *entry = &queue->entries[i];
+        DrawCommand *command = &queue->commands[entry->command];
+        
+        CaptureDraw draw =
+        {
+            entry->key,
+            command->kind,
+            command->pipeline,
+            command->descriptorSet,
+            command->vertexBuffer,
+            command->vertexCount,
+            command->firstVertex,
+            command->maxDrawCount,
+            0,
+            command->pushConstants
+        };
+        
+        capture_write_record(writer, CAPTURE_RECORD_DRAW,
+                             &draw, sizeof(draw), NULL, 0);
+    }
+}
+
+void
+capture_end(CaptureWriter *writer)
+{
+    if (writer->file)
+    {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+}
+
+/*
+*  Reading
+*/
+
+typedef struct
+{
+    LoadedFile file;
+    CaptureFileHeader *header;
+    u8 *at; // next record
+    u8 *end;
+    
+} CaptureReader;
+
+bool
+capture_open(CaptureReader *reader, char *fileName)
+{
+    reader->file = load_entire_file(fileName);
+    reader->header = (CaptureFileHeader *)reader->file.data;
+    reader->at = (u8 *)reader->file.data + sizeof(CaptureFileHeader);
+    reader->end = (u8 *)reader->file.data + reader->file.size;
+    
+    return reader->file.size >= sizeof(CaptureFileHeader) &&
+        reader->header->magic == CAPTURE_MAGIC &&
+        reader->header->version == CAPTURE_VERSION;
+}
+
+// Returns the next record's payload, or NULL at the end of the stream
+void *
+capture_next_record(CaptureReader *reader, CaptureRecordType *type,
+                    u32 *size)
+{
+    if (reader->at + sizeof(CaptureRecordHeader) > reader->end)
+    {
+        return NULL;
+    }
+    
+    CaptureRecordHeader *header = (CaptureRecordHeader *)reader->at;
+    u8 *payload = reader->at + sizeof(CaptureRecordHeader);
+    
+    if (payload + header->size > reader->end)
+    {
+        return NULL; // truncated, e.g. the capturing run was killed
+    }
+    
+    reader->at = payload + header->size;
+    *type = (CaptureRecordType)header->type;
+    *size = header->size;
+    
+    return payload;
+}
+
+// Peeks without consuming, so a frame can stop at the next FRAME record
+bool
+capture_next_is_frame(CaptureReader *reader)
+{
+    if (reader->at + sizeof(CaptureRecordHeader) > reader->end)
+    {
+        return true; // end of stream ends the frame too
+    }
+    
+    CaptureRecordHeader *header = (CaptureRecordHeader *)reader->at;
+    return header->type == CAPTURE_RECORD_FRAME;
+}
+
+DrawCommand
+capture_draw_command(CaptureDraw *draw)
+{
+    DrawCommand command = {0};
+    command.kind = draw->kind;
+    command.pipeline = draw->pipeline;
+    command.descriptorSet = draw->descriptorSet;
+    command.vertexBuffer = draw->vertexBuffer;
+    command.vertexCount = draw->vertexCount;
+    command.firstVertex = draw->firstVertex;
+    command.maxDrawCount = draw->maxDrawCount;
+    command.pushConstants = draw->pushConstants;
+    
+    return command;
+}
+
+/*
+*  Replay timing report
+*/
+
+typedef struct
+{
+    f32 *frameMilliseconds; // replayed
+    f32 *recordedMilliseconds; // what the captured session took
+    u32 frameCount;
+    u32 capacity;
+    
+} ReplayReport;
+
+void
+replay_report_add(ReplayReport *report, f32 replayedMs, f32 recordedMs)
+{
+    if (report->frameCount == report->capacity)
+    {
+        report->capacity = report->capacity ? report->capacity * 2 : 1024;
+        report->frameMilliseconds = (f32 *)realloc(
+            report->frameMilliseconds, report->capacity * sizeof(f32));
+        report->recordedMilliseconds = (f32 *)realloc(
+            report->recordedMilliseconds, report->capacity * sizeof(f32));
+        assert(report->frameMilliseconds && report->recordedMilliseconds);
+    }
+    
+    report->frameMilliseconds[report->frameCount] = replayedMs;
+    report->recordedMilliseconds[report->frameCount] = recordedMs;
+    report->frameCount++;
+}
+
+int
+replay_compare_f32(const void *a, const void *b)
+{
+    f32 x = *(f32 *)a;
+    f32 y = *(f32 *)b;
+    return (x > y) - (x < y);
+}
+
+/* Writes one line per frame to fileName as CSV and prints min, average,
+   median, 99th percentile and max frame times. */
+void
+replay_report_write(ReplayReport *report, char *fileName)
+{
+    if (report->frameCount == 0)
+    {
+        return;
+    }
+    
+    FILE *file;
+    fopen_s(&file, fileName, "w");
+    if (file)
+    {
+        fprintf(file, "frame,replayed_ms,recorded_ms\n");
+        for (u32 i = 0; i < report->frameCount; i++)
+        {
+            fprintf(file, "%u,%.3f,%.3f\n", i,
+                    report->frameMilliseconds[i],
+                    report->recordedMilliseconds[i]);
+        }
+        fclose(file);
+    }
+    
+    f32 *sorted = (f32 *)malloc(report->frameCount * sizeof(f32));
+    assert(sorted);
+    memcpy(sorted, report->frameMilliseconds, report->frameCount * sizeof(f32));
+    qsort(sorted, report->frameCount, sizeof(f32), replay_compare_f32);
+    
+    f32 total = 0;
+    for (u32 i = 0; i < report->frameCount; i++)
+    {
+        total += sorted[i];
+    }
+    
+    char text[256];
+    sprintf_s(text, sizeof(text),
+              "Replay: %u frames, ms min %.3f avg %.3f median %.3f "
+              "p99 %.3f max %.3f\n",
+              report->frameCount,
+              sorted[0],
+              total / (f32)report->frameCount,
+              sorted[report->frameCount / 2],
+              sorted[(report->frameCount * 99) / 100],
+              sorted[report->frameCount - 1]);
+    OutputDebugString(text);
+    
+    free(sorted);
+}
@@ -0,0 +1,193 @@
+/*
+*  CPU visibility culling
+*
+*  Axis aligned bounds are kept in structure-of-arrays form so SIMD_WIDTH
+*  boxes are tested against the view per iteration. The work is split into
+*  chunks over the job queue. Each chunk writes its visible indices in place
+*  at its own offset of the output, then the chunks are packed together.
+*/
+
+#define CULL_CHUNK_SIZE 4096 // multiple of SIMD_WIDTH
+#define CULL_MAX_CHUNKS 1024
+
+typedef struct
+{
+    f32 minX, minY;
+    f32 maxX, maxY;
+    
+} Rect2;
+
+typedef struct
+{
+    f32 *minX;
+    f32 *minY;
+    f32 *maxX;
+    f32 *maxY;
+    
+} BoundsArrays;
+
+/*
+*  Bounds of rotated sprites
+*/
+
+typedef struct
+{
+    SpriteArrays *sprites;
+    BoundsArrays *bounds;
+    
+} SpriteBoundsWork;
+
+void
+compute_sprite_bounds_chunk(void *userData, u32 first, u32 count,
+                            u32 chunkIndex)
+{
+    SpriteBoundsWork *work = (SpriteBoundsWork *)userData;
+    SpriteArrays *sprites = work->sprites;
+    BoundsArrays *bounds = work->bounds;
+    
+    f32xN half = simd_set1(0.5f);
+    
+    u32 end = first + count;
+    u32 i = first;
+    for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH)
+    {
+        f32xN cx = simd_load(sprites->centerX + i);
+        f32xN cy = simd_load(sprites->centerY + i);
+        f32xN hw = simd_mul(simd_load(sprites->width + i), half);
+        f32xN hh = simd_mul(simd_load(sprites->height + i), half);
+        
+        f32xN s, c;
+        simd_sincos(simd_load(sprites->rotation + i), &s, &c);
+        
+        // Extents of the rotated box projected onto each axis
+        f32xN ex = simd_add(simd_abs(simd_mul(hw, c)), simd_abs(simd_mul(hh, s)));
+        f32xN ey = simd_add(simd_abs(simd_mul(hw, s)), simd_abs(simd_mul(hh, c)));
+        
+        simd_store(bounds->minX + i, simd_sub(cx, ex));
+        simd_store(bounds->minY + i, simd_sub(cy, ey));
+        simd_store(bounds->maxX + i, simd_add(cx, ex));
+        simd_store(bounds->maxY + i, simd_add(cy, ey));
+    }
+    
+    for (; i < end; i++)
+    {
+        f32 hw = sprites->width[i] * 0.5f;
+        f32 hh = sprites->height[i] * 0.5f;
+        f32 s = sinf(sprites->rotation[i]);
+        f32 c = cosf(sprites->rotation[i]);
+        
+        f32 ex = fabsf(hw * c) + fabsf(hh * s);
+        f32 ey = fabsf(hw * s) + fabsf(hh * c);
+        
+        bounds->minX[i] = sprites->centerX[i] - ex;
+        bounds->minY[i] = sprites->centerY[i] - ey;
+        bounds->maxX[i] = sprites->centerX[i] + ex;
+        bounds->maxY[i] = sprites->centerY[i] + ey;
+    }
+}
+
+// Only needs to run again for sprites that moved, resized or rotated
+void
+compute_sprite_bounds(JobQueue *queue, SpriteArrays *sprites, u32 count,
+                      BoundsArrays *bounds)
+{
+    SpriteBoundsWork work = { sprites, bounds };
+    jobs_parallel_for(queue, count, CULL_CHUNK_SIZE,
+                      compute_sprite_bounds_chunk, &work);
+}
+
+/*
+*  View culling
+*/
+
+typedef struct
+{
+    BoundsArrays *bounds;
+    Rect2 view;
+    u32 *visible;
+    u32 chunkVisibleCounts[CULL_MAX_CHUNKS];
+    
+} CullWork;
+
+void
+cull_chunk(void *userData, u32 first, u32 count, u32 chunkIndex)
+{
+    CullWork *work = (CullWork *)userData;
+    BoundsArrays *bounds = work->bounds;
+    
+    f32xN viewMinX = simd_set1(work->view.minX);
+    f32xN viewMinY = simd_set1(work->view.minY);
+    f32xN viewMaxX = simd_set1(work->view.maxX);
+    f32xN viewMaxY = simd_set1(work->view.maxY);
+    
+    // Chunks write at their own offset, so no two chunks share output
+    u32 *out = work->visible + first;
+    
+    u32 end = first + count;
+    u32 i = first;
+    for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH)
+    {
+        // Overlap on both axes, touching edges count as visible
+        maskN inside = simd_mask_and(
+            simd_mask_and(simd_cmp_ge(simd_load(bounds->maxX + i), viewMinX),
+                          simd_cmp_le(simd_load(bounds->minX + i), viewMaxX)),
+            simd_mask_and(simd_cmp_ge(simd_load(bounds->maxY + i), viewMinY),
+                          simd_cmp_le(simd_load(bounds->minY + i), viewMaxY)));
+        
+        u32 bits = simd_mask_bits(inside);
+        while (bits)
+        {
+            *out++ = i + bit_scan_forward(bits);
+            bits &= bits - 1;
+        }
+    }
+    
+    for (; i < end; i++)
+    {
+        if (bounds->maxX[i] >= work->view.minX &&
+            bounds->minX[i] <= work->view.maxX &&
+            bounds->maxY[i] >= work->view.minY &&
+            bounds->minY[i] <= work->view.maxY)
+        {
+            *out++ = i;
+        }
+    }
+    
+    work->chunkVisibleCounts[chunkIndex] = (u32)(out - (work->visible + first));
+}
+
+/* Fills visible with the indices of the boxes that overlap view, in
+   ascending order, and returns how many there are. visible must have room
+   for count indices. */
+u32
+cull_bounds(JobQueue *queue, BoundsArrays *bounds, u32 count, Rect2 view,
+            u32 *visible)
+{
+    assert(jobs_chunk_count(count, CULL_CHUNK_SIZE) <= CULL_MAX_CHUNKS);
+    
+    CullWork work;
+    work.bounds = bounds;
+    work.view = view;
+    work.visible = visible;
+    
+    jobs_parallel_for(queue, count, CULL_CHUNK_SIZE, cull_chunk, &work);
+    
+    // Pack the per-chunk runs, each one only ever moves towards the front
+    u32 visibleCount = 0;
+    u32 chunkCount = jobs_chunk_count(count, CULL_CHUNK_SIZE);
+    for (u32 chunk = 0; chunk < chunkCount; chunk++)
+    {
+        u32 chunkVisible = work.chunkVisibleCounts[chunk];
+        u32 chunkFirst = chunk * CULL_CHUNK_SIZE;
+        
+        if (chunkFirst != visibleCount)
+        {
+            memmove(visible + visibleCount, visible + chunkFirst,
+                    chunkVisible * sizeof(u32));
+        }
+        
+        visibleCount += chunkVisible;
+    }
+    
+    return visibleCount;
+}
@@ -0,0 +1,191 @@
+/*
+*  Deferred destruction
+*
+*  Vulkan objects can't be destroyed while a submission that uses them may
+*  still be running. Instead of waiting for the GPU, they are queued with
+*  the timeline value of the last submission that used them, and once a
+*  frame every entry whose value has been reached is destroyed in one go.
+*  Nothing here ever blocks, except destroy_queue_flush at exit.
+*/
+
+typedef enum
+{
+    DESTROY_BUFFER,
+    DESTROY_IMAGE,
+    DESTROY_IMAGE_VIEW,
+    DESTROY_MEMORY,
+    DESTROY_COMMAND_BUFFER // from graphicsCommandPool
+    
+} DestroyType;
+
+typedef struct
+{
+    DestroyType type;
+    u64 value; // destroyed once the timeline reaches it
+    
+    union
+    {
+        VkBuffer buffer;
+        VkImage image;
+        VkImageView imageView;
+        VkDeviceMemory memory;
+        VkCommandBuffer commandBuffer;
+        
+    } handle;
+    
+} DestroyEntry;
+
+struct DestroyQueue
+{
+    DestroyEntry *entries; // in the order they were queued
+    u32 count;
+    u32 capacity;
+    
+    u32 destroyedTotal;
+};
+
+void
+destroy_queue_push(VulkanContext *vk, DestroyEntry *entry)
+{
+    DestroyQueue *queue = vk->destroyQueue;
+    
+    if (queue->count == queue->capacity)
+    {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->entries = (DestroyEntry *)realloc(
+            queue->entries, queue->capacity * sizeof(DestroyEntry));
+        assert(queue->entries);
+    }
+    
+    queue->entries[queue->count++] = *entry;
+}
+
+// Either handle may be VK_NULL_HANDLE
+void
+destroy_queue_buffer(VulkanContext *vk, VkBuffer buffer,
+                     VkDeviceMemory memory, u64 value)
+{
+    DestroyEntry entry = {0};
+    entry.value = value;
+    
+    if (buffer)
+    {
+        entry.type = DESTROY_BUFFER;
+        entry.handle.buffer = buffer;
+        destroy_queue_push(vk, &entry);
+    }
+    
+    if (memory)
+    {
+        entry.type = DESTROY_MEMORY;
+        entry.handle.memory = memory;
+        destroy_queue_push(vk, &entry);
+    }
+}
+
+// Any of the handles may be VK_NULL_HANDLE
+void
+destroy_queue_image(VulkanContext *vk, VkImage image, VkImageView view,
+                    VkDeviceMemory memory, u64 value)
+{
+    DestroyEntry entry = {0};
+    entry.value = value;
+    
+    // Views before their image, entries are destroyed in queue order
+    if (view)
+    {
+        entry.type = DESTROY_IMAGE_VIEW;
+        entry.handle.imageView = view;
+        destroy_queue_push(vk, &entry);
+    }
+    
+    if (image)
+    {
+        entry.type = DESTROY_IMAGE;
+        entry.handle.image = image;
+        destroy_queue_push(vk, &entry);
+    }
+    
+    if (memory)
+    {
+        entry.type = DESTROY_MEMORY;
+        entry.handle.memory = memory;
+        destroy_queue_push(vk, &entry);
+    }
+}
+
+void
+destroy_queue_command_buffer(VulkanContext *vk, VkCommandBuffer commandBuffer,
+                             u64 value)
+{
+    DestroyEntry entry = {0};
+    entry.type = DESTROY_COMMAND_BUFFER;
+    entry.value = value;
+    entry.handle.commandBuffer = commandBuffer;
+    destroy_queue_push(vk, &entry);
+}
+
+/* Destroys everything whose value the GPU has passed and returns how many
+   objects that was. Call once a frame. */
+u32
+destroy_queue_collect(VulkanContext *vk)
+{
+    DestroyQueue *queue = vk->destroyQueue;
+    
+    u32 kept = 0;
+    for (u32 i = 0; i < queue->count; i++)
+    {
+        DestroyEntry *entry = &queue->entries[i];
+        if (!gpu_timeline_reached(vk, entry->value))
+        {
+            queue->entries[kept++] = *entry;
+            continue;
+        }
+        
+        switch (entry->type)
+        {
+            case DESTROY_BUFFER:
+            {
+                vkDestroyBuffer(vk->device, entry->handle.buffer, NULL);
+            } break;
+            
+            case DESTROY_IMAGE:
+            {
+                vkDestroyImage(vk->device, entry->handle.image, NULL);
+            } break;
+            
+            case DESTROY_IMAGE_VIEW:
+            {
+                vkDestroyImageView(vk->device, entry->handle.imageView, NULL);
+            } break;
+            
+            case DESTROY_MEMORY:
+            {
+                vkFreeMemory(vk->device, entry->handle.memory, NULL);
+            } break;
+            
+            case DESTROY_COMMAND_BUFFER:
+            {
+                vkFreeCommandBuffers(vk->device, vk->graphicsCommandPool, 1,
+                                     &entry->handle.commandBuffer);
+            } break;
+        }
+    }
+    
+    u32 destroyed = queue->count - kept;
+    queue->count = kept;
+    queue->destroyedTotal += destroyed;
+    
+    return destroyed;
+}
+
+// Waits for the GPU to finish everything and empties the queue
+void
+destroy_queue_flush(VulkanContext *vk)
+{
+    gpu_timeline_wait_all(vk);
+    destroy_queue_collect(vk);
+    
+    free(vk->destroyQueue->entries);
+    memset(vk->destroyQueue, 0, sizeof(DestroyQueue));
+}
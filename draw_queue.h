@@ -0,0 +1,437 @@
+/*
+*  Draw queue
+*
+*  Draws are recorded in any order with a 64-bit sort key, sorted with a
+*  parallel LSD radix sort, then emitted while skipping every bind that
+*  would set state that is already bound. The key layout, most significant
+*  bits first, decides what is grouped together:
+*
+*    layer (8) | pipeline (10) | descriptor set (14) | vertex buffer (8) |
+*    depth (24)
+*/
+
+#define DRAW_KEY_LAYER_SHIFT 56
+#define DRAW_KEY_PIPELINE_SHIFT 46
+#define DRAW_KEY_DESCRIPTOR_SHIFT 32
+#define DRAW_KEY_VERTEX_BUFFER_SHIFT 24
+
+#define DRAW_MAX_PIPELINES 1024
+#define DRAW_MAX_DESCRIPTOR_SETS 16384
+#define DRAW_MAX_VERTEX_BUFFERS 256
+#define DRAW_NO_VERTEX_BUFFER (DRAW_MAX_VERTEX_BUFFERS - 1) // pulled draws
+
+#define DRAW_SORT_MIN_CHUNK 2048
+#define DRAW_SORT_MAX_CHUNKS 64
+
+typedef enum
+{
+    DRAW_KIND_DIRECT, // vkCmdDraw
+    DRAW_KIND_INDIRECT_COUNT // vkCmdDrawIndirectCount
+    
+} DrawKind;
+
+typedef struct
+{
+    u32 kind; // DrawKind
+    u32 pipeline; // index into DrawStateTable
+    u32 descriptorSet;
+    u32 vertexBuffer;
+    
+    u32 vertexCount;
+    u32 firstVertex;
+    
+    // DRAW_KIND_INDIRECT_COUNT only
+    VkBuffer indirectBuffer;
+    VkBuffer countBuffer;
+    u32 maxDrawCount;
+    
+    PushConstants pushConstants;
+    
+} DrawCommand;
+
+// Handles the command indices resolve to
+typedef struct
+{
+    VkPipeline pipelines[DRAW_MAX_PIPELINES];
+    VkPipelineLayout pipelineLayouts[DRAW_MAX_PIPELINES];
+    VkDescriptorSet descriptorSets[DRAW_MAX_DESCRIPTOR_SETS];
+    VkBuffer vertexBuffers[DRAW_MAX_VERTEX_BUFFERS];
+    
+    /* Raster state of each pipeline slot, set on the command buffer when
+       pipelines leave it dynamic. Slots that only differ here can then
+       share one VkPipeline. */
+    bool dynamicRasterState;
+    VkCullModeFlags cullModes[DRAW_MAX_PIPELINES];
+    VkFrontFace frontFaces[DRAW_MAX_PIPELINES];
+    
+} DrawStateTable;
+
+typedef struct
+{
+    u32 draws;
+    
+    u32 pipelineBinds;
+    u32 descriptorBinds;
+    u32 vertexBufferBinds;
+    u32 pushConstantUpdates;
+    
+    // State changes the sort and the redundancy checks avoided
+    u32 pipelineBindsSkipped;
+    u32 descriptorBindsSkipped;
+    u32 vertexBufferBindsSkipped;
+    u32 pushConstantUpdatesSkipped;
+    
+} DrawQueueStats;
+
+typedef struct
+{
+    u64 key;
+    u32 command; // index into commands
+    u32 padding;
+    
+} DrawSortEntry;
+
+typedef struct
+{
+    DrawCommand *commands;
+    DrawSortEntry *entries;
+    DrawSortEntry *scratch; // radix sort ping-pong buffer
+    u32 count;
+    u32 capacity;
+    
+    JobQueue *jobQueue;
+    
+    // Per chunk digit counts, turned into scatter offsets in place
+    u32 histograms[DRAW_SORT_MAX_CHUNKS][256];
+    u32 chunkSize;
+    u32 shift; // digit being sorted
+    
+} DrawQueue;
+
+/*
+*  Sort key helpers
+*/
+
+/* Maps a float to bits whose unsigned order matches the float order, and
+   keeps the top 24. Back to front drawing flips them so the farthest draw
+   sorts first. */
+u32
+draw_key_depth(f32 depth, bool backToFront)
+{
+    u32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    
+    bits = (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+    bits >>= 8;
+    
+    return backToFront ? (~bits & 0xFFFFFF) : bits;
+}
+
+u64
+draw_key_make(u32 layer, u32 pipeline, u32 descriptorSet, u32 vertexBuffer,
+              u32 depthBits)
+{
+    assert(layer < 256);
+    assert(pipeline < DRAW_MAX_PIPELINES);
+    assert(descriptorSet < DRAW_MAX_DESCRIPTOR_SETS);
+    assert(vertexBuffer < DRAW_MAX_VERTEX_BUFFERS);
+    
+    return ((u64)layer << DRAW_KEY_LAYER_SHIFT) |
+           ((u64)pipeline << DRAW_KEY_PIPELINE_SHIFT) |
+           ((u64)descriptorSet << DRAW_KEY_DESCRIPTOR_SHIFT) |
+           ((u64)vertexBuffer << DRAW_KEY_VERTEX_BUFFER_SHIFT) |
+           (u64)(depthBits & 0xFFFFFF);
+}
+
+/*
+*  Queue
+*/
+
+void
+draw_queue_init(DrawQueue *queue, u32 capacity, JobQueue *jobQueue)
+{
+    queue->commands = (DrawCommand *)malloc(sizeof(DrawCommand) * capacity);
+    queue->entries = (DrawSortEntry *)malloc(sizeof(DrawSortEntry) * capacity);
+    queue->scratch = (DrawSortEntry *)malloc(sizeof(DrawSortEntry) * capacity);
+    assert(queue->commands && queue->entries && queue->scratch);
+    
+    queue->count = 0;
+    queue->capacity = capacity;
+    queue->jobQueue = jobQueue;
+}
+
+void
+draw_queue_reset(DrawQueue *queue)
+{
+    queue->count = 0;
+}
+
+// For keys made earlier, e.g. by a captured session being replayed
+void
+draw_queue_push_keyed(DrawQueue *queue, u64 key, DrawCommand *command)
+{
+    assert(queue->count < queue->capacity);
+    
+    u32 index = queue->count++;
+    queue->commands[index] = *command;
+    
+    DrawSortEntry entry = { key, index, 0 };
+    queue->entries[index] = entry;
+}
+
+// layer and depth only affect ordering, everything else is in command
+void
+draw_queue_push(DrawQueue *queue, u32 layer, f32 depth, bool backToFront,
+                DrawCommand *command)
+{
+    u64 key = draw_key_make(layer, command->pipeline, command->descriptorSet,
+                            command->vertexBuffer,
+                            draw_key_depth(depth, backToFront));
+    
+    draw_queue_push_keyed(queue, key, command);
+}
+
+/*
+*  Parallel radix sort (8 passes of 8 bits, stable)
+*/
+
+void
+draw_sort_histogram_chunk(void *userData, u32 first, u32 count,
+                          u32 chunkIndex)
+{
+    DrawQueue *queue = (DrawQueue *)userData;
+    u32 *histogram = queue->histograms[chunkIndex];
+    
+    memset(histogram, 0, sizeof(queue->histograms[0]));
+    
+    for (u32 i = first; i < first + count; i++)
+    {
+        histogram[(queue->entries[i].key >> queue->shift) & 0xFF]++;
+    }
+}
+
+void
+draw_sort_scatter_chunk(void *userData, u32 first, u32 count,
+                        u32 chunkIndex)
+{
+    DrawQueue *queue = (DrawQueue *)userData;
+    u32 *offsets = queue->histograms[chunkIndex];
+    
+    for (u32 i = first; i < first + count; i++)
+    {
+        DrawSortEntry entry = queue->entries[i];
+        queue->scratch[offsets[(entry.key >> queue->shift) & 0xFF]++] = entry;
+    }
+}
+
+void
+draw_queue_sort(DrawQueue *queue)
+{
+    u32 count = queue->count;
+    if (count < 2)
+    {
+        return;
+    }
+    
+    // Big enough chunks that every worker gets a share but no more
+    u32 threadCount = queue->jobQueue ? queue->jobQueue->threadCount + 1 : 1;
+    u32 chunkSize = (count + threadCount - 1) / threadCount;
+    if (chunkSize < DRAW_SORT_MIN_CHUNK)
+    {
+        chunkSize = DRAW_SORT_MIN_CHUNK;
+    }
+    if (jobs_chunk_count(count, chunkSize) > DRAW_SORT_MAX_CHUNKS)
+    {
+        chunkSize = (count + DRAW_SORT_MAX_CHUNKS - 1) / DRAW_SORT_MAX_CHUNKS;
+    }
+    
+    queue->chunkSize = chunkSize;
+    u32 chunkCount = jobs_chunk_count(count, chunkSize);
+    
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        queue->shift = shift;
+        jobs_parallel_for(queue->jobQueue, count, chunkSize,
+                          draw_sort_histogram_chunk, queue);
+        
+        /* Exclusive prefix sum in (digit, chunk) order, so each chunk
+           scatters after every earlier chunk's entries with the same digit,
+           which keeps the sort stable. A pass where every key has the same
+           digit would be a plain copy and is skipped. */
+        u32 offset = 0;
+        bool allSameDigit = false;
+        for (u32 digit = 0; digit < 256; digit++)
+        {
+            u32 digitTotal = 0;
+            for (u32 chunk = 0; chunk < chunkCount; chunk++)
+            {
+                u32 digitCount = queue->histograms[chunk][digit];
+                queue->histograms[chunk][digit] = offset + digitTotal;
+                digitTotal += digitCount;
+            }
+            
+            if (digitTotal == count)
+            {
+                allSameDigit = true;
+                break;
+            }
+            
+            offset += digitTotal;
+        }
+        
+        if (allSameDigit)
+        {
+            continue;
+        }
+        
+        jobs_parallel_for(queue->jobQueue, count, chunkSize,
+                          draw_sort_scatter_chunk, queue);
+        
+        DrawSortEntry *swap = queue->entries;
+        queue->entries = queue->scratch;
+        queue->scratch = swap;
+    }
+}
+
+/*
+*  Emit
+*/
+
+/* Records the sorted draws into commandBuffer (inside a render pass).
+   Every pipeline in table is expected to use a pipeline layout compatible
+   with the descriptor set and push constants the draws use. */
+void
+draw_queue_emit(DrawQueue *queue, DrawStateTable *table,
+                VkCommandBuffer commandBuffer, DrawQueueStats *stats)
+{
+    u32 boundPipeline = UINT32_MAX;
+    VkPipeline boundPipelineHandle = VK_NULL_HANDLE;
+    VkCullModeFlags boundCullMode = VK_CULL_MODE_FLAG_BITS_MAX_ENUM;
+    VkFrontFace boundFrontFace = VK_FRONT_FACE_MAX_ENUM;
+    u32 boundDescriptorSet = UINT32_MAX;
+    u32 boundVertexBuffer = UINT32_MAX;
+    PushConstants *lastPushConstants = NULL;
+    
+    DrawQueueStats frameStats = {0};
+    
+    for (u32 i = 0; i < queue->count; i++)
+    {
+        DrawCommand *command = &queue->commands[queue->entries[i].command];
+        VkPipelineLayout layout = table->pipelineLayouts[command->pipeline];
+        
+        VkPipeline pipeline = table->pipelines[command->pipeline];
+        if (pipeline != boundPipelineHandle)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              pipeline);
+            
+            boundPipelineHandle = pipeline;
+            frameStats.pipelineBinds++;
+        }
+        else
+        {
+            frameStats.pipelineBindsSkipped++;
+        }
+        
+        if (command->pipeline != boundPipeline)
+        {
+            // Push constants are undefined after binding a new layout
+            if (boundPipeline != UINT32_MAX &&
+                table->pipelineLayouts[boundPipeline] != layout)
+            {
+                boundDescriptorSet = UINT32_MAX;
+                lastPushConstants = NULL;
+            }
+            
+            if (table->dynamicRasterState)
+            {
+                VkCullModeFlags cullMode = table->cullModes[command->pipeline];
+                if (cullMode != boundCullMode)
+                {
+                    vkCmdSetCullMode(commandBuffer, cullMode);
+                    boundCullMode = cullMode;
+                }
+                
+                VkFrontFace frontFace = table->frontFaces[command->pipeline];
+                if (frontFace != boundFrontFace)
+                {
+                    vkCmdSetFrontFace(commandBuffer, frontFace);
+                    boundFrontFace = frontFace;
+                }
+            }
+            
+            boundPipeline = command->pipeline;
+        }
+        
+        if (command->descriptorSet != boundDescriptorSet)
+        {
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    layout, 0, 1,
+                                    &table->descriptorSets[command->descriptorSet],
+                                    0, NULL);
+            
+            boundDescriptorSet = command->descriptorSet;
+            frameStats.descriptorBinds++;
+        }
+        else
+        {
+            frameStats.descriptorBindsSkipped++;
+        }
+        
+        // Draws that pull their vertices leave the binding as it is
+        if (command->vertexBuffer != boundVertexBuffer &&
+            command->vertexBuffer != DRAW_NO_VERTEX_BUFFER)
+        {
+            VkDeviceSize offset = 0;
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+                                   &table->vertexBuffers[command->vertexBuffer],
+                                   &offset);
+            
+            boundVertexBuffer = command->vertexBuffer;
+            frameStats.vertexBufferBinds++;
+        }
+        else
+        {
+            frameStats.vertexBufferBindsSkipped++;
+        }
+        
+        if (!lastPushConstants ||
+            memcmp(lastPushConstants, &command->pushConstants,
+                   sizeof(PushConstants)) != 0)
+        {
+            vkCmdPushConstants(commandBuffer, layout,
+                               VK_SHADER_STAGE_VERTEX_BIT,
+                               0, sizeof(PushConstants),
+                               &command->pushConstants);
+            
+            lastPushConstants = &command->pushConstants;
+            frameStats.pushConstantUpdates++;
+        }
+        else
+        {
+            frameStats.pushConstantUpdatesSkipped++;
+        }
+        
+        if (command->kind == DRAW_KIND_INDIRECT_COUNT)
+        {
+            vkCmdDrawIndirectCount(commandBuffer,
+                                   command->indirectBuffer, 0,
+                                   command->countBuffer, 0,
+                                   command->maxDrawCount,
+                                   sizeof(VkDrawIndirectCommand));
+        }
+        else
+        {
+            vkCmdDraw(commandBuffer, command->vertexCount, 1,
+                      command->firstVertex, 0);
+        }
+        
+        frameStats.draws++;
+    }
+    
+    if (stats)
+    {
+        *stats = frameStats;
+    }
+}
@@ -0,0 +1,92 @@
+/*
+*  Platform event ring
+*
+*  The window and its message pump live on a thread of their own, so a
+*  frame blocked on the GPU or on the swapchain never holds up window
+*  messages, and dispatching messages never delays a frame. The window
+*  procedure turns the messages the app cares about into events on this
+*  ring, and the render thread drains it once a frame, before it starts
+*  building the frame, so every change applies to a whole frame.
+*
+*  There is exactly one producer and one consumer, so neither side needs a
+*  lock or a compare exchange: each only ever writes its own index, and
+*  fills or empties the slot before publishing the index that hands it
+*  over. A full ring drops the event and counts it, the window thread
+*  never waits for the renderer. Quitting is a flag instead of an event so
+*  it can't be dropped.
+*/
+
+#define EVENT_RING_SIZE 256 // must be a power of two
+
+typedef enum
+{
+    PLATFORM_EVENT_KEY_DOWN
+    
+} PlatformEventType;
+
+typedef struct
+{
+    PlatformEventType type;
+    u32 key; // virtual-key code
+    
+} PlatformEvent;
+
+typedef struct
+{
+    PlatformEvent events[EVENT_RING_SIZE];
+    volatile LONG writeIndex; // only written by the window thread
+    volatile LONG readIndex; // only written by the render thread
+    
+    volatile LONG eventsDropped;
+    volatile LONG quitRequested;
+    
+} EventRing;
+
+// Window thread only
+bool
+event_ring_push(EventRing *ring, PlatformEvent *event)
+{
+    LONG write = ring->writeIndex;
+    LONG next = (write + 1) & (EVENT_RING_SIZE - 1);
+    
+    if (next == ring->readIndex)
+    {
+        InterlockedIncrement(&ring->eventsDropped);
+        return false;
+    }
+    
+    ring->events[write] = *event;
+    
+    // Make the event visible before publishing the new write index
+    MemoryBarrier();
+    ring->writeIndex = next;
+    
+    return true;
+}
+
+// Render thread only, false once the ring is empty
+bool
+event_ring_pop(EventRing *ring, PlatformEvent *event)
+{
+    LONG read = ring->readIndex;
+    if (read == ring->writeIndex)
+    {
+        return false;
+    }
+    
+    // Don't read the slot before the index that published it
+    MemoryBarrier();
+    *event = ring->events[read];
+    
+    // Done with the slot before the window thread may reuse it
+    MemoryBarrier();
+    ring->readIndex = (read + 1) & (EVENT_RING_SIZE - 1);
+    
+    return true;
+}
+
+void
+event_ring_request_quit(EventRing *ring)
+{
+    InterlockedExchange(&ring->quitRequested, 1);
+}
@@ -0,0 +1,138 @@
+/*
+*  GPU pipeline statistics
+*
+*  A VK_QUERY_TYPE_PIPELINE_STATISTICS query wraps the main render pass.
+*  Each frame uses the next slot of a small ring, and the slot is read back
+*  without waiting just before it gets reused, so the counters lag the
+*  frame being recorded by GPU_STATS_FRAMES frames but never stall it.
+*/
+
+#define GPU_STATS_FRAMES 3
+
+// Results come back in bit order of the statistic flags
+#define GPU_STATS_FLAGS \
+    (VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT)
+
+typedef struct
+{
+    u64 vertexInvocations;
+    u64 clippingPrimitives; // primitives that survived clipping
+    u64 fragmentInvocations;
+    u32 frameIndex; // the frame these were recorded in
+    
+} GpuFrameCounters;
+
+typedef struct
+{
+    bool enabled; // false if the device has no pipelineStatisticsQuery
+    VkQueryPool queryPool;
+    
+    u32 slotFrames[GPU_STATS_FRAMES]; // frame that last used each slot
+    bool slotPending[GPU_STATS_FRAMES];
+    u32 currentSlot;
+    
+    GpuFrameCounters latest;
+    
+} GpuStats;
+
+void
+gpu_stats_init(GpuStats *stats, VulkanContext *vk, bool supported)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = supported;
+    
+    if (!supported)
+    {
+        return;
+    }
+    
+    VkQueryPoolCreateInfo queryPoolInfo =
+    {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        NULL,
+        0,
+        VK_QUERY_TYPE_PIPELINE_STATISTICS,
+        GPU_STATS_FRAMES, // queryCount
+        GPU_STATS_FLAGS
+    };
+    
+    if (vkCreateQueryPool(vk->device, &queryPoolInfo, NULL,
+                          &stats->queryPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create pipeline statistics query pool");
+    }
+}
+
+/* Picks this frame's slot and collects whatever that slot measured last
+   time, if the GPU has finished with it. Call before recording. */
+void
+gpu_stats_new_frame(GpuStats *stats, VulkanContext *vk, u32 frameIndex)
+{
+    if (!stats->enabled)
+    {
+        return;
+    }
+    
+    u32 slot = frameIndex % GPU_STATS_FRAMES;
+    
+    if (stats->slotPending[slot])
+    {
+        // Three counters and the availability word
+        u64 results[4] = {0};
+        VkResult result =
+            vkGetQueryPoolResults(vk->device, stats->queryPool, slot, 1,
+                                  sizeof(results), results, sizeof(results),
+                                  VK_QUERY_RESULT_64_BIT |
+                                  VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        
+        // Not ready means the numbers are skipped, never waited for
+        if (result == VK_SUCCESS && results[3])
+        {
+            stats->latest.vertexInvocations = results[0];
+            stats->latest.clippingPrimitives = results[1];
+            stats->latest.fragmentInvocations = results[2];
+            stats->latest.frameIndex = stats->slotFrames[slot];
+        }
+        
+        stats->slotPending[slot] = false;
+    }
+    
+    stats->currentSlot = slot;
+    stats->slotFrames[slot] = frameIndex;
+}
+
+// Outside a render pass, queries can't be reset inside one
+void
+gpu_stats_begin(GpuStats *stats, VkCommandBuffer commandBuffer)
+{
+    if (!stats->enabled)
+    {
+        return;
+    }
+    
+    vkCmdResetQueryPool(commandBuffer, stats->queryPool, stats->currentSlot, 1);
+    vkCmdBeginQuery(commandBuffer, stats->queryPool, stats->currentSlot, 0);
+}
+
+void
+gpu_stats_end(GpuStats *stats, VkCommandBuffer commandBuffer)
+{
+    if (!stats->enabled)
+    {
+        return;
+    }
+    
+    vkCmdEndQuery(commandBuffer, stats->queryPool, stats->currentSlot);
+    stats->slotPending[stats->currentSlot] = true;
+}
+
+void
+gpu_stats_destroy(GpuStats *stats, VulkanContext *vk)
+{
+    if (stats->enabled)
+    {
+        vkDestroyQueryPool(vk->device, stats->queryPool, NULL);
+    }
+}
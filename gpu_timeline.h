@@ -0,0 +1,158 @@
+/*
+*  GPU timeline
+*
+*  One timeline semaphore orders everything submitted to the queue. Each
+*  submission, a frame or a batch of uploads, signals the next value of the
+*  timeline, so values only ever grow and a value names a point in the
+*  GPU's progress. Whatever a submission reads or writes is safe to reuse
+*  once the timeline reaches that submission's value, and resources keep
+*  the value they are waiting for. The CPU then waits for exactly that
+*  value instead of a fence or an idle queue.
+*
+*  The swapchain can only wait on and signal binary semaphores, so the
+*  frame's acquire and present semaphores stay binary and ride along in
+*  the same submission.
+*/
+
+void
+gpu_timeline_init(VulkanContext *vk)
+{
+    VkSemaphoreTypeCreateInfo typeInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        NULL,
+        VK_SEMAPHORE_TYPE_TIMELINE,
+        0 // initialValue
+    };
+    
+    VkSemaphoreCreateInfo semaphoreInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        &typeInfo,
+        0
+    };
+    
+    if (vkCreateSemaphore(vk->device, &semaphoreInfo, NULL,
+                          &vk->timeline) != VK_SUCCESS)
+    {
+        assert(!"Failed to create timeline semaphore");
+    }
+    
+    vk->timelineSubmitted = 0;
+    vk->timelineCompleted = 0;
+}
+
+/* Submits commandBuffer signalling the next timeline value and returns
+   it. waitSemaphore (at waitStage) and signalSemaphore are optional binary
+   semaphores, VK_NULL_HANDLE for none. */
+u64
+gpu_timeline_submit(VulkanContext *vk, VkCommandBuffer commandBuffer,
+                    VkSemaphore waitSemaphore, VkPipelineStageFlags2 waitStage,
+                    VkSemaphore signalSemaphore)
+{
+    u64 value = vk->timelineSubmitted + 1;
+    
+    VkSemaphoreSubmitInfo waitInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        NULL,
+        waitSemaphore,
+        0, // value (ignored for binary semaphores)
+        waitStage,
+        0 // deviceIndex
+    };
+    
+    VkSemaphoreSubmitInfo signalInfos[2] =
+    {
+        {
+            VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            NULL,
+            vk->timeline,
+            value,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            0 // deviceIndex
+        },
+        {
+            VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            NULL,
+            signalSemaphore,
+            0, // value (ignored for binary semaphores)
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            0 // deviceIndex
+        }
+    };
+    
+    VkCommandBufferSubmitInfo commandBufferInfo =
+    {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        NULL,
+        commandBuffer,
+        0 // deviceMask
+    };
+    
+    VkSubmitInfo2 submitInfo =
+    {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        NULL,
+        0, // flags
+        waitSemaphore ? 1 : 0, // waitSemaphoreInfoCount
+        &waitInfo,
+        1, // commandBufferInfoCount
+        &commandBufferInfo,
+        signalSemaphore ? 2 : 1, // signalSemaphoreInfoCount
+        signalInfos
+    };
+    
+    if (vkQueueSubmit2(vk->graphicsAndPresentQueue, 1, &submitInfo,
+                       VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        assert(!"Failed to submit command buffer");
+    }
+    
+    vk->timelineSubmitted = value;
+    return value;
+}
+
+// Never blocks, remembers the newest value seen so most calls are free
+bool
+gpu_timeline_reached(VulkanContext *vk, u64 value)
+{
+    if (value > vk->timelineCompleted)
+    {
+        u64 current;
+        vkGetSemaphoreCounterValue(vk->device, vk->timeline, &current);
+        vk->timelineCompleted = current;
+    }
+    
+    return value <= vk->timelineCompleted;
+}
+
+// Blocks until the GPU has finished the submission that signals value
+void
+gpu_timeline_wait(VulkanContext *vk, u64 value)
+{
+    if (gpu_timeline_reached(vk, value))
+    {
+        return;
+    }
+    
+    VkSemaphoreWaitInfo waitInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        NULL,
+        0, // flags
+        1, // semaphoreCount
+        &vk->timeline,
+        &value
+    };
+    
+    vkWaitSemaphores(vk->device, &waitInfo, UINT64_MAX);
+    vk->timelineCompleted = value;
+}
+
+// Everything submitted so far, the replacement for vkDeviceWaitIdle
+void
+gpu_timeline_wait_all(VulkanContext *vk)
+{
+    gpu_timeline_wait(vk, vk->timelineSubmitted);
+}
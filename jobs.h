@@ -0,0 +1,248 @@
+/*
+*  Job queue and parallel for
+*
+*  A fixed ring of jobs consumed by a pool of Win32 worker threads. Workers
+*  sleep on a semaphore when the ring is empty. Producers serialize on a slim
+*  reader/writer lock, consumers claim entries with a compare exchange. The
+*  thread that waits on a job always helps run queued jobs instead of idling.
+*/
+
+#define JOBS_MAX_THREADS 15
+#define JOBS_QUEUE_SIZE 256 // must be a power of two
+
+typedef void JobCallback(void *data);
+
+typedef struct
+{
+    JobCallback *callback;
+    void *data;
+    volatile LONG *doneCounter; // incremented after callback returns
+    
+} Job;
+
+typedef struct
+{
+    Job entries[JOBS_QUEUE_SIZE];
+    volatile LONG nextEntryToWrite;
+    volatile LONG nextEntryToRead;
+    
+    SRWLOCK writeLock;
+    HANDLE semaphore;
+    
+    HANDLE threads[JOBS_MAX_THREADS];
+    u32 threadCount;
+    
+} JobQueue;
+
+/* Runs one queued job if there is one. Returns false when the queue was
+   empty, so callers can decide whether to sleep or spin. */
+bool
+jobs_run_next(JobQueue *queue)
+{
+    LONG read = queue->nextEntryToRead;
+    if (read == queue->nextEntryToWrite)
+    {
+        return false;
+    }
+    
+    // Copy before claiming, a producer may reuse the slot right after
+    Job job = queue->entries[read];
+    
+    LONG next = (read + 1) & (JOBS_QUEUE_SIZE - 1);
+    if (InterlockedCompareExchange(&queue->nextEntryToRead, next, read) == read)
+    {
+        job.callback(job.data);
+        
+        if (job.doneCounter)
+        {
+            InterlockedIncrement(job.doneCounter);
+        }
+    }
+    
+    return true;
+}
+
+DWORD WINAPI
+jobs_worker_thread(LPVOID parameter)
+{
+    JobQueue *queue = (JobQueue *)parameter;
+    
+    for (;;)
+    {
+        if (!jobs_run_next(queue))
+        {
+            WaitForSingleObjectEx(queue->semaphore, INFINITE, FALSE);
+        }
+    }
+}
+
+void
+jobs_init(JobQueue *queue, u32 threadCount)
+{
+    if (threadCount > JOBS_MAX_THREADS)
+    {
+        threadCount = JOBS_MAX_THREADS;
+    }
+    
+    InitializeSRWLock(&queue->writeLock);
+    queue->semaphore = CreateSemaphoreEx(NULL, 0, threadCount + 1, NULL, 0,
+                                         SEMAPHORE_ALL_ACCESS);
+    assert(queue->semaphore);
+    
+    queue->threadCount = threadCount;
+    for (u32 i = 0; i < threadCount; i++)
+    {
+        queue->threads[i] = CreateThread(NULL, 0, jobs_worker_thread, queue,
+                                         0, NULL);
+        assert(queue->threads[i]);
+    }
+}
+
+// One worker per logical core, minus the calling thread
+u32
+jobs_default_thread_count(void)
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    
+    return systemInfo.dwNumberOfProcessors > 1 ?
+        systemInfo.dwNumberOfProcessors - 1 : 0;
+}
+
+// Safe to call from any thread, including from inside a running job
+void
+jobs_push(JobQueue *queue, JobCallback *callback, void *data,
+          volatile LONG *doneCounter)
+{
+    AcquireSRWLockExclusive(&queue->writeLock);
+    
+    LONG write = queue->nextEntryToWrite;
+    LONG next = (write + 1) & (JOBS_QUEUE_SIZE - 1);
+    
+    // Run jobs ourselves while the ring is full
+    while (next == queue->nextEntryToRead)
+    {
+        ReleaseSRWLockExclusive(&queue->writeLock);
+        jobs_run_next(queue);
+        AcquireSRWLockExclusive(&queue->writeLock);
+        
+        write = queue->nextEntryToWrite;
+        next = (write + 1) & (JOBS_QUEUE_SIZE - 1);
+    }
+    
+    Job job = { callback, data, doneCounter };
+    queue->entries[write] = job;
+    
+    // Make the entry visible before publishing the new write index
+    MemoryBarrier();
+    queue->nextEntryToWrite = next;
+    
+    ReleaseSRWLockExclusive(&queue->writeLock);
+    
+    ReleaseSemaphore(queue->semaphore, 1, NULL);
+}
+
+// Helps with queued work until *doneCounter reaches target
+void
+jobs_wait(JobQueue *queue, volatile LONG *doneCounter, LONG target)
+{
+    while (*doneCounter < target)
+    {
+        if (!jobs_run_next(queue))
+        {
+            YieldProcessor();
+        }
+    }
+}
+
+/*
+*  Parallel for
+*/
+
+typedef void ParallelForCallback(void *userData, u32 first, u32 count,
+                                 u32 chunkIndex);
+
+typedef struct
+{
+    ParallelForCallback *callback;
+    void *userData;
+    u32 itemCount;
+    u32 chunkSize;
+    u32 chunkCount;
+    volatile LONG nextChunk;
+    
+} ParallelFor;
+
+void
+jobs_parallel_for_worker(void *data)
+{
+    ParallelFor *work = (ParallelFor *)data;
+    
+    // Keep claiming chunks until none are left
+    for (;;)
+    {
+        u32 chunk = (u32)InterlockedIncrement(&work->nextChunk) - 1;
+        if (chunk >= work->chunkCount)
+        {
+            break;
+        }
+        
+        u32 first = chunk * work->chunkSize;
+        u32 count = work->itemCount - first;
+        if (count > work->chunkSize)
+        {
+            count = work->chunkSize;
+        }
+        
+        work->callback(work->userData, first, count, chunk);
+    }
+}
+
+u32
+jobs_chunk_count(u32 itemCount, u32 chunkSize)
+{
+    return (itemCount + chunkSize - 1) / chunkSize;
+}
+
+/* Splits [0, itemCount) into chunks of chunkSize items and runs callback on
+   each one, in parallel, returning once all chunks are done. The calling
+   thread takes part, so a NULL queue simply runs everything inline. */
+void
+jobs_parallel_for(JobQueue *queue, u32 itemCount, u32 chunkSize,
+                  ParallelForCallback *callback, void *userData)
+{
+    ParallelFor work =
+    {
+        callback,
+        userData,
+        itemCount,
+        chunkSize,
+        jobs_chunk_count(itemCount, chunkSize),
+        0 // nextChunk
+    };
+    
+    if (work.chunkCount == 0)
+    {
+        return;
+    }
+    
+    // One helper job per worker at most, they share the chunk counter
+    u32 helperCount = queue ? queue->threadCount : 0;
+    if (helperCount > work.chunkCount - 1)
+    {
+        helperCount = work.chunkCount - 1;
+    }
+    
+    volatile LONG helpersDone = 0;
+    for (u32 i = 0; i < helperCount; i++)
+    {
+        jobs_push(queue, jobs_parallel_for_worker, &work, &helpersDone);
+    }
+    
+    jobs_parallel_for_worker(&work);
+    
+    if (helperCount)
+    {
+        jobs_wait(queue, &helpersDone, (LONG)helperCount);
+    }
+}
@@ -7,26 +7,41 @@
 #include <vulkan\vulkan_win32.h>
 
 #include <assert.h>
+#include <float.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t s16;
 typedef int32_t s32;
 
 typedef float f32;
 
 #define array_count(array) (sizeof(array) / sizeof((array)[0]))
 
+#include "simd_math.h"
+#include "jobs.h"
+#include "startup.h"
+#include "cull.h"
+
 /*
 *  VulkanContext struct
 */
 
+typedef struct DestroyQueue DestroyQueue;
+typedef struct UploadQueue UploadQueue;
+
 typedef struct
 {
     HWND window;
     VkInstance instance;
+    VkDebugUtilsMessengerEXT debugMessenger;
     VkSurfaceKHR surface;
     VkPhysicalDevice physicalDevice;
     VkDevice device;
@@ -40,8 +55,198 @@ typedef struct
     
     VkCommandPool graphicsCommandPool;
     
+    VkSemaphore timeline; // signalled by every submission, see gpu_timeline.h
+    u64 timelineSubmitted; // value of the last submission
+    u64 timelineCompleted; // newest value the GPU was seen to reach
+    
+    DestroyQueue *destroyQueue; // see destroy_queue.h
+    UploadQueue *uploadQueue; // see upload_queue.h, any thread may push
+    
+    bool extendedDynamicState; // cull mode, front face, ... set per draw
+    bool pipelineStatisticsQuery;
+    bool swapchainReadable; // created with TRANSFER_SRC, can be copied from
+    bool memoryBudget; // VK_EXT_memory_budget, live heap budgets and usage
+    
 } VulkanContext;
 
+/*
+*  GPU timeline
+*/
+
+#include "gpu_timeline.h"
+
+/*
+*  Deferred destruction
+*/
+
+#include "destroy_queue.h"
+
+/*
+*  Compact vertex formats
+*/
+
+#include "vertex_format.h"
+
+/*
+*  Push Constants (per-draw data read by shader.vert)
+*/
+
+typedef struct
+{
+    f32 transform[4]; // row-major 2x2 (rotation and scale)
+    f32 offset[2]; // translation in pixels
+    f32 depth; // 0 (near) to 1 (far), only tested in the depth pass
+    f32 padding; // keeps tint on a 16 byte boundary (std430)
+    f32 tint[4]; // RGBA color multiplier
+    
+} PushConstants;
+
+PushConstants
+push_constants_make(f32 x, f32 y, f32 scale, f32 rotation,
+                    f32 r, f32 g, f32 b, f32 a)
+{
+    Affine2D t = affine2d_make(x, y, scale, rotation);
+    
+    PushConstants result =
+    {
+        { t.m00, t.m01,
+          t.m10, t.m11 },
+        { t.tx, t.ty },
+        0, // depth
+        0, // padding
+        { r, g, b, a }
+    };
+    
+    return result;
+}
+
+/*
+*  Draw queue and its state table slots
+*/
+
+#include "draw_queue.h"
+
+enum
+{
+    PIPELINE_SPRITE, // alpha blended, no depth attachment
+    PIPELINE_SPRITE_OPAQUE, // depth tested and written, no blending
+    PIPELINE_SPRITE_TRANSPARENT, // depth tested, alpha blended
+    PIPELINE_TEXT, // sdf.frag, alpha blended, no depth attachment
+    PIPELINE_TEXT_TRANSPARENT, // sdf.frag in the depth pass
+    PIPELINE_SCENE, // PIPELINE_SPRITE with the sprite scene's vertex layout
+    PIPELINE_SCENE_OPAQUE, // PIPELINE_SPRITE_OPAQUE with it
+    PIPELINE_SCENE_TRANSPARENT, // PIPELINE_SPRITE_TRANSPARENT with it
+    PIPELINE_SPRITE_PULL, // PIPELINE_SPRITE with pull.vert
+    PIPELINE_SPRITE_PULL_OPAQUE, // PIPELINE_SPRITE_OPAQUE with pull.vert
+    PIPELINE_SPRITE_PULL_TRANSPARENT, // and PIPELINE_SPRITE_TRANSPARENT
+    
+    // The same pipelines with overdraw.frag and additive blending,
+    // at PIPELINE_OVERDRAW + each of the above
+    PIPELINE_OVERDRAW
+};
+
+// Layers without depth, in painter's order
+enum
+{
+    LAYER_TILES,
+    LAYER_SPRITES,
+    LAYER_PANELS,
+    LAYER_QUADS,
+    LAYER_TEXT
+};
+
+// Layers of the depth pass, opaque draws first
+enum
+{
+    LAYER_OPAQUE,
+    LAYER_TRANSPARENT
+};
+
+enum
+{
+    DESC_SET_TEXTURE,
+    DESC_SET_TEXT, // the glyph atlas instead of the texture
+    DESC_SET_PANEL_FIRST // one per streamed panel texture from here on
+};
+
+enum
+{
+    VERTEX_BUFFER_QUAD,
+    VERTEX_BUFFER_SPRITE_BATCH,
+    VERTEX_BUFFER_SPRITE_SCENE,
+    VERTEX_BUFFER_TILEMAP,
+    
+    // Read by pull.vert as a storage buffer, never bound, the slot only
+    // names it for captured uploads
+    VERTEX_BUFFER_SPRITE_RECORDS
+};
+
+// Sprites the edit demo changes every frame
+#define SELECTION_SIZE 256 // consecutive
+#define SELECTION_STRAYS 16 // anywhere
+
+// Panels along the world with streamed textures, pulsing in size
+#define PANEL_COUNT 32
+#define PANEL_TEXTURE_SIZE 512
+
+// Whether every texel is at full alpha, which draws need to skip blending
+bool
+texels_opaque(u32 *texels, u32 count)
+{
+    for (u32 i = 0; i < count; i++)
+    {
+        if ((texels[i] >> 24) != 0xFF)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/* Queues a draw of the depth pass. Only draws whose texture and tint are
+   both opaque go unblended into the opaque layer, translucent texels there
+   would hide what is behind them and reject it by depth too. The others
+   are blended, back to front. */
+void
+draw_queue_push_depth_pass(DrawQueue *queue, bool *opaqueTextures,
+                           u32 opaquePipeline, u32 transparentPipeline,
+                           f32 depth, DrawCommand *command)
+{
+    if (opaqueTextures[command->descriptorSet] &&
+        command->pushConstants.tint[3] >= 1.0f)
+    {
+        command->pipeline = opaquePipeline;
+        draw_queue_push(queue, LAYER_OPAQUE, depth, false, command);
+    }
+    else
+    {
+        command->pipeline = transparentPipeline;
+        draw_queue_push(queue, LAYER_TRANSPARENT, depth, true, command);
+    }
+}
+
+/*
+*  GPU culling data (read by cull.comp)
+*/
+
+// One indirect draw per object, turned into a VkDrawIndirectCommand on GPU
+typedef struct
+{
+    u32 firstVertex;
+    u32 vertexCount;
+    
+} DrawRecord;
+
+typedef struct
+{
+    f32 view[4]; // minX, minY, maxX, maxY in world pixels
+    u32 objectCount;
+    
+} CullConstants;
+
+#define CULL_WORKGROUP_SIZE 64 // local_size_x in cull.comp
+
 /*
 *  File loading utility
 */
@@ -79,11 +284,114 @@ load_entire_file(char *fileName)
     return result;
 }
 
+/*
+*  Embedded SPIR-V
+*/
+
+#include "shader_registry.h"
+
+/*
+*  Command line utility
+*/
+
+/* Finds the space separated word name in cmdLine. If value is not NULL the
+   word after it is copied there (no quoting, so no spaces in values). */
+bool
+command_line_option(char *cmdLine, char *name, char *value, u32 valueSize)
+{
+    size_t nameLength = strlen(name);
+    char *at = cmdLine;
+    
+    while (*at)
+    {
+        while (*at == ' ')
+        {
+            at++;
+        }
+        
+        char *word = at;
+        while (*at && *at != ' ')
+        {
+            at++;
+        }
+        
+        if ((size_t)(at - word) == nameLength &&
+            strncmp(word, name, nameLength) == 0)
+        {
+            if (!value)
+            {
+                return true;
+            }
+            
+            while (*at == ' ')
+            {
+                at++;
+            }
+            
+            u32 length = 0;
+            while (at[length] && at[length] != ' ' && length + 1 < valueSize)
+            {
+                value[length] = at[length];
+                length++;
+            }
+            value[length] = 0;
+            
+            return length > 0;
+        }
+    }
+    
+    return false;
+}
+
+/*
+*  Random number utility (xorshift32)
+*/
+
+u32
+random_next(u32 *state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    
+    return x;
+}
+
+f32
+random_range(u32 *state, f32 min, f32 max)
+{
+    f32 t = (f32)(random_next(state) >> 8) / (f32)(1 << 24);
+    return min + (max - min) * t;
+}
+
+/*
+*  Platform event ring
+*/
+
+#include "event_ring.h"
+
+/*
+*  Fixed-timestep simulation
+*/
+
+#include "simulation.h"
+
 /*
 *  globalRunning and WindowProc
 */
 
+// Filled by the window thread, drained by the render thread once a frame
+static EventRing globalEvents;
+
+// Everything below is only touched by the render thread
 static bool globalRunning;
+static bool globalGpuCulling = true; // toggled with the G key
+static bool globalDepthPass = true; // toggled with the D key
+static bool globalOverdraw; // toggled with the O key
+static bool globalSpriteLabels; // toggled with the T key
+static bool globalVertexPulling = true; // toggled with the P key
 
 LRESULT CALLBACK
 vulkan_window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
@@ -100,10 +408,16 @@ vulkan_window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
             OutputDebugString("Window resized\n");
         } break;
         
+        case WM_KEYDOWN:
+        {
+            PlatformEvent event = { PLATFORM_EVENT_KEY_DOWN, (u32)wparam };
+            event_ring_push(&globalEvents, &event);
+        } break;
+        
         case WM_CLOSE:
         case WM_DESTROY:
         {
-            globalRunning = false;
+            event_ring_request_quit(&globalEvents);
         } break;
         
         default:
@@ -115,6 +429,148 @@ vulkan_window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
     return 0;
 }
 
+// Render thread, applies a key press taken off globalEvents
+void
+handle_key_down(u32 key)
+{
+    if (key == 'G')
+    {
+        globalGpuCulling = !globalGpuCulling;
+        OutputDebugString(globalGpuCulling ?
+                          "Sprite culling: GPU (indirect count)\n" :
+                          "Sprite culling: CPU\n");
+    }
+    else if (key == 'D')
+    {
+        globalDepthPass = !globalDepthPass;
+        OutputDebugString(globalDepthPass ?
+                          "Depth pass: on (opaque front-to-back)\n" :
+                          "Depth pass: off (painter's order)\n");
+    }
+    else if (key == 'O')
+    {
+        globalOverdraw = !globalOverdraw;
+        OutputDebugString(globalOverdraw ?
+                          "Overdraw view: on\n" :
+                          "Overdraw view: off\n");
+    }
+    else if (key == 'T')
+    {
+        globalSpriteLabels = !globalSpriteLabels;
+    }
+    else if (key == 'P')
+    {
+        globalVertexPulling = !globalVertexPulling;
+        OutputDebugString(globalVertexPulling ?
+                          "CPU sprite batch: records (pull.vert)\n" :
+                          "CPU sprite batch: vertices\n");
+    }
+}
+
+/*
+*  Window thread
+*/
+
+typedef struct
+{
+    HINSTANCE instance;
+    s32 x, y;
+    u32 width, height; // of the client area
+    char *title;
+    
+    HWND window;
+    HANDLE created; // signalled once window is set
+    
+} WindowThreadParams;
+
+HWND
+win32_create_window(HINSTANCE instance, s32 windowX, s32 windowY,
+                    u32 windowWidth, u32 windowHeight, char *windowTitle)
+{
+    // Register window class
+    WNDCLASSEX winClass =
+    {
+        sizeof(WNDCLASSEX),
+        0, // style
+        vulkan_window_proc, // window procedure
+        0, // cbClsExtra
+        0, // cbWndExtra
+        instance, // hInstance
+        NULL, // hIcon
+        NULL, // hCursor
+        NULL, // hbrBackground
+        NULL, // lpszMenuName
+        "MyUniqueVulkanWindowClassName",
+        NULL, // hIconSm
+    };
+    
+    if (!RegisterClassEx(&winClass))
+    {
+        assert(!"Failed to register window class");
+    }
+    
+    // Make sure the window is not resizable for simplicity
+    DWORD windowStyle = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX;
+    
+    RECT windowRect =
+    {
+        windowX, // left
+        windowY, // top
+        windowX + windowWidth, // right
+        windowY + windowHeight, // bottom
+    };
+    
+    AdjustWindowRect(&windowRect, windowStyle, 0);
+    
+    windowWidth = windowRect.right - windowRect.left;
+    windowHeight = windowRect.bottom - windowRect.top;
+    windowX = windowRect.left;
+    windowY = windowRect.top;
+    
+    // Create window
+    HWND window = CreateWindowEx(0, // Extended style
+                                 winClass.lpszClassName,
+                                 windowTitle,
+                                 windowStyle,
+                                 windowX, windowY, windowWidth, windowHeight,
+                                 NULL, NULL, instance, NULL);
+    
+    if (!window)
+    {
+        assert(!"Failed to create window");
+    }
+    
+    ShowWindow(window, SW_SHOW);
+    
+    return window;
+}
+
+/* Creates the window and pumps its messages until WM_QUIT, which the
+   render thread posts once it is done with the window. Messages go to the
+   thread that created the window, so both have to happen here. */
+DWORD WINAPI
+win32_window_thread(LPVOID parameter)
+{
+    WindowThreadParams *params = (WindowThreadParams *)parameter;
+    
+    params->window = win32_create_window(params->instance,
+                                         params->x, params->y,
+                                         params->width, params->height,
+                                         params->title);
+    SetEvent(params->created);
+    
+    // Blocks while there is nothing to do, unlike the render loop
+    MSG message;
+    while (GetMessage(&message, NULL, 0, 0) > 0)
+    {
+        TranslateMessage(&message);
+        DispatchMessage(&message);
+    }
+    
+    DestroyWindow(params->window);
+    return 0;
+}
+
 /*
 *  Vulkan Validation layer's Debug Callback
 */
@@ -138,7 +594,8 @@ vulkan_debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 */
 
 VkImageView
-vk_create_image_view(VulkanContext *vk, VkImage image, VkFormat format)
+vk_create_image_view(VulkanContext *vk, VkImage image, VkFormat format,
+                     VkImageAspectFlags aspect)
 {
     VkImageView imageView;
     
@@ -152,7 +609,7 @@ vk_create_image_view(VulkanContext *vk, VkImage image, VkFormat format)
     
     VkImageSubresourceRange subRange =
     {
-        VK_IMAGE_ASPECT_COLOR_BIT,
+        aspect,
         0, // baseMipLevel
         1, // levelCount
         0, // baseArrayLayer
@@ -185,69 +642,10 @@ vk_create_image_view(VulkanContext *vk, VkImage image, VkFormat format)
 */
 
 VulkanContext
-win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
-                  u32 windowHeight, char *windowTitle)
+win32_init_vulkan(HINSTANCE instance, HWND window, bool uncappedPresent)
 {
     VulkanContext vk = {NULL};
-    
-    /*
-    *  Create window
-    */
-    
-    // Register window class
-    WNDCLASSEX winClass =
-    {
-        sizeof(WNDCLASSEX),
-        0, // style
-        vulkan_window_proc, // window procedure
-        0, // cbClsExtra
-        0, // cbWndExtra
-        instance, // hInstance
-        NULL, // hIcon
-        NULL, // hCursor
-        NULL, // hbrBackground
-        NULL, // lpszMenuName
-        "MyUniqueVulkanWindowClassName",
-        NULL, // hIconSm
-    };
-    
-    if (!RegisterClassEx(&winClass))
-    {
-        assert(!"Failed to register window class");
-    }
-    
-    // Make sure the window is not resizable for simplicity
-    DWORD windowStyle = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX;
-    
-    RECT windowRect =
-    {
-        windowX, // left
-        windowY, // top
-        windowX + windowWidth, // right
-        windowY + windowHeight, // bottom
-    };
-    
-    AdjustWindowRect(&windowRect, windowStyle, 0);
-    
-    windowWidth = windowRect.right - windowRect.left;
-    windowHeight = windowRect.bottom - windowRect.top;
-    windowX = windowRect.left;
-    windowY = windowRect.top;
-    
-    // Create window
-    vk.window = CreateWindowEx(0, // Extended style
-                               winClass.lpszClassName,
-                               windowTitle,
-                               windowStyle,
-                               windowX, windowY, windowWidth, windowHeight,
-                               NULL, NULL, instance, NULL);
-    
-    if (!vk.window)
-    {
-        assert(!"Failed to create window");
-    }
-    
-    ShowWindow(vk.window, SW_SHOW);
+    vk.window = window;
     
     /*
     *  Set up enabled layers and extensions
@@ -353,9 +751,8 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
     (PFN_vkCreateDebugUtilsMessengerEXT)
         vkGetInstanceProcAddr(vk.instance, "vkCreateDebugUtilsMessengerEXT");
     
-    VkDebugUtilsMessengerEXT debugMessenger;
     if (vkCreateDebugUtilsMessengerEXT(vk.instance, &debugCreateInfo, NULL,
-                                       &debugMessenger) != VK_SUCCESS)
+                                       &vk.debugMessenger) != VK_SUCCESS)
     {
         assert(!"Failed to create debug messenger!");
     }
@@ -454,19 +851,96 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
     
     VkDeviceQueueCreateInfo queueCreateInfos[] = {queueCreateInfo};
     
-    // Enable required device extensions (swapchain)
-    char *deviceExtensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    // Enable required device extensions (swapchain), then optional ones
+    char *deviceExtensions[2] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    u32 deviceExtensionCount = 1;
+    
+    u32 availableExtensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(vk.physicalDevice, NULL,
+                                         &availableExtensionCount, NULL);
+    
+    VkExtensionProperties *availableExtensions = (VkExtensionProperties *)
+        malloc(availableExtensionCount * sizeof(VkExtensionProperties));
+    vkEnumerateDeviceExtensionProperties(vk.physicalDevice, NULL,
+                                         &availableExtensionCount,
+                                         availableExtensions);
+    
+    // Texture streaming sizes its budget from the heap's live budget
+    for (u32 i = 0; i < availableExtensionCount; i++)
+    {
+        if (strcmp(availableExtensions[i].extensionName,
+                   VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0)
+        {
+            deviceExtensions[deviceExtensionCount++] =
+                VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+            vk.memoryBudget = true;
+        }
+    }
+    free(availableExtensions);
+    
+    /*
+    *  Check and enable device features
+    */
+    
+    VkPhysicalDeviceVulkan13Features supported13 = {0};
+    supported13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    
+    VkPhysicalDeviceVulkan12Features supported12 = {0};
+    supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    supported12.pNext = &supported13;
+    
+    VkPhysicalDeviceFeatures2 supportedFeatures = {0};
+    supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures.pNext = &supported12;
+    
+    vkGetPhysicalDeviceFeatures2(vk.physicalDevice, &supportedFeatures);
+    
+    // GPU-driven culling writes many draws and their count from a shader
+    assert(supportedFeatures.features.multiDrawIndirect);
+    assert(supported12.drawIndirectCount);
+    
+    // The render graph records its barriers with vkCmdPipelineBarrier2
+    assert(supported13.synchronization2);
+    
+    // Every submission signals one timeline semaphore
+    assert(supported12.timelineSemaphore);
+    
+    // Core since Vulkan 1.3, lets pipelines leave raster state dynamic
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(vk.physicalDevice, &deviceProperties);
+    vk.extendedDynamicState = deviceProperties.apiVersion >= VK_API_VERSION_1_3;
+    
+    VkPhysicalDeviceVulkan13Features enabled13 = {0};
+    enabled13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    enabled13.synchronization2 = VK_TRUE;
+    
+    VkPhysicalDeviceVulkan12Features enabled12 = {0};
+    enabled12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    enabled12.pNext = &enabled13;
+    enabled12.drawIndirectCount = VK_TRUE;
+    enabled12.timelineSemaphore = VK_TRUE;
+    
+    VkPhysicalDeviceFeatures2 enabledFeatures = {0};
+    enabledFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    enabledFeatures.pNext = &enabled12;
+    enabledFeatures.features.multiDrawIndirect = VK_TRUE;
+    
+    // Optional, only used for the per-frame GPU counters
+    vk.pipelineStatisticsQuery =
+        supportedFeatures.features.pipelineStatisticsQuery == VK_TRUE;
+    enabledFeatures.features.pipelineStatisticsQuery =
+        supportedFeatures.features.pipelineStatisticsQuery;
     
     VkDeviceCreateInfo deviceCreateInfo =
     {
         VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        NULL,
+        &enabledFeatures, // features are chained instead of pEnabledFeatures
         0,
         array_count(queueCreateInfos),
         queueCreateInfos,
         0, // enabledLayerCount deprecated
         NULL, // ppEnabledLayerNames deprecated
-        array_count(deviceExtensions),
+        deviceExtensionCount,
         deviceExtensions,
         NULL // pEnabledFeatures
     };
@@ -486,6 +960,11 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
                      &vk.graphicsAndPresentQueue);
     assert(vk.graphicsAndPresentQueue);
     
+    gpu_timeline_init(&vk);
+    
+    vk.destroyQueue = (DestroyQueue *)calloc(1, sizeof(DestroyQueue));
+    assert(vk.destroyQueue);
+    
     /*
     *  Create swapchain 
     */
@@ -499,6 +978,45 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
     vk.swapchainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
     vk.swapchainExtents = surfaceCapabilities.currentExtent;
     
+    // FIFO (vsync) is always there, uncapped asks for IMMEDIATE if possible
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    if (uncappedPresent)
+    {
+        u32 presentModeCount = 0;
+        vkGetPhysicalDeviceSurfacePresentModesKHR(vk.physicalDevice,
+                                                  vk.surface,
+                                                  &presentModeCount, NULL);
+        
+        VkPresentModeKHR presentModes[8];
+        if (presentModeCount > array_count(presentModes))
+        {
+            presentModeCount = array_count(presentModes);
+        }
+        vkGetPhysicalDeviceSurfacePresentModesKHR(vk.physicalDevice,
+                                                  vk.surface,
+                                                  &presentModeCount,
+                                                  presentModes);
+        
+        for (u32 i = 0; i < presentModeCount; i++)
+        {
+            if (presentModes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR ||
+                (presentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR &&
+                 presentMode == VK_PRESENT_MODE_FIFO_KHR))
+            {
+                presentMode = presentModes[i];
+            }
+        }
+    }
+    
+    // Copied from when frames are exported, if the surface allows it
+    VkImageUsageFlags imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (surfaceCapabilities.supportedUsageFlags &
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
+    {
+        imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        vk.swapchainReadable = true;
+    }
+    
     VkSwapchainCreateInfoKHR swapchainCreateInfo =
     {
         VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
@@ -510,13 +1028,13 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
         VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, // imageColorSpace
         vk.swapchainExtents, // imageExtent
         1, // imageArrayLayers
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, // imageUsage
+        imageUsage,
         VK_SHARING_MODE_EXCLUSIVE,
         0, // queueFamilyIndexCount
         NULL, // pQueueFamilyIndices
         surfaceCapabilities.currentTransform, // preTransform
         VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-        VK_PRESENT_MODE_FIFO_KHR,
+        presentMode,
         VK_TRUE, // clipped
         NULL // oldSwapchain
     };
@@ -545,7 +1063,8 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
         
         vk.swapchainImageViews[i] =
             vk_create_image_view(&vk, vk.swapchainImages[i],
-                                 vk.swapchainImageFormat);
+                                 vk.swapchainImageFormat,
+                                 VK_IMAGE_ASPECT_COLOR_BIT);
         
         assert(vk.swapchainImageViews[i]);
     }
@@ -557,9 +1076,10 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
 *  Find Memory Type function
 */
 
+// Returns UINT32_MAX when no allowed type has all of memPropFlags
 u32
-vk_find_memory_type(VulkanContext *vk, u32 typeFilter,
-                    VkMemoryPropertyFlags memPropFlags)
+vk_try_find_memory_type(VulkanContext *vk, u32 typeFilter,
+                        VkMemoryPropertyFlags memPropFlags)
 {
     VkPhysicalDeviceMemoryProperties memProperties = { 0 };
     vkGetPhysicalDeviceMemoryProperties(vk->physicalDevice, &memProperties);
@@ -580,6 +1100,15 @@ vk_find_memory_type(VulkanContext *vk, u32 typeFilter,
         }
     }
     
+    return memoryTypeIndex;
+}
+
+u32
+vk_find_memory_type(VulkanContext *vk, u32 typeFilter,
+                    VkMemoryPropertyFlags memPropFlags)
+{
+    u32 memoryTypeIndex = vk_try_find_memory_type(vk, typeFilter,
+                                                  memPropFlags);
     assert(memoryTypeIndex != UINT32_MAX);
     
     return memoryTypeIndex;
@@ -635,6 +1164,82 @@ vk_create_buffer(VulkanContext *vk, VkDeviceSize size,
     vkBindBufferMemory(vk->device, *buffer, *bufferMemory, 0);
 }
 
+/*
+*  Create Image function (device local, single mip and layer)
+*/
+
+void
+vk_create_image(VulkanContext *vk, VkExtent2D extent, VkFormat format,
+                VkImageUsageFlags usage,
+                VkImage *image, VkDeviceMemory *imageMemory)
+{
+    VkImageCreateInfo imageInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_IMAGE_TYPE_2D,
+        format,
+        { extent.width, extent.height, 1 },
+        1, // mipLevels
+        1, // arrayLayers
+        VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_TILING_OPTIMAL,
+        usage,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL, // queue families ignored
+        VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    if (vkCreateImage(vk->device, &imageInfo, NULL, image) != VK_SUCCESS)
+    {
+        assert(!"Failed to create image");
+    }
+    
+    VkMemoryRequirements memRequirements;
+    vkGetImageMemoryRequirements(vk->device, *image, &memRequirements);
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        memRequirements.size,
+        vk_find_memory_type(vk, memRequirements.memoryTypeBits,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         imageMemory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate image memory!");
+    }
+    
+    vkBindImageMemory(vk->device, *image, *imageMemory, 0);
+}
+
+// D16 is always supported as a depth attachment, D32 usually is too
+VkFormat
+vk_find_depth_format(VulkanContext *vk)
+{
+    VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM };
+    
+    for (u32 i = 0; i < array_count(candidates); i++)
+    {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(vk->physicalDevice, candidates[i],
+                                            &properties);
+        
+        if (properties.optimalTilingFeatures &
+            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+        {
+            return candidates[i];
+        }
+    }
+    
+    assert(!"No supported depth format");
+    return VK_FORMAT_UNDEFINED;
+}
+
 /*
 *  Helper functions for single time use command buffers
 */
@@ -669,24 +1274,106 @@ vk_begin_single_time_commands(VulkanContext *vk)
     return commandBuffer;
 }
 
+/* Submits without waiting and returns the batch's timeline value, the
+   command buffer is freed once the GPU is done with it. What the batch
+   writes is visible to everything submitted after it. */
+u64
+vk_submit_single_time_commands(VulkanContext *vk,
+                               VkCommandBuffer commandBuffer)
+{
+    VkMemoryBarrier2 barrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        NULL,
+        VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, // srcStageMask
+        VK_ACCESS_2_MEMORY_WRITE_BIT, // srcAccessMask
+        VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, // dstStageMask
+        VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT
+    };
+    
+    VkDependencyInfo dependencyInfo =
+    {
+        VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        NULL,
+        0, // dependencyFlags
+        1, &barrier,
+        0, NULL, // no buffer barriers
+        0, NULL // no image barriers
+    };
+    
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+    
+    vkEndCommandBuffer(commandBuffer);
+    
+    u64 value = gpu_timeline_submit(vk, commandBuffer, VK_NULL_HANDLE, 0,
+                                    VK_NULL_HANDLE);
+    
+    // TODO: change to transfer command pool
+    destroy_queue_command_buffer(vk, commandBuffer, value);
+    
+    return value;
+}
+
+// Waits for this batch only, not for whatever else is on the queue
 void
 vk_end_single_time_commands(VulkanContext *vk, VkCommandBuffer commandBuffer)
 {
-    vkEndCommandBuffer(commandBuffer);
+    u64 value = vk_submit_single_time_commands(vk, commandBuffer);
+    gpu_timeline_wait(vk, value);
+}
+
+
+/*
+*  Fill (part of) a device local buffer through a staging buffer
+*/
+
+/* Doesn't wait for the copy, the staging buffer is destroyed once it is
+   done. The buffer needs VK_BUFFER_USAGE_TRANSFER_DST_BIT. */
+void
+vk_upload_to_buffer(VulkanContext *vk, VkBuffer buffer, VkDeviceSize offset,
+                    void *data, VkDeviceSize size)
+{
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    
+    vk_create_buffer(vk, size,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &stagingBuffer, &stagingBufferMemory);
     
-    VkSubmitInfo submitInfo = {0};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+    void *mapped;
+    vkMapMemory(vk->device, stagingBufferMemory, 0, size, 0, &mapped);
+    memcpy(mapped, data, size);
+    vkUnmapMemory(vk->device, stagingBufferMemory);
     
-    vkQueueSubmit(vk->graphicsAndPresentQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(vk->graphicsAndPresentQueue); // Wait for execution to finish
+    VkCommandBuffer commandBuffer = vk_begin_single_time_commands(vk);
     
-    // TODO: change to transfer command pool
-    vkFreeCommandBuffers(vk->device, vk->graphicsCommandPool, 1,
-                         &commandBuffer);
+    VkBufferCopy copyRegion = { 0, offset, size };
+    vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffer, 1, &copyRegion);
+    
+    u64 value = vk_submit_single_time_commands(vk, commandBuffer);
+    destroy_queue_buffer(vk, stagingBuffer, stagingBufferMemory, value);
+}
+
+void
+vk_create_device_local_buffer(VulkanContext *vk, VkDeviceSize size,
+                              VkBufferUsageFlags usage, void *data,
+                              VkBuffer *buffer, VkDeviceMemory *bufferMemory)
+{
+    vk_create_buffer(vk, size,
+                     usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     buffer, bufferMemory);
+    
+    vk_upload_to_buffer(vk, *buffer, 0, data, size);
 }
 
+/*
+*  Upload request queue
+*/
+
+#include "upload_queue.h"
 
 /*
 *  Create shader module function
@@ -716,105 +1403,913 @@ vk_create_shader_module(VulkanContext *vk, void *code, size_t size)
 }
 
 /*
-*  WinMain application entry point
+*  Sprite batching
 */
 
-int CALLBACK
-WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
+typedef struct
 {
-    u32 winWidth = 800;
-    u32 winHeight = 600;
-    
-    VulkanContext vk = win32_init_vulkan(instance,
-                                         100, 100, winWidth, winHeight,
-                                         "My Shiny Vulkan Window");
-    
-    /*
-    *  App-specific Vulkan objects
-    */
-    
-    VkRenderPass renderPass;
-    VkFramebuffer swapchainFramebuffers[2];
-    VkSemaphore imageAvailableSemaphore;
-    VkSemaphore renderFinishedSemaphore;
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
-    VkFence frameFence;
-    
-    VkCommandBuffer graphicsCommandBuffer;
-    
-    /*
-    *  Texture-related Vulkan objects
-    */
+    SpriteArrays *sprites;
+    u32 *indices;
+    Vertex *out;
     
-    // Descriptor System
-    VkDescriptorSetLayout descSetLayout;
-    VkDescriptorPool descPool;
-    VkDescriptorSet descSet;
-    
-    // Texture
-    VkImage texImage;
-    VkDeviceMemory texImageMemory;
-    VkImageView texImageView;
-    VkSampler texSampler;
-    
-    /*
-    *  Uniform Buffer Vulkan Objects
-    */
-    
-    VkBuffer uniformBuffer;
-    VkDeviceMemory uniformBufferMemory;
-    
-    /*
-    *  Vertex Buffer Vulkan Objects
-    */
+} SpriteBatchWork;
+
+void
+batch_sprites_chunk(void *userData, u32 first, u32 count, u32 chunkIndex)
+{
+    SpriteBatchWork *work = (SpriteBatchWork *)userData;
     
-    VkBuffer vertStagingBuffer;
-    VkDeviceMemory vertStagingBufferMemory;
+    generate_sprite_vertices_indexed(work->sprites, work->indices + first,
+                                     count,
+                                     work->out + first * VERTICES_PER_SPRITE);
+}
+
+// Writes the vertices of the listed sprites to out, in parallel
+void
+batch_sprites(JobQueue *queue, SpriteArrays *sprites, u32 *indices,
+              u32 count, Vertex *out)
+{
+    SpriteBatchWork work = { sprites, indices, out };
+    jobs_parallel_for(queue, count, CULL_CHUNK_SIZE, batch_sprites_chunk,
+                      &work);
+}
+
+// One sprite as pull.vert reads it (std430), a sixth of its six vertices
+typedef struct
+{
+    f32 centerX, centerY;
+    u32 size; // width and height as half floats, width in the low bits
+    f32 rotation;
     
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+} SpriteRecord;
+
+typedef struct
+{
+    SpriteArrays *sprites;
+    u32 *indices;
+    SpriteRecord *out;
     
+} SpriteRecordWork;
+
+void
+batch_sprite_records_chunk(void *userData, u32 first, u32 count,
+                           u32 chunkIndex)
+{
+    SpriteRecordWork *work = (SpriteRecordWork *)userData;
+    SpriteArrays *sprites = work->sprites;
     
-    /*
-    *  Create the Render Pass
-    */
+    u32 *indices = work->indices + first;
+    SpriteRecord *out = work->out + first;
     
-    // Describe the color attachment (the swapchain image)
-    VkAttachmentDescription colorAttachment =
+    for (u32 i = 0; i < count; i++)
     {
-        0, // flags
-        vk.swapchainImageFormat,
-        VK_SAMPLE_COUNT_1_BIT, // no multisampling
-        VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation (clear the screen)
-        VK_ATTACHMENT_STORE_OP_STORE, // store op (save the result)
-        VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
-        VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
-        VK_IMAGE_LAYOUT_UNDEFINED, // initial image layout
-        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR // final layout (optimal to present)
-    };
-    
-    VkAttachmentDescription colorAttachments[] = { colorAttachment };
+        u32 sprite = indices[i];
+        
+        // Built whole, then written once, mapped memory may be
+        // write-combined
+        SpriteRecord record =
+        {
+            sprites->centerX[sprite],
+            sprites->centerY[sprite],
+            (u32)f32_to_half(sprites->width[sprite]) |
+            ((u32)f32_to_half(sprites->height[sprite]) << 16),
+            sprites->rotation[sprite]
+        };
+        
+        out[i] = record;
+    }
+}
+
+/* Writes one record per listed sprite to out, in parallel. pull.vert
+   expands each into its quad, so this is a sixth of batch_sprites' bytes. */
+void
+batch_sprite_records(JobQueue *queue, SpriteArrays *sprites, u32 *indices,
+                     u32 count, SpriteRecord *out)
+{
+    SpriteRecordWork work = { sprites, indices, out };
+    jobs_parallel_for(queue, count, CULL_CHUNK_SIZE,
+                      batch_sprite_records_chunk, &work);
+}
+
+/*
+*  Pipeline state cache
+*/
+
+#include "pipeline_cache.h"
+
+/*
+*  Session capture and replay
+*/
+
+#include "capture.h"
+
+/* Applies an UPLOAD record of a replayed capture. The batch and record
+   buffers stay mapped, so they are written directly. The others are queued
+   and copied in by the next frame, or uploaded right away without staging,
+   like the startup uploads before the first frame. */
+void
+replay_upload(VulkanContext *vk, DrawStateTable *table, Vertex *batchVertices,
+              SpriteRecord *spriteRecords, UploadStaging *staging,
+              CaptureUpload *upload)
+{
+    assert(upload->slot < DRAW_MAX_VERTEX_BUFFERS);
+    void *data = upload + 1;
     
-    VkAttachmentReference colorAttachmentRef =
+    if (upload->slot == VERTEX_BUFFER_SPRITE_BATCH)
     {
-        0, // index of the attachment in the render pass
-        // layout during rendering (optimal for rendering color data)
-        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
-    };
-    
-    VkAttachmentReference colorAttachmentRefs[] = { colorAttachmentRef };
-    
-    // Describe the render subpass
-    VkSubpassDescription subpass =
+        memcpy((u8 *)batchVertices + upload->offset, data,
+               (size_t)upload->size);
+    }
+    else if (upload->slot == VERTEX_BUFFER_SPRITE_RECORDS)
     {
-        0, // flags
-        VK_PIPELINE_BIND_POINT_GRAPHICS, // pipeline bind point
-        0, // input attachment count (ignored)
-        NULL, // input attachments (ignored)
-        array_count(colorAttachmentRefs),
-        colorAttachmentRefs,
-        NULL, // resolve attachments (ignored)
+        memcpy((u8 *)spriteRecords + upload->offset, data,
+               (size_t)upload->size);
+    }
+    else if (!staging)
+    {
+        vk_upload_to_buffer(vk, table->vertexBuffers[upload->slot],
+                            upload->offset, data, upload->size);
+    }
+    else
+    {
+        VkBuffer buffer = table->vertexBuffers[upload->slot];
+        
+        /* Too big for the staging ring, or it is still being copied from,
+           then a staging buffer of its own. Both go through the queue, so
+           the uploads land in the order they were captured. */
+        if (!upload_staging_buffer(staging, buffer, upload->offset, data,
+                                   upload->size) &&
+            !upload_queue_buffer(vk, buffer, upload->offset, data,
+                                 upload->size))
+        {
+            assert(!"Upload queue full");
+        }
+    }
+}
+
+/*
+*  GPU pipeline statistics
+*/
+
+#include "gpu_stats.h"
+
+/*
+*  SDF text
+*/
+
+#include "text.h"
+
+/*
+*  Chunked tile map
+*/
+
+#include "tilemap.h"
+
+/*
+*  Shadow buffers with dirty ranges
+*/
+
+#include "shadow_buffer.h"
+
+/*
+*  Asynchronous frame readback
+*/
+
+#include "readback.h"
+
+/*
+*  Texture streaming
+*/
+
+#include "texture_stream.h"
+
+/*
+*  Render graph passes
+*/
+
+#include "render_graph.h"
+
+typedef struct
+{
+    VkBuffer stagingBuffer;
+    VkImage image;
+    VkExtent3D extent;
+    
+} TextureUploadPass;
+
+void
+texture_upload_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                    void *userData)
+{
+    TextureUploadPass *upload = (TextureUploadPass *)userData;
+    
+    VkImageSubresourceLayers subResLayers =
+    {
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        0, // mipLevel
+        0, // baseArrayLayer
+        1  // layerCount
+    };
+    
+    VkBufferImageCopy imageCopy =
+    {
+        0, // bufferOfsset
+        0, // bufferRowLength
+        0, // bufferImageHeight
+        subResLayers,
+        {0, 0, 0},
+        upload->extent
+    };
+    
+    vkCmdCopyBufferToImage(commandBuffer,
+                           upload->stagingBuffer,
+                           upload->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           1,
+                           &imageCopy);
+}
+
+// Everything the per-frame passes need, refreshed before each execute
+typedef struct
+{
+    // Culling
+    VkPipeline cullPipeline;
+    VkPipelineLayout cullPipelineLayout;
+    VkDescriptorSet cullDescSet;
+    VkBuffer drawCountBuffer;
+    u32 objectCount;
+    Rect2 view;
+    
+    // Main pass
+    VkRenderPass renderPass;
+    VkFramebuffer framebuffer;
+    VkExtent2D extent;
+    DrawQueue *drawQueue;
+    DrawStateTable *drawStateTable;
+    DrawQueueStats drawStats;
+    GpuStats *gpuStats;
+    bool overdraw; // clear to black so the additive heat shows
+    
+    // Glyphs rasterized while the frame was built
+    TextRenderer *text;
+    
+    // Chunks edited while the frame was built
+    TileMap *tileMap;
+    
+    // Sprites edited while the frame was built
+    ShadowBuffer *sceneVertices;
+    ShadowBuffer *sceneBounds;
+    
+    // Panel textures rebuilt for this frame
+    TextureStreamer *streamer;
+    
+    // Uploads pushed from any thread since the last frame
+    UploadQueue *uploadQueue;
+    
+    // Frame export, NULL when not exporting
+    Readback *readback;
+    VkImage swapchainImage;
+    
+} FrameContext;
+
+void
+upload_queue_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                  void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    upload_queue_record(frame->uploadQueue, commandBuffer);
+}
+
+void
+text_atlas_upload_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                       void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    text_record_uploads(frame->text, commandBuffer);
+}
+
+void
+tilemap_upload_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                    void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    tilemap_record_uploads(frame->tileMap, commandBuffer);
+}
+
+void
+scene_upload_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                  void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    shadow_buffer_record(frame->sceneVertices, commandBuffer);
+    shadow_buffer_record(frame->sceneBounds, commandBuffer);
+}
+
+void
+clear_draw_count_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                      void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    
+    // Reset the draw count, then let the shader append draws
+    vkCmdFillBuffer(commandBuffer, frame->drawCountBuffer, 0, sizeof(u32), 0);
+}
+
+void
+cull_pass(RenderGraph *graph, VkCommandBuffer commandBuffer, void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      frame->cullPipeline);
+    
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            frame->cullPipelineLayout, 0,
+                            1, &frame->cullDescSet,
+                            0, NULL);
+    
+    CullConstants cullConstants =
+    {
+        {
+            frame->view.minX, frame->view.minY,
+            frame->view.maxX, frame->view.maxY
+        },
+        frame->objectCount
+    };
+    
+    vkCmdPushConstants(commandBuffer, frame->cullPipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(CullConstants),
+                       &cullConstants);
+    
+    vkCmdDispatch(commandBuffer,
+                  (frame->objectCount + CULL_WORKGROUP_SIZE - 1) /
+                  CULL_WORKGROUP_SIZE, 1, 1);
+}
+
+void
+main_pass(RenderGraph *graph, VkCommandBuffer commandBuffer, void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    
+    VkOffset2D renderAreaOffset = { 0, 0 };
+    VkRect2D renderArea =
+    {
+        renderAreaOffset,
+        frame->extent
+    };
+    
+    VkClearColorValue clearColor = {1, 1, 0, 1}; // yellow
+    VkClearColorValue overdrawClearColor = {0, 0, 0, 1};
+    
+    VkClearValue clearValue;
+    clearValue.color = frame->overdraw ? overdrawClearColor : clearColor;
+    
+    VkClearValue depthClearValue;
+    depthClearValue.depthStencil.depth = 1.0f; // far
+    depthClearValue.depthStencil.stencil = 0;
+    
+    // The depth value is ignored by the render pass without depth
+    VkClearValue clearValues[] = { clearValue, depthClearValue };
+    
+    VkRenderPassBeginInfo renderPassBeginInfo =
+    {
+        VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        NULL,
+        frame->renderPass,
+        frame->framebuffer,
+        renderArea,
+        array_count(clearValues),
+        clearValues
+    };
+    
+    // Counts everything the render pass does
+    gpu_stats_begin(frame->gpuStats, commandBuffer);
+    
+    vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo,
+                         VK_SUBPASS_CONTENTS_INLINE);
+    
+    // Dynamic in every pipeline, so set once for all of them
+    VkViewport viewport =
+    {
+        0, 0, // x, y
+        (f32)frame->extent.width,
+        (f32)frame->extent.height,
+        0, 1 // min, max depth
+    };
+    
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &renderArea);
+    
+    draw_queue_emit(frame->drawQueue, frame->drawStateTable, commandBuffer,
+                    &frame->drawStats);
+    
+    vkCmdEndRenderPass(commandBuffer);
+    
+    gpu_stats_end(frame->gpuStats, commandBuffer);
+}
+
+void
+texture_stream_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                    void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    stream_record(frame->streamer, commandBuffer);
+}
+
+void
+readback_pass(RenderGraph *graph, VkCommandBuffer commandBuffer,
+              void *userData)
+{
+    FrameContext *frame = (FrameContext *)userData;
+    readback_record(frame->readback, commandBuffer, frame->swapchainImage);
+}
+
+/*
+*  Startup tasks, none of them touch Vulkan
+*/
+
+typedef struct
+{
+    char *overrideDirectory; // NULL to use only the embedded code
+    LoadedFile code[SHADER_COUNT];
+    bool fromDisk[SHADER_COUNT]; // read by load_entire_file, to be freed
+    
+} ShaderFiles;
+
+// Only reads files when overridden, the embedded code is already there
+void
+load_shader_files(void *data)
+{
+    ShaderFiles *files = (ShaderFiles *)data;
+    for (u32 i = 0; i < SHADER_COUNT; i++)
+    {
+        files->code[i] = shader_code((ShaderId)i, files->overrideDirectory,
+                                     &files->fromDisk[i]);
+    }
+}
+
+// Once its module is created, the code isn't needed anymore
+void
+free_shader_file(ShaderFiles *files, ShaderId id)
+{
+    if (files->fromDisk[id])
+    {
+        free(files->code[id].data);
+        files->fromDisk[id] = false;
+    }
+    
+    files->code[id].data = NULL;
+    files->code[id].size = 0;
+}
+
+typedef struct
+{
+    JobQueue *queue;
+    StreamedTexture textures[PANEL_COUNT]; // added to the streamer later
+    
+} PanelTextures;
+
+void
+build_panel_textures_chunk(void *userData, u32 first, u32 count,
+                           u32 chunkIndex)
+{
+    PanelTextures *panels = (PanelTextures *)userData;
+    
+    u8 *texels = (u8 *)malloc(PANEL_TEXTURE_SIZE * PANEL_TEXTURE_SIZE * 4);
+    assert(texels);
+    
+    for (u32 i = first; i < first + count; i++)
+    {
+        // A checker in the panel's color under a fine grid, which only
+        // shows when the top levels are resident
+        f32 hue = SIMD_TWO_PI * (f32)i / (f32)PANEL_COUNT;
+        u8 r = (u8)(127.5f + 127.5f * cosf(hue));
+        u8 g = (u8)(127.5f + 127.5f * cosf(hue - SIMD_TWO_PI / 3.0f));
+        u8 b = (u8)(127.5f + 127.5f * cosf(hue + SIMD_TWO_PI / 3.0f));
+        u32 cell = PANEL_TEXTURE_SIZE / (4 << (i % 4));
+        
+        u8 *texel = texels;
+        for (u32 y = 0; y < PANEL_TEXTURE_SIZE; y++)
+        {
+            for (u32 x = 0; x < PANEL_TEXTURE_SIZE; x++, texel += 4)
+            {
+                bool grid = x % 16 == 0 || y % 16 == 0;
+                bool light = ((x / cell) + (y / cell)) & 1;
+                
+                texel[0] = grid ? 0 : light ? 240 : r;
+                texel[1] = grid ? 0 : light ? 240 : g;
+                texel[2] = grid ? 0 : light ? 240 : b;
+                texel[3] = 255;
+            }
+        }
+        
+        stream_build_texture(&panels->textures[i], PANEL_TEXTURE_SIZE,
+                             texels);
+    }
+    
+    free(texels);
+}
+
+// Texels and the whole mip chain of every panel, one panel per chunk
+void
+build_panel_textures(void *data)
+{
+    PanelTextures *panels = (PanelTextures *)data;
+    jobs_parallel_for(panels->queue, PANEL_COUNT, 1,
+                      build_panel_textures_chunk, panels);
+}
+
+typedef struct
+{
+    JobQueue *queue;
+    u32 randomState; // carried on from the sprites to the tile map
+    
+    u32 spriteCount;
+    f32 worldWidth;
+    f32 worldHeight;
+    SpriteArrays sprites; // one allocation for these and the bounds
+    BoundsArrays bounds;
+    u32 *colors; // only stored by vertex layouts with a color
+    
+    TileMap tileMap;
+    
+} SceneSetup;
+
+void
+build_sprite_scene(void *data)
+{
+    SceneSetup *scene = (SceneSetup *)data;
+    u32 spriteCount = scene->spriteCount;
+    
+    // One allocation for the sprite and bounds arrays (SoA)
+    f32 *spriteMemory = (f32 *)malloc(sizeof(f32) * 9 * spriteCount);
+    assert(spriteMemory);
+    
+    SpriteArrays sprites =
+    {
+        spriteMemory + 0 * spriteCount, // centerX
+        spriteMemory + 1 * spriteCount, // centerY
+        spriteMemory + 2 * spriteCount, // width
+        spriteMemory + 3 * spriteCount, // height
+        spriteMemory + 4 * spriteCount // rotation
+    };
+    
+    BoundsArrays bounds =
+    {
+        spriteMemory + 5 * spriteCount, // minX
+        spriteMemory + 6 * spriteCount, // minY
+        spriteMemory + 7 * spriteCount, // maxX
+        spriteMemory + 8 * spriteCount // maxY
+    };
+    
+    u32 *randomState = &scene->randomState;
+    for (u32 i = 0; i < spriteCount; i++)
+    {
+        sprites.centerX[i] = random_range(randomState, 0, scene->worldWidth);
+        sprites.centerY[i] = random_range(randomState, 0, scene->worldHeight);
+        sprites.width[i] = random_range(randomState, 8, 32);
+        sprites.height[i] = random_range(randomState, 8, 32);
+        sprites.rotation[i] = random_range(randomState, 0, SIMD_TWO_PI);
+    }
+    
+    u32 *colors = (u32 *)malloc(sizeof(u32) * spriteCount);
+    assert(colors);
+    
+    for (u32 i = 0; i < spriteCount; i++)
+    {
+        colors[i] = 0xff000000 | (random_next(randomState) | 0x404040);
+    }
+    
+    // Only the edited sprites have their bounds computed again
+    compute_sprite_bounds(scene->queue, &sprites, spriteCount, &bounds);
+    
+    scene->sprites = sprites;
+    scene->bounds = bounds;
+    scene->colors = colors;
+}
+
+// After build_sprite_scene, which leaves randomState where this starts
+void
+build_tile_map(void *data)
+{
+    SceneSetup *scene = (SceneSetup *)data;
+    u32 *randomState = &scene->randomState;
+    
+    // Covers the sprite world, ground a few hundred pixels down
+    TileMap *tileMap = &scene->tileMap;
+    tilemap_init(tileMap, 40, 8);
+    
+    for (u32 x = 0; x < tileMap->widthInTiles; x++)
+    {
+        u32 surface = 26 + (u32)(4.0f * sinf((f32)x * 0.07f) +
+                                 random_range(randomState, 0, 3));
+        
+        for (u32 y = surface; y < tileMap->heightInTiles; y++)
+        {
+            TileType type = y < surface + 2 ? TILE_CHECKER : TILE_DARK;
+            if (random_next(randomState) % 50 == 0)
+            {
+                type = TILE_RED;
+            }
+            
+            tilemap_set_tile(tileMap, x, y, type);
+        }
+    }
+}
+
+/*
+*  WinMain application entry point
+*/
+
+int CALLBACK
+WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
+{
+    u32 winWidth = 800;
+    u32 winHeight = 600;
+    
+    /*
+    *  Capture and Replay Options
+    */
+    
+    // -capture <file> records the session, -replay <file> plays one back
+    // as fast as possible, or at the recorded pace with -timed
+    char captureFileName[MAX_PATH];
+    char replayFileName[MAX_PATH];
+    bool capturing = command_line_option(cmdLine, "-capture",
+                                         captureFileName,
+                                         sizeof(captureFileName));
+    bool replaying = command_line_option(cmdLine, "-replay",
+                                         replayFileName,
+                                         sizeof(replayFileName));
+    bool replayTimed = command_line_option(cmdLine, "-timed", NULL, 0);
+    
+    // -export <file> writes every frame, as .png, .y4m or else raw BGRA8
+    char exportFileName[MAX_PATH];
+    bool exporting = command_line_option(cmdLine, "-export", exportFileName,
+                                         sizeof(exportFileName));
+    
+    // -texturebudget <MB> caps streamed textures below what the heap allows
+    VkDeviceSize textureBudgetCap = 0;
+    char textureBudgetText[16];
+    if (command_line_option(cmdLine, "-texturebudget", textureBudgetText,
+                            sizeof(textureBudgetText)))
+    {
+        textureBudgetCap = (VkDeviceSize)atoi(textureBudgetText) << 20;
+    }
+    
+    // -vertexformat <float|snorm16|half|color> for the sprite scene, a
+    // replay uses the one its capture was made with instead
+    VertexLayout sceneLayout = VERTEX_LAYOUT_SPRITE_SNORM16;
+    char vertexFormatName[16];
+    if (command_line_option(cmdLine, "-vertexformat", vertexFormatName,
+                            sizeof(vertexFormatName)))
+    {
+        sceneLayout = vertex_layout_from_name(vertexFormatName);
+        assert(sceneLayout != VERTEX_LAYOUT_COUNT);
+    }
+    
+    // -shaders <directory> loads the .spv files there over the embedded ones
+    char shaderDirectory[MAX_PATH];
+    bool overridingShaders = command_line_option(cmdLine, "-shaders",
+                                                 shaderDirectory,
+                                                 sizeof(shaderDirectory));
+    
+    CaptureReader replay = {0};
+    if (replaying)
+    {
+        bool replayOpened = capture_open(&replay, replayFileName);
+        assert(replayOpened && "Not a capture file");
+        
+        // Its uploads are in the scene layout it was captured with
+        sceneLayout = (VertexLayout)replay.header->sceneLayout;
+        assert(sceneLayout < VERTEX_LAYOUT_COUNT);
+        
+        // And its frames were drawn at this size, the window's client area
+        winWidth = replay.header->width;
+        winHeight = replay.header->height;
+    }
+    
+    /*
+    *  Start the Worker Threads
+    */
+    
+    JobQueue jobQueue = {0};
+    jobs_init(&jobQueue, jobs_default_thread_count());
+    
+    /*
+    *  Start the Startup Tasks
+    */
+    
+    /* They run on the workers while this thread brings up the window and
+       Vulkan, each is waited for right before its result is needed */
+    Startup startup;
+    startup_begin(&startup, &jobQueue);
+    
+    ShaderFiles shaderFiles = {0};
+    shaderFiles.overrideDirectory = overridingShaders ? shaderDirectory : NULL;
+    u32 shaderFilesTask = startup_task(&startup, "shader code",
+                                       load_shader_files, &shaderFiles, 0);
+    
+    PanelTextures *panels = (PanelTextures *)malloc(sizeof(PanelTextures));
+    assert(panels);
+    panels->queue = &jobQueue;
+    u32 panelsTask = startup_task(&startup, "panel textures",
+                                  build_panel_textures, panels, 0);
+    
+    // A large scrolling world, most of it offscreen at any time
+    SceneSetup scene = {0};
+    scene.queue = &jobQueue;
+    scene.randomState = 0x12345678;
+    scene.spriteCount = 100000;
+    scene.worldWidth = 20000;
+    scene.worldHeight = 4000;
+    
+    u32 spritesTask = startup_task(&startup, "sprite scene",
+                                   build_sprite_scene, &scene, 0);
+    u32 tileMapTask = startup_task(&startup, "tile map", build_tile_map,
+                                   &scene, 1 << spritesTask);
+    
+    /*
+    *  Start the Window Thread
+    */
+    
+    startup_stage(&startup, "window");
+    
+    // This thread renders, the window's messages are pumped on another one
+    WindowThreadParams windowParams =
+    {
+        instance,
+        100, 100, // x, y
+        winWidth, winHeight,
+        "My Shiny Vulkan Window",
+        NULL, // window
+        CreateEvent(NULL, FALSE, FALSE, NULL) // created
+    };
+    assert(windowParams.created);
+    
+    DWORD windowThreadId;
+    HANDLE windowThread = CreateThread(NULL, 0, win32_window_thread,
+                                       &windowParams, 0, &windowThreadId);
+    assert(windowThread);
+    
+    WaitForSingleObject(windowParams.created, INFINITE);
+    CloseHandle(windowParams.created);
+    assert(windowParams.window);
+    
+    startup_stage(&startup, "instance, device and swapchain");
+    
+    VulkanContext vk = win32_init_vulkan(instance, windowParams.window,
+                                         replaying && !replayTimed);
+    
+    vk.uploadQueue = (UploadQueue *)malloc(sizeof(UploadQueue));
+    assert(vk.uploadQueue);
+    upload_queue_init(vk.uploadQueue);
+    
+    // A replayed frame is drawn with all of its captured uploads, none of
+    // them may wait for the next one
+    if (replaying)
+    {
+        vk.uploadQueue->maxPerFrame = UPLOAD_QUEUE_SIZE;
+    }
+    
+    CaptureWriter capture = {0};
+    if (capturing && !replaying)
+    {
+        bool captureOpened = capture_begin(&capture, captureFileName,
+                                           vk.swapchainExtents, sceneLayout);
+        assert(captureOpened);
+    }
+    
+    // The recorded view only lines up in the extent it was captured at
+    if (replaying)
+    {
+        assert(vk.swapchainExtents.width == replay.header->width &&
+               vk.swapchainExtents.height == replay.header->height &&
+               "Swapchain extent differs from the capture's");
+    }
+    
+    /*
+    *  App-specific Vulkan objects
+    */
+    
+    startup_stage(&startup, "render passes and framebuffers");
+    
+    VkRenderPass renderPass;
+    VkFramebuffer swapchainFramebuffers[2];
+    
+    // Depth attachment for the opaque pass, a transient of the frame graphs
+    // with a depth pass, which also own the framebuffers using it
+    VkFormat depthFormat;
+    VkRenderPass depthRenderPass;
+    VkFramebuffer depthFramebuffers[4][2] = {0}; // [graph][swapchain image]
+    
+    VkSemaphore imageAvailableSemaphore;
+    VkSemaphore renderFinishedSemaphore;
+    VkPipelineLayout pipelineLayout;
+    
+    VkCommandBuffer graphicsCommandBuffer;
+    
+    /*
+    *  Texture-related Vulkan objects
+    */
+    
+    // Descriptor System
+    VkDescriptorSetLayout descSetLayout;
+    VkDescriptorPool descPool;
+    VkDescriptorSet descSet;
+    
+    // Texture
+    VkImage texImage;
+    VkDeviceMemory texImageMemory;
+    VkImageView texImageView;
+    VkSampler texSampler;
+    
+    /*
+    *  Uniform Buffer Vulkan Objects
+    */
+    
+    VkBuffer uniformBuffer;
+    VkDeviceMemory uniformBufferMemory;
+    
+    /*
+    *  Vertex Buffer Vulkan Objects
+    */
+    
+    VkBuffer vertStagingBuffer;
+    VkDeviceMemory vertStagingBufferMemory;
+    
+    VkBuffer vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    
+    // Rewritten every frame with the visible sprites (host visible)
+    VkBuffer batchVertexBuffer;
+    VkDeviceMemory batchVertexBufferMemory;
+    
+    /*
+    *  GPU-driven Culling Vulkan Objects
+    */
+    
+    ShadowBuffer *sceneBounds; // vec4 per object
+    
+    VkBuffer drawRecordBuffer; // DrawRecord per object
+    VkDeviceMemory drawRecordBufferMemory;
+    
+    ShadowBuffer *sceneVertices; // every object's vertices
+    
+    VkBuffer indirectCommandBuffer; // VkDrawIndirectCommand per visible object
+    VkDeviceMemory indirectCommandBufferMemory;
+    
+    VkBuffer drawCountBuffer; // u32 visible object count
+    VkDeviceMemory drawCountBufferMemory;
+    
+    VkDescriptorSetLayout cullDescSetLayout;
+    VkDescriptorPool cullDescPool;
+    VkDescriptorSet cullDescSet;
+    VkPipelineLayout cullPipelineLayout;
+    VkPipeline cullPipeline;
+    
+    
+    /*
+    *  Create the Render Pass
+    */
+    
+    // Describe the color attachment (the swapchain image)
+    VkAttachmentDescription colorAttachment =
+    {
+        0, // flags
+        vk.swapchainImageFormat,
+        VK_SAMPLE_COUNT_1_BIT, // no multisampling
+        VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation (clear the screen)
+        VK_ATTACHMENT_STORE_OP_STORE, // store op (save the result)
+        VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
+        // The render graph moves the image in and out of this layout
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, // initial image layout
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL // final layout
+    };
+    
+    VkAttachmentDescription colorAttachments[] = { colorAttachment };
+    
+    VkAttachmentReference colorAttachmentRef =
+    {
+        0, // index of the attachment in the render pass
+        // layout during rendering (optimal for rendering color data)
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+    };
+    
+    VkAttachmentReference colorAttachmentRefs[] = { colorAttachmentRef };
+    
+    // Describe the render subpass
+    VkSubpassDescription subpass =
+    {
+        0, // flags
+        VK_PIPELINE_BIND_POINT_GRAPHICS, // pipeline bind point
+        0, // input attachment count (ignored)
+        NULL, // input attachments (ignored)
+        array_count(colorAttachmentRefs),
+        colorAttachmentRefs,
+        NULL, // resolve attachments (ignored)
         NULL, // depth stencil attachment (ignored)
         0, // preserve attachment count (ignored)
         NULL // preserve attachments (ignored)
@@ -831,8 +2326,8 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         colorAttachments,
         array_count(subpasses),
         subpasses,
-        0, // dependency count (ignored)
-        NULL  // dependencies (ignored)
+        0, // dependency count (the render graph's barriers cover them)
+        NULL  // dependencies
     };
     
     if (vkCreateRenderPass(vk.device, &renderPassInfo, NULL,
@@ -841,6 +2336,56 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         assert(!"Failed to create render pass");
     }
     
+    /*
+    *  Create the Depth Render Pass
+    */
+    
+    // Same color attachment, plus depth for the opaque front-to-back pass
+    depthFormat = vk_find_depth_format(&vk);
+    
+    {
+        VkAttachmentDescription depthAttachment =
+        {
+            0, // flags
+            depthFormat,
+            VK_SAMPLE_COUNT_1_BIT, // no multisampling
+            VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation (clear to far)
+            VK_ATTACHMENT_STORE_OP_DONT_CARE, // only needed during the pass
+            VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
+            VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
+            // Depth only formats, so this needs no separate depth/stencil
+            // layouts feature
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, // initialLayout
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL // finalLayout
+        };
+        
+        VkAttachmentDescription depthPassAttachments[] =
+        {
+            colorAttachment,
+            depthAttachment
+        };
+        
+        VkAttachmentReference depthAttachmentRef =
+        {
+            1, // index of the attachment in the render pass
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+        };
+        
+        VkSubpassDescription depthSubpass = subpass;
+        depthSubpass.pDepthStencilAttachment = &depthAttachmentRef;
+        
+        VkRenderPassCreateInfo depthRenderPassInfo = renderPassInfo;
+        depthRenderPassInfo.attachmentCount = array_count(depthPassAttachments);
+        depthRenderPassInfo.pAttachments = depthPassAttachments;
+        depthRenderPassInfo.pSubpasses = &depthSubpass;
+        
+        if (vkCreateRenderPass(vk.device, &depthRenderPassInfo, NULL,
+                               &depthRenderPass) != VK_SUCCESS)
+        {
+            assert(!"Failed to create depth render pass");
+        }
+    }
+    
     /*
     *  Create Swapchain image's Framebuffers
     */
@@ -922,10 +2467,15 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     *  Load SPIR-V and Create Shader Modules
     */
     
-    LoadedFile vertexShader = load_entire_file("../shaders/vert.spv");
+    startup_stage(&startup, "shader modules");
+    
+    // Overrides were read while the device was created
+    startup_wait(&startup, shaderFilesTask);
+    
+    LoadedFile vertexShader = shaderFiles.code[SHADER_VERT];
     assert(vertexShader.size > 0);
     
-    LoadedFile fragmentShader = load_entire_file("../shaders/frag.spv");
+    LoadedFile fragmentShader = shaderFiles.code[SHADER_FRAG];
     assert(fragmentShader.size > 0);
     
     // Create shader modules from loaded binaries
@@ -935,42 +2485,48 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     VkShaderModule fragShaderModule =
         vk_create_shader_module(&vk, fragmentShader.data, fragmentShader.size);
     
-    /*
-    *  Define Shader Stage Create Info
-    */
+    // Debug overdraw view, replaces the textured fragment shader
+    LoadedFile overdrawShader = shaderFiles.code[SHADER_OVERDRAW];
+    assert(overdrawShader.size > 0);
     
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        NULL,
-        0,
-        VK_SHADER_STAGE_VERTEX_BIT,
-        vertShaderModule,
-        "main", // entry point
-        NULL // specialization info
-    };
+    VkShaderModule overdrawShaderModule =
+        vk_create_shader_module(&vk, overdrawShader.data, overdrawShader.size);
     
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        NULL,
-        0,
-        VK_SHADER_STAGE_FRAGMENT_BIT,
-        fragShaderModule,
-        "main", // entry point
-        NULL, // specialization info
-    };
+    // Signed distance field text, samples the glyph atlas
+    LoadedFile sdfShader = shaderFiles.code[SHADER_SDF];
+    assert(sdfShader.size > 0);
     
-    VkPipelineShaderStageCreateInfo shaderStageInfo[] =
-    {
-        vertShaderStageInfo,
-        fragShaderStageInfo
-    };
+    VkShaderModule sdfShaderModule =
+        vk_create_shader_module(&vk, sdfShader.data, sdfShader.size);
+    
+    // shader.vert plus a per-vertex color, for the vertex layouts with one
+    LoadedFile colorShader = shaderFiles.code[SHADER_COLOR];
+    assert(colorShader.size > 0);
+    
+    VkShaderModule colorShaderModule =
+        vk_create_shader_module(&vk, colorShader.data, colorShader.size);
+    
+    // Builds sprite quads from records in a storage buffer, no vertex input
+    LoadedFile pullShader = shaderFiles.code[SHADER_PULL];
+    assert(pullShader.size > 0);
+    
+    VkShaderModule pullShaderModule =
+        vk_create_shader_module(&vk, pullShader.data, pullShader.size);
+    
+    // The modules keep their own copy, only cull.comp is still to come
+    free_shader_file(&shaderFiles, SHADER_VERT);
+    free_shader_file(&shaderFiles, SHADER_FRAG);
+    free_shader_file(&shaderFiles, SHADER_OVERDRAW);
+    free_shader_file(&shaderFiles, SHADER_SDF);
+    free_shader_file(&shaderFiles, SHADER_COLOR);
+    free_shader_file(&shaderFiles, SHADER_PULL);
     
     /*
     *  Create the Descriptor Set Layout
     */
     
+    startup_stage(&startup, "descriptors, texture and text");
+    
     VkDescriptorSetLayoutBinding descSetLayoutBinding1 =
     {
         0, // binding
@@ -989,10 +2545,21 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         NULL // pImmutableSamplers
     };
     
+    // The sprite records of pull.vert, only written in the texture set
+    VkDescriptorSetLayoutBinding descSetLayoutBinding3 =
+    {
+        2, // binding
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        1, // descriptorCount
+        VK_SHADER_STAGE_VERTEX_BIT,
+        NULL // pImmutableSamplers
+    };
+    
     VkDescriptorSetLayoutBinding descSetLayoutBindings[] =
     {
         descSetLayoutBinding1,
-        descSetLayoutBinding2
+        descSetLayoutBinding2,
+        descSetLayoutBinding3
     };
     
     VkDescriptorSetLayoutCreateInfo descSetLayoutInfo =
@@ -1014,22 +2581,30 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     *  Create the Descriptor Pool
     */
     
+    // One set for the texture, one for the glyph atlas, one per panel
     VkDescriptorPoolSize descPoolSize1 =
     {
         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        1 // descriptorCount
+        2 + PANEL_COUNT // descriptorCount
     };
     
     VkDescriptorPoolSize descPoolSize2 =
     {
         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        1 // descriptorCount
+        2 + PANEL_COUNT // descriptorCount
+    };
+    
+    VkDescriptorPoolSize descPoolSize3 =
+    {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        2 + PANEL_COUNT // descriptorCount, every set has the record binding
     };
     
     VkDescriptorPoolSize descPoolSizes[] =
     {
         descPoolSize1,
-        descPoolSize2
+        descPoolSize2,
+        descPoolSize3
     };
     
     VkDescriptorPoolCreateInfo descPoolInfo =
@@ -1037,7 +2612,7 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
         NULL,
         0,
-        1, // maxSets
+        2 + PANEL_COUNT, // maxSets
         array_count(descPoolSizes),
         descPoolSizes
     };
@@ -1066,7 +2641,14 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     if (vkAllocateDescriptorSets(vk.device, &descSetAllocInfo,
                                  &descSet) != VK_SUCCESS)
     {
-        assert(!"Failed to allocate descriptor set!");
+        assert(!"Failed to allocate descriptor set!");
+    }
+    
+    VkDescriptorSet textDescSet;
+    if (vkAllocateDescriptorSets(vk.device, &descSetAllocInfo,
+                                 &textDescSet) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate text descriptor set!");
     }
     
     /*
@@ -1081,6 +2663,17 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     
     VkDeviceSize texDataSize = sizeof(texData);
     
+    /* Per descriptor set, whether its texture is opaque. The checker's
+       dark texels are translucent, the panels' are all at full alpha, and
+       text is always blended. */
+    bool opaqueTextures[DESC_SET_PANEL_FIRST + PANEL_COUNT] = {0};
+    opaqueTextures[DESC_SET_TEXTURE] =
+        texels_opaque(texData, array_count(texData));
+    for (u32 i = 0; i < PANEL_COUNT; i++)
+    {
+        opaqueTextures[DESC_SET_PANEL_FIRST + i] = true;
+    }
+    
     /*
     *  Create the Staging Buffer
     */
@@ -1175,121 +2768,49 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     
     VkCommandBuffer texCommandBuffer = vk_begin_single_time_commands(&vk);
     
-    /*
-    *  Define the Subresource Range
-    */
-    
-    VkImageSubresourceRange subResRange =
-    {
-        VK_IMAGE_ASPECT_COLOR_BIT,
-        0, // baseMipLevel
-        1, // levelCount
-        0, // baseArrayLayer
-        1, // layerCount
-    };
-    
-    /*
-    *  Change Image Layout to Transfer using a barrier
-    */
-    
-    {
-        VkImageMemoryBarrier barrier =
-        {
-            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            NULL,
-            0, // srcAccessMask
-            VK_ACCESS_TRANSFER_WRITE_BIT, // dstAccessMask
-            VK_IMAGE_LAYOUT_UNDEFINED, // oldLayout
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // newLayout
-            VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
-            VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
-            texImage,
-            subResRange
-        };
-        
-        VkImageMemoryBarrier barriers[] = { barrier };
-        
-        vkCmdPipelineBarrier(texCommandBuffer,
-                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                             VK_PIPELINE_STAGE_TRANSFER_BIT,
-                             0, 0, NULL, 0, NULL,
-                             array_count(barriers),
-                             barriers);
-    }
-    
     /*
     *  Copy texture data from Staging Buffer to Image
     */
     
-    VkImageSubresourceLayers subResLayers =
-    {
-        VK_IMAGE_ASPECT_COLOR_BIT,
-        0, // mipLevel
-        0, // baseArrayLayer
-        1  // layerCount
-    };
+    // The graph moves the image to TRANSFER_DST and then to shader read
+    RenderGraph uploadGraph = {0};
     
-    VkBufferImageCopy imageCopy =
+    u32 uploadTexture = rg_import_image(&uploadGraph, "texture",
+                                        VK_IMAGE_ASPECT_COLOR_BIT,
+                                        RG_ACCESS_NONE,
+                                        RG_ACCESS_FRAGMENT_SAMPLED_READ);
+    rg_set_image(&uploadGraph, uploadTexture, texImage, VK_NULL_HANDLE);
+    
+    TextureUploadPass textureUpload =
     {
-        0, // bufferOfsset
-        0, // bufferRowLength
-        0, // bufferImageHeight
-        subResLayers,
-        {0, 0, 0},
+        texStagingBuffer,
+        texImage,
         imageExtent
     };
     
-    vkCmdCopyBufferToImage(texCommandBuffer,
-                           texStagingBuffer,
-                           texImage,
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           1,
-                           &imageCopy);
-    
-    /*
-    *  Change Image Layout to Shader Read using a barrier
-    */
-    
-    {
-        VkImageMemoryBarrier barrier =
-        {
-            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            NULL,
-            VK_ACCESS_TRANSFER_WRITE_BIT, // srcAccessMask
-            VK_ACCESS_SHADER_READ_BIT, // dstAccessMask
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // oldLayout
-            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // newLayout
-            VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
-            VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
-            texImage,
-            subResRange
-        };
-        
-        vkCmdPipelineBarrier(texCommandBuffer,
-                             VK_PIPELINE_STAGE_TRANSFER_BIT,
-                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                             0, 0, NULL, 0, NULL, 1, &barrier);
-    }
-    
-    /*
-    *  End and Execute Single Time Command Buffer
-    */
+    u32 uploadPass = rg_add_pass(&uploadGraph, "texture upload",
+                                 texture_upload_pass, &textureUpload);
+    rg_pass_access(&uploadGraph, uploadPass, uploadTexture,
+                   RG_ACCESS_TRANSFER_WRITE);
     
-    vk_end_single_time_commands(&vk, texCommandBuffer);
+    rg_compile(&uploadGraph, &vk);
+    rg_execute(&uploadGraph, texCommandBuffer);
     
     /*
-    *  Destroy Staging Buffer and Free its Memory
+    *  Submit Single Time Command Buffer, Destroy Staging Once it's Done
     */
     
-    vkDestroyBuffer(vk.device, texStagingBuffer, NULL);
-    vkFreeMemory(vk.device, texStagingBufferMemory, NULL);
+    u64 texUploadValue = vk_submit_single_time_commands(&vk, texCommandBuffer);
+    destroy_queue_buffer(&vk, texStagingBuffer, texStagingBufferMemory,
+                         texUploadValue);
     
     /*
     *  Create Texture Image View
     */
     
     texImageView = vk_create_image_view(&vk, texImage,
-                                        VK_FORMAT_R8G8B8A8_SRGB);
+                                        VK_FORMAT_R8G8B8A8_SRGB,
+                                        VK_IMAGE_ASPECT_COLOR_BIT);
     
     /*
     *  Create Texture Image Sampler
@@ -1323,11 +2844,50 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         assert(!"Failed to create texture sampler!");
     }
     
+    /*
+    *  Create the Text Renderer and Clear its Glyph Atlas
+    */
+    
+    TextRenderer *text = (TextRenderer *)calloc(1, sizeof(TextRenderer));
+    assert(text);
+    
+    text_init(text, &vk, "Segoe UI");
+    
+    {
+        VkCommandBuffer atlasCommandBuffer = vk_begin_single_time_commands(&vk);
+        
+        RenderGraph atlasGraph = {0};
+        
+        u32 atlas = rg_import_image(&atlasGraph, "glyph atlas",
+                                    VK_IMAGE_ASPECT_COLOR_BIT,
+                                    RG_ACCESS_NONE,
+                                    RG_ACCESS_FRAGMENT_SAMPLED_READ);
+        rg_set_image(&atlasGraph, atlas, text->atlasImage, VK_NULL_HANDLE);
+        
+        // The staging buffer starts out zeroed, i.e. all outside
+        TextureUploadPass atlasClear =
+        {
+            text->stagingBuffer,
+            text->atlasImage,
+            { TEXT_ATLAS_SIZE, TEXT_ATLAS_SIZE, 1 }
+        };
+        
+        u32 clearPass = rg_add_pass(&atlasGraph, "glyph atlas clear",
+                                    texture_upload_pass, &atlasClear);
+        rg_pass_access(&atlasGraph, clearPass, atlas,
+                       RG_ACCESS_TRANSFER_WRITE);
+        
+        rg_compile(&atlasGraph, &vk);
+        rg_execute(&atlasGraph, atlasCommandBuffer);
+        
+        vk_end_single_time_commands(&vk, atlasCommandBuffer);
+    }
+    
     /*
     *  Create Uniform Buffer
     */
     
-    VkDeviceSize uniBufferSize = sizeof(f32) * 4 * 4;
+    VkDeviceSize uniBufferSize = sizeof(Mat4);
     
     // Create the buffer (standard Vulkan buffer creation)
     vk_create_buffer(&vk, uniBufferSize,
@@ -1342,15 +2902,9 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         vkMapMemory(vk.device, uniformBufferMemory, 0, uniBufferSize, 0,
                     &data);
         
-        f32 projectionMatrix[] =
-        {
-            2.0f / (f32)winWidth, 0, 0, -1,
-            0, 2.0f / (f32)winHeight, 0, -1,
-            0, 0, 1, 0,
-            0, 0, 0, 1
-        };
+        Mat4 projection = mat4_orthographic_2d((f32)winWidth, (f32)winHeight);
         
-        memcpy(data, &projectionMatrix, uniBufferSize);
+        memcpy(data, &projection, uniBufferSize);
         
         vkUnmapMemory(vk.device, uniformBufferMemory);
     }
@@ -1407,29 +2961,85 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         writeDescSet2
     };
     
+    vkUpdateDescriptorSets(vk.device,
+                           array_count(writeDescSets),
+                           writeDescSets,
+                           0, NULL);
+    
+    // The text set, same layout with the glyph atlas bound instead
+    VkDescriptorImageInfo textImageInfo =
+    {
+        text->sampler,
+        text->atlasView,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+    
+    writeDescSets[0].dstSet = textDescSet;
+    writeDescSets[0].pImageInfo = &textImageInfo;
+    writeDescSets[1].dstSet = textDescSet;
+    
     vkUpdateDescriptorSets(vk.device,
                            array_count(writeDescSets),
                            writeDescSets,
                            0, NULL);
     
     /*
-    *  Create Vertex Buffer Staging Buffer
+    *  Create the Streamed Panel Textures
     */
     
-    float s = 100; // Size
+    startup_stage(&startup, "panel textures");
     
-    f32 vertices[] =
+    TextureStreamer *streamer =
+        (TextureStreamer *)malloc(sizeof(TextureStreamer));
+    assert(streamer);
+    
+    stream_init(streamer, &vk, textureBudgetCap);
+    
+    // Texels and mip chains were built on the workers
+    startup_wait(&startup, panelsTask);
+    
+    VkDescriptorSet panelDescSets[PANEL_COUNT];
+    for (u32 i = 0; i < PANEL_COUNT; i++)
     {
-        0, 0,    0, 0,
-        s, 0,    1, 0,
-        s, s,    1, 1,
+        if (vkAllocateDescriptorSets(vk.device, &descSetAllocInfo,
+                                     &panelDescSets[i]) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate a panel descriptor set!");
+        }
+        
+        // The uniform buffer, the streamer binds the texture
+        writeDescSets[1].dstSet = panelDescSets[i];
+        vkUpdateDescriptorSets(vk.device, 1, &writeDescSets[1], 0, NULL);
         
-        0, 0,    0, 0,
-        s, s,    1, 1,
-        0, s,    0, 1
+        stream_add_texture(streamer, &panels->textures[i], panelDescSets[i]);
+    }
+    
+    free(panels);
+    stream_load_tails(streamer);
+    
+    /*
+    *  Create Vertex Buffer Staging Buffer
+    */
+    
+    startup_stage(&startup, "vertex buffers");
+    
+    f32 s = 100; // Size
+    
+    // A single unrotated sprite covering (0, 0) to (s, s)
+    f32 quadCenter[] = { s / 2 };
+    f32 quadSize[] = { s };
+    f32 quadRotation[] = { 0 };
+    
+    SpriteArrays quad =
+    {
+        quadCenter, // centerX
+        quadCenter, // centerY
+        quadSize, // width
+        quadSize, // height
+        quadRotation
     };
     
-    u32 vertBufferSize = sizeof(vertices);
+    u32 vertBufferSize = sizeof(Vertex) * VERTICES_PER_SPRITE;
     
     vk_create_buffer(&vk,
                      vertBufferSize, 
@@ -1443,7 +3053,12 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         vkMapMemory(vk.device, vertStagingBufferMemory, 0, vertBufferSize, 0,
                     &data);
         
-        memcpy(data, vertices, vertBufferSize);
+        // The kernel writes straight into the mapped staging memory
+        generate_sprite_vertices(&quad, 0, 1, (Vertex *)data);
+        
+        capture_buffer(&capture, VERTEX_BUFFER_QUAD,
+                       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertBufferSize);
+        capture_upload(&capture, VERTEX_BUFFER_QUAD, 0, data, vertBufferSize);
         
         vkUnmapMemory(vk.device, vertStagingBufferMemory);
     }
@@ -1479,280 +3094,1083 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
                     array_count(copyRegions),
                     copyRegions);
     
-    vk_end_single_time_commands(&vk, vertCommandBuffer);
+    u64 vertUploadValue = vk_submit_single_time_commands(&vk,
+                                                         vertCommandBuffer);
+    
+    /*
+    *  Destroy Vertex Staging Buffer Once the Copy is Done
+    */
+    
+    destroy_queue_buffer(&vk, vertStagingBuffer, vertStagingBufferMemory,
+                         vertUploadValue);
+    
+    /*
+    *  Create the Sprite Scene
+    */
+    
+    startup_stage(&startup, "sprite scene");
+    
+    // Laid out and bounded on the workers
+    startup_wait(&startup, spritesTask);
+    
+    u32 spriteCount = scene.spriteCount;
+    f32 worldWidth = scene.worldWidth;
+    f32 worldHeight = scene.worldHeight;
+    SpriteArrays sprites = scene.sprites;
+    BoundsArrays spriteBounds = scene.bounds;
+    u32 *spriteColors = scene.colors;
+    
+    // Rotated sprites reach a little past the world, never more than this
+    VertexQuantization sceneQuantization =
+        vertex_quantization_make(sceneLayout, -32, -32,
+                                 worldWidth + 32, worldHeight + 32);
+    u32 sceneStride = vertexLayouts[sceneLayout].stride;
+    
+    u32 *visibleSprites = (u32 *)malloc(sizeof(u32) * spriteCount);
+    assert(visibleSprites);
+    
+    /*
+    *  Create the Sprite Batch Vertex Buffer (persistently mapped)
+    */
+    
+    // Visible sprites first, then the frame's glyph quads
+    u32 textFirstVertex = VERTICES_PER_SPRITE * spriteCount;
+    VkDeviceSize batchBufferSize = sizeof(Vertex) *
+        (textFirstVertex + VERTICES_PER_SPRITE * TEXT_MAX_GLYPHS);
+    
+    vk_create_buffer(&vk, batchBufferSize,
+                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &batchVertexBuffer, &batchVertexBufferMemory);
+    
+    Vertex *batchVertices = NULL;
+    vkMapMemory(vk.device, batchVertexBufferMemory, 0, batchBufferSize, 0,
+                (void **)&batchVertices);
+    assert(batchVertices);
+    
+    // Its contents are captured per frame, as they are rebuilt
+    capture_buffer(&capture, VERTEX_BUFFER_SPRITE_BATCH,
+                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, batchBufferSize);
+    
+    /*
+    *  Create the Sprite Record Buffer (persistently mapped)
+    */
+    
+    // What the batch holds instead when pull.vert builds the vertices
+    VkDeviceSize recordBufferSize = sizeof(SpriteRecord) * spriteCount;
+    
+    VkBuffer spriteRecordBuffer;
+    VkDeviceMemory spriteRecordBufferMemory;
+    vk_create_buffer(&vk, recordBufferSize,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &spriteRecordBuffer, &spriteRecordBufferMemory);
+    
+    SpriteRecord *spriteRecords = NULL;
+    vkMapMemory(vk.device, spriteRecordBufferMemory, 0, recordBufferSize, 0,
+                (void **)&spriteRecords);
+    assert(spriteRecords);
+    
+    VkDescriptorBufferInfo recordBufferInfo =
+    {
+        spriteRecordBuffer,
+        0, // offset
+        VK_WHOLE_SIZE
+    };
+    
+    VkWriteDescriptorSet writeRecordDescSet =
+    {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        NULL,
+        descSet,
+        2, // dstBinding
+        0, // dstArrayElement
+        1, // descriptorCount
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        NULL, // pImageInfo
+        &recordBufferInfo, // pBufferInfo
+        NULL // pTexelBufferView
+    };
+    
+    vkUpdateDescriptorSets(vk.device, 1, &writeRecordDescSet, 0, NULL);
+    
+    capture_buffer(&capture, VERTEX_BUFFER_SPRITE_RECORDS,
+                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, recordBufferSize);
+    
+    /*
+    *  GPU-driven Culling: Check Subgroup Support
+    */
+    
+    // cull.comp uses subgroup ballots to issue one atomic per subgroup
+    VkPhysicalDeviceSubgroupProperties subgroupProperties = {0};
+    subgroupProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    
+    VkPhysicalDeviceProperties2 deviceProperties2 = {0};
+    deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    deviceProperties2.pNext = &subgroupProperties;
+    
+    vkGetPhysicalDeviceProperties2(vk.physicalDevice, &deviceProperties2);
+    
+    assert(subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT);
+    assert(subgroupProperties.supportedOperations &
+           VK_SUBGROUP_FEATURE_BALLOT_BIT);
+    
+    /*
+    *  GPU-driven Culling: Upload Object Bounds, Draw Records and Vertices
+    */
+    
+    {
+        VkDeviceSize boundsSize = sizeof(f32) * 4 * spriteCount;
+        f32 *objectBounds = (f32 *)malloc(boundsSize);
+        
+        VkDeviceSize recordsSize = sizeof(DrawRecord) * spriteCount;
+        DrawRecord *drawRecords = (DrawRecord *)malloc(recordsSize);
+        
+        u32 sceneVertexCount = VERTICES_PER_SPRITE * spriteCount;
+        Vertex *vertices = (Vertex *)malloc(sizeof(Vertex) * sceneVertexCount);
+        
+        VkDeviceSize sceneBufferSize = sceneStride * sceneVertexCount;
+        u8 *packedVertices = (u8 *)malloc(sceneBufferSize);
+        
+        assert(objectBounds && drawRecords && vertices && packedVertices);
+        
+        for (u32 i = 0; i < spriteCount; i++)
+        {
+            objectBounds[i * 4 + 0] = spriteBounds.minX[i];
+            objectBounds[i * 4 + 1] = spriteBounds.minY[i];
+            objectBounds[i * 4 + 2] = spriteBounds.maxX[i];
+            objectBounds[i * 4 + 3] = spriteBounds.maxY[i];
+            
+            drawRecords[i].firstVertex = i * VERTICES_PER_SPRITE;
+            drawRecords[i].vertexCount = VERTICES_PER_SPRITE;
+        }
+        
+        generate_sprite_vertices(&sprites, 0, spriteCount, vertices);
+        
+        for (u32 i = 0; i < spriteCount; i++)
+        {
+            u32 first = i * VERTICES_PER_SPRITE;
+            vertex_quantize(sceneLayout, &sceneQuantization, vertices + first,
+                            VERTICES_PER_SPRITE, spriteColors[i],
+                            packedVertices + first * sceneStride);
+        }
+        
+        assert(vertex_quantization_check(sceneLayout, &sceneQuantization,
+                                         vertices, packedVertices,
+                                         sceneVertexCount));
+        
+        /* Edits are copied in through a shadow copy, a frame's worth of
+           staging each is plenty for a few hundred sprites */
+        sceneBounds = (ShadowBuffer *)malloc(sizeof(ShadowBuffer));
+        assert(sceneBounds);
+        shadow_buffer_init(sceneBounds, &vk, boundsSize,
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                           objectBounds, 64 * 1024);
+        
+        vk_create_device_local_buffer(&vk, recordsSize,
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                      drawRecords,
+                                      &drawRecordBuffer,
+                                      &drawRecordBufferMemory);
+        
+        sceneVertices = (ShadowBuffer *)malloc(sizeof(ShadowBuffer));
+        assert(sceneVertices);
+        shadow_buffer_init(sceneVertices, &vk, sceneBufferSize,
+                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                           packedVertices, 256 * 1024);
+        
+        capture_buffer(&capture, VERTEX_BUFFER_SPRITE_SCENE,
+                       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, sceneBufferSize);
+        capture_upload(&capture, VERTEX_BUFFER_SPRITE_SCENE, 0, packedVertices,
+                       sceneBufferSize);
+        
+        free(objectBounds);
+        free(drawRecords);
+        free(vertices);
+        free(packedVertices);
+    }
+    
+    /*
+    *  Create the Tile Map
+    */
+    
+    startup_stage(&startup, "tile map");
+    
+    // Its tiles were set on the workers, after the sprites
+    startup_wait(&startup, tileMapTask);
+    
+    TileMap tileMap = scene.tileMap;
+    u32 randomState = scene.randomState;
+    
+    tilemap_bake(&tileMap, &vk);
+    
+    if (capture.file)
+    {
+        u32 chunkCount = tileMap.widthInChunks * tileMap.heightInChunks;
+        VkDeviceSize chunkBytes = sizeof(Vertex) * TILEMAP_CHUNK_VERTICES;
+        
+        capture_buffer(&capture, VERTEX_BUFFER_TILEMAP,
+                       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                       chunkBytes * chunkCount);
+        
+        // Rebuilt one chunk at a time, only the used part of each slot
+        for (u32 chunk = 0; chunk < chunkCount; chunk++)
+        {
+            u32 vertexCount = tilemap_build_chunk(&tileMap, chunk,
+                                                  tileMap.staging);
+            capture_upload(&capture, VERTEX_BUFFER_TILEMAP,
+                           chunk * chunkBytes, tileMap.staging,
+                           vertexCount * sizeof(Vertex));
+        }
+    }
+    
+    // Written by cull.comp, read by vkCmdDrawIndirectCount
+    VkDeviceSize indirectCommandsSize =
+        sizeof(VkDrawIndirectCommand) * spriteCount;
+    
+    vk_create_buffer(&vk, indirectCommandsSize,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &indirectCommandBuffer, &indirectCommandBufferMemory);
+    
+    vk_create_buffer(&vk, sizeof(u32),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT, // cleared every frame
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &drawCountBuffer, &drawCountBufferMemory);
+    
+    /*
+    *  GPU-driven Culling: Descriptor Set
+    */
+    
+    startup_stage(&startup, "culling pipeline");
+    
+    {
+        VkDescriptorSetLayoutBinding bindings[4];
+        for (u32 i = 0; i < array_count(bindings); i++)
+        {
+            VkDescriptorSetLayoutBinding binding =
+            {
+                i, // binding
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                1, // descriptorCount
+                VK_SHADER_STAGE_COMPUTE_BIT,
+                NULL // pImmutableSamplers
+            };
+            
+            bindings[i] = binding;
+        }
+        
+        VkDescriptorSetLayoutCreateInfo layoutInfo =
+        {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            NULL,
+            0,
+            array_count(bindings),
+            bindings
+        };
+        
+        if (vkCreateDescriptorSetLayout(vk.device, &layoutInfo, NULL,
+                                        &cullDescSetLayout) != VK_SUCCESS)
+        {
+            assert(!"Failed to create cull descriptor set layout!");
+        }
+        
+        VkDescriptorPoolSize poolSize =
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            array_count(bindings) // descriptorCount
+        };
+        
+        VkDescriptorPoolCreateInfo poolInfo =
+        {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            NULL,
+            0,
+            1, // maxSets
+            1, &poolSize
+        };
+        
+        if (vkCreateDescriptorPool(vk.device, &poolInfo, NULL,
+                                   &cullDescPool) != VK_SUCCESS)
+        {
+            assert(!"Failed to create cull descriptor pool!");
+        }
+        
+        VkDescriptorSetAllocateInfo allocateInfo =
+        {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            NULL,
+            cullDescPool,
+            1, &cullDescSetLayout
+        };
+        
+        if (vkAllocateDescriptorSets(vk.device, &allocateInfo,
+                                     &cullDescSet) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate cull descriptor set!");
+        }
+        
+        // Binding order matches cull.comp
+        VkDescriptorBufferInfo bufferInfos[] =
+        {
+            { sceneBounds->buffer, 0, VK_WHOLE_SIZE },
+            { drawRecordBuffer, 0, VK_WHOLE_SIZE },
+            { indirectCommandBuffer, 0, VK_WHOLE_SIZE },
+            { drawCountBuffer, 0, VK_WHOLE_SIZE }
+        };
+        
+        VkWriteDescriptorSet writes[array_count(bufferInfos)];
+        for (u32 i = 0; i < array_count(bufferInfos); i++)
+        {
+            VkWriteDescriptorSet write =
+            {
+                VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                NULL,
+                cullDescSet,
+                i, // dstBinding
+                0, // dstArrayElement
+                1, // descriptorCount
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                NULL, // pImageInfo
+                &bufferInfos[i],
+                NULL // pTexelBufferView
+            };
+            
+            writes[i] = write;
+        }
+        
+        vkUpdateDescriptorSets(vk.device, array_count(writes), writes,
+                               0, NULL);
+    }
     
     /*
-    *  Destroy Vertex Staging Buffer and Free its Memory
+    *  GPU-driven Culling: Compute Pipeline
     */
     
-    vkDestroyBuffer(vk.device, vertStagingBuffer, NULL);
-    vkFreeMemory(vk.device, vertStagingBufferMemory, NULL);
+    {
+        VkPushConstantRange cullPushRange =
+        {
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            0, // offset
+            sizeof(CullConstants)
+        };
+        
+        VkPipelineLayoutCreateInfo layoutInfo =
+        {
+            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            NULL,
+            0,
+            1, &cullDescSetLayout,
+            1, &cullPushRange
+        };
+        
+        if (vkCreatePipelineLayout(vk.device, &layoutInfo, NULL,
+                                   &cullPipelineLayout) != VK_SUCCESS)
+        {
+            assert(!"Failed to create cull pipeline layout!");
+        }
+        
+        LoadedFile cullShader = shaderFiles.code[SHADER_CULL];
+        VkShaderModule cullShaderModule =
+            vk_create_shader_module(&vk, cullShader.data, cullShader.size);
+        free_shader_file(&shaderFiles, SHADER_CULL);
+        
+        VkComputePipelineCreateInfo pipelineInfo =
+        {
+            VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            NULL,
+            0,
+            {
+                VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                NULL,
+                0,
+                VK_SHADER_STAGE_COMPUTE_BIT,
+                cullShaderModule,
+                "main", // entry point
+                NULL // specialization info
+            },
+            cullPipelineLayout,
+            NULL, 0 // (no base pipeline)
+        };
+        
+        if (vkCreateComputePipelines(vk.device, VK_NULL_HANDLE, 1,
+                                     &pipelineInfo, NULL,
+                                     &cullPipeline) != VK_SUCCESS)
+        {
+            assert(!"Failed to create cull compute pipeline!");
+        }
+        
+        vkDestroyShaderModule(vk.device, cullShaderModule, NULL);
+    }
     
     /*
-    *  Define Vertex Input Layout
+    *  Create Pipeline Layout
     */
     
-    u32 stride = sizeof(f32) * 4;
-    
-    VkVertexInputBindingDescription vertInputBindDesc =
-    {
-        0, // binding index
-        stride,
-        VK_VERTEX_INPUT_RATE_VERTEX // per-vertex data (not per-instance)
-    };
+    startup_stage(&startup, "pipelines");
     
-    VkVertexInputBindingDescription vertInputBindDescs[] =
+    // Per-draw transform and tint, pushed before each vkCmdDraw
+    VkPushConstantRange pushConstantRange =
     {
-        vertInputBindDesc
+        VK_SHADER_STAGE_VERTEX_BIT,
+        0, // offset
+        sizeof(PushConstants) // size (48 bytes, well under the 128 minimum)
     };
     
-    VkVertexInputAttributeDescription vertInputAttrDesc1 =
-    {
-        0, // location in the shader
-        0, // binding (same as buffer binding)
-        VK_FORMAT_R32G32_SFLOAT,
-        0 // byte offset in the struct
-    };
+    VkPushConstantRange pushConstantRanges[] = { pushConstantRange };
     
-    VkVertexInputAttributeDescription vertInputAttrDesc2 =
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo =
     {
-        1, // location in the shader
-        0, // binding
-        VK_FORMAT_R32G32_SFLOAT,
-        sizeof(f32) * 2 // byte offset
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        array_count(descSetLayouts),
+        descSetLayouts,
+        array_count(pushConstantRanges),
+        pushConstantRanges
     };
     
-    VkVertexInputAttributeDescription vertInputAttrDescs[] =
+    if (vkCreatePipelineLayout(vk.device, &pipelineLayoutInfo, NULL,
+                               &pipelineLayout) != VK_SUCCESS)
     {
-        vertInputAttrDesc1,
-        vertInputAttrDesc2
-    };
+        assert(!"Failed to create pipeline layout!");
+    }
     
     /*
-    *  Define Vertex Input Create Info
+    *  Create the Pipeline Cache and the Sprite Pipeline
     */
     
-    VkPipelineVertexInputStateCreateInfo vertexInputStateInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        NULL,
-        0,
-        array_count(vertInputBindDescs),
-        vertInputBindDescs,
-        array_count(vertInputAttrDescs),
-        vertInputAttrDescs
-    };
-    
-    VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
-        VK_FALSE // primitiveRestartEnable
-    };
+    // The shader modules stay alive, pipelines are created on first use
+    PipelineCache *pipelineCache =
+        (PipelineCache *)calloc(1, sizeof(PipelineCache));
+    assert(pipelineCache);
+    
+    pipeline_cache_init(pipelineCache, &vk, vk.extendedDynamicState);
+    
+    PipelineKey spriteKey = pipeline_key_make(vertShaderModule,
+                                              fragShaderModule,
+                                              pipelineLayout, renderPass,
+                                              VERTEX_LAYOUT_SPRITE,
+                                              BLEND_MODE_ALPHA,
+                                              DEPTH_MODE_NONE);
+    
+    // The depth render pass variants, opaque and blended
+    PipelineKey opaqueKey = pipeline_key_make(vertShaderModule,
+                                              fragShaderModule,
+                                              pipelineLayout, depthRenderPass,
+                                              VERTEX_LAYOUT_SPRITE,
+                                              BLEND_MODE_OPAQUE,
+                                              DEPTH_MODE_TEST_WRITE);
+    
+    PipelineKey transparentKey = opaqueKey;
+    transparentKey.blendMode = BLEND_MODE_ALPHA;
+    transparentKey.depthMode = DEPTH_MODE_TEST;
+    
+    // Text is the sprite pipeline with the distance field fragment shader
+    PipelineKey textKey = spriteKey;
+    textKey.fragmentShader = sdfShaderModule;
+    
+    PipelineKey textTransparentKey = transparentKey;
+    textTransparentKey.fragmentShader = sdfShaderModule;
+    
+    /* The sprite scene's vertices may be quantized, and may carry a color.
+       Its draws are untinted, so only the vertex color needs the tint
+       multiply. */
+    bool sceneColor =
+        vertexLayouts[sceneLayout].colorFormat != VK_FORMAT_UNDEFINED;
+    
+    PipelineKey sceneKey = spriteKey;
+    sceneKey.vertexShader = sceneColor ? colorShaderModule : vertShaderModule;
+    sceneKey.vertexLayout = (u8)sceneLayout;
+    sceneKey.features = SHADER_FEATURE_TEXTURE |
+        (sceneColor ? SHADER_FEATURE_TINT : 0);
+    pipeline_key_set_decode(&sceneKey, &sceneQuantization);
+    
+    PipelineKey sceneOpaqueKey = sceneKey;
+    sceneOpaqueKey.renderPass = depthRenderPass;
+    sceneOpaqueKey.blendMode = BLEND_MODE_OPAQUE;
+    sceneOpaqueKey.depthMode = DEPTH_MODE_TEST_WRITE;
+    
+    PipelineKey sceneTransparentKey = sceneOpaqueKey;
+    sceneTransparentKey.blendMode = BLEND_MODE_ALPHA;
+    sceneTransparentKey.depthMode = DEPTH_MODE_TEST;
+    
+    // CPU-batched sprites as records, expanded by pull.vert
+    PipelineKey pullKey = spriteKey;
+    pullKey.vertexShader = pullShaderModule;
+    pullKey.vertexLayout = VERTEX_LAYOUT_PULLED;
+    
+    PipelineKey pullOpaqueKey = opaqueKey;
+    pullOpaqueKey.vertexShader = pullShaderModule;
+    pullOpaqueKey.vertexLayout = VERTEX_LAYOUT_PULLED;
+    
+    PipelineKey pullTransparentKey = transparentKey;
+    pullTransparentKey.vertexShader = pullShaderModule;
+    pullTransparentKey.vertexLayout = VERTEX_LAYOUT_PULLED;
     
     /*
-    *  Define Dynamic State Crate Info
+    *  Per-draw Push Constants
     */
     
-    VkPipelineDynamicStateCreateInfo dynamicStateInfo =
+    // The same quad drawn several times, each with its own transform and tint.
+    // None of these draws touch the descriptor set or the uniform buffer.
+    PushConstants quadDraws[] =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
-        NULL,
-        0,
-        0, NULL // No dynamic states
+        push_constants_make(0, 0, 1.0f, 0.0f, 1, 1, 1, 1),
+        push_constants_make(250, 100, 1.0f, SIMD_PI / 8.0f, 1, 0.5f, 0.5f, 1),
+        push_constants_make(450, 150, 1.5f, SIMD_PI / 4.0f, 0.5f, 1, 0.5f, 1),
+        push_constants_make(650, 300, 0.5f, SIMD_PI / 3.0f, 0.5f, 0.5f, 1, 0.75f)
     };
     
     /*
-    *  Define Viewport State Create Info
+    *  Main Loop
     */
     
-    VkViewport viewport =
-    {
-        0, 0, // x, y
-        (f32)vk.swapchainExtents.width,
-        (f32)vk.swapchainExtents.height,
-        0, 0 // min, max depth
-    };
+    startup_stage(&startup, "draw queue and frame graphs");
     
-    VkViewport viewports[] = { viewport };
+    /*
+    *  Draw Queue and the Handles its Commands Refer to
+    */
     
-    VkRect2D scissor =
-    {
-        {0, 0}, // offset
-        vk.swapchainExtents
-    };
+    DrawQueue drawQueue;
+    draw_queue_init(&drawQueue, 1024, &jobQueue);
     
-    VkRect2D scissors[] = { scissor };
+    DrawStateTable *drawStateTable =
+        (DrawStateTable *)calloc(1, sizeof(DrawStateTable));
+    assert(drawStateTable);
     
-    VkPipelineViewportStateCreateInfo viewportStateInfo =
+    PipelineKey *pipelineKeys[] =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-        NULL,
-        0,
-        array_count(viewports),
-        viewports,
-        array_count(scissors),
-        scissors
+        &spriteKey, // PIPELINE_SPRITE
+        &opaqueKey, // PIPELINE_SPRITE_OPAQUE
+        &transparentKey, // PIPELINE_SPRITE_TRANSPARENT
+        &textKey, // PIPELINE_TEXT
+        &textTransparentKey, // PIPELINE_TEXT_TRANSPARENT
+        &sceneKey, // PIPELINE_SCENE
+        &sceneOpaqueKey, // PIPELINE_SCENE_OPAQUE
+        &sceneTransparentKey, // PIPELINE_SCENE_TRANSPARENT
+        &pullKey, // PIPELINE_SPRITE_PULL
+        &pullOpaqueKey, // PIPELINE_SPRITE_PULL_OPAQUE
+        &pullTransparentKey // PIPELINE_SPRITE_PULL_TRANSPARENT
     };
     
-    /*
-    *  Define Rasterization State Create Info
-    */
-    
-    VkPipelineRasterizationStateCreateInfo rasterizationStateInfo =
+    for (u32 i = 0; i < array_count(pipelineKeys); i++)
     {
-        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_FALSE, // depthClampEnable
-        VK_FALSE, // rasterizerDiscardEnable
-        VK_POLYGON_MODE_FILL, // polygonMode (solid triangles)
-        VK_CULL_MODE_BACK_BIT, // cullMode
-        VK_FRONT_FACE_CLOCKWISE, // frontFace
-        VK_FALSE, 0, 0, 0, // no depth bias
-        1.0f // lineWidth
-    };
-    
-    /*
-    *  Define Multisample State Create Info
-    */
-    
-    VkPipelineMultisampleStateCreateInfo multisampleStateInfo =
+        PipelineKey overdrawKey = *pipelineKeys[i];
+        overdrawKey.fragmentShader = overdrawShaderModule;
+        overdrawKey.blendMode = BLEND_MODE_ADDITIVE;
+        
+        u32 overdrawSlot = PIPELINE_OVERDRAW + i;
+        
+        drawStateTable->pipelines[i] =
+            pipeline_cache_get(pipelineCache, pipelineKeys[i]);
+        drawStateTable->pipelines[overdrawSlot] =
+            pipeline_cache_get(pipelineCache, &overdrawKey);
+        
+        drawStateTable->pipelineLayouts[i] = pipelineKeys[i]->pipelineLayout;
+        drawStateTable->pipelineLayouts[overdrawSlot] =
+            pipelineKeys[i]->pipelineLayout;
+        
+        drawStateTable->cullModes[i] = pipelineKeys[i]->cullMode;
+        drawStateTable->cullModes[overdrawSlot] = pipelineKeys[i]->cullMode;
+        
+        drawStateTable->frontFaces[i] = (VkFrontFace)pipelineKeys[i]->frontFace;
+        drawStateTable->frontFaces[overdrawSlot] =
+            (VkFrontFace)pipelineKeys[i]->frontFace;
+    }
+    drawStateTable->dynamicRasterState = pipelineCache->dynamicRasterState;
+    drawStateTable->descriptorSets[DESC_SET_TEXTURE] = descSet;
+    drawStateTable->descriptorSets[DESC_SET_TEXT] = textDescSet;
+    for (u32 i = 0; i < PANEL_COUNT; i++)
     {
-        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_SAMPLE_COUNT_1_BIT, // rasterizationSamples
-        VK_FALSE, // sampleShadingEnable
-        0, // minSampleShading
-        NULL, // pSampleMask
-        VK_FALSE, // alphaToCoverageEnable
-        VK_FALSE, // alphaToOneEnable
-    };
+        drawStateTable->descriptorSets[DESC_SET_PANEL_FIRST + i] =
+            panelDescSets[i];
+    }
+    drawStateTable->vertexBuffers[VERTEX_BUFFER_QUAD] = vertexBuffer;
+    drawStateTable->vertexBuffers[VERTEX_BUFFER_SPRITE_BATCH] =
+        batchVertexBuffer;
+    drawStateTable->vertexBuffers[VERTEX_BUFFER_SPRITE_SCENE] =
+        sceneVertices->buffer;
+    drawStateTable->vertexBuffers[VERTEX_BUFFER_TILEMAP] =
+        tileMap.vertexBuffer;
+    drawStateTable->vertexBuffers[VERTEX_BUFFER_SPRITE_RECORDS] =
+        spriteRecordBuffer;
+    
+    // What a replayed capture's buffers have to match
+    VkDeviceSize vertexBufferSizes[DRAW_MAX_VERTEX_BUFFERS] = {0};
+    vertexBufferSizes[VERTEX_BUFFER_QUAD] = vertBufferSize;
+    vertexBufferSizes[VERTEX_BUFFER_SPRITE_BATCH] = batchBufferSize;
+    vertexBufferSizes[VERTEX_BUFFER_SPRITE_SCENE] = sceneVertices->size;
+    vertexBufferSizes[VERTEX_BUFFER_TILEMAP] =
+        sizeof(Vertex) * TILEMAP_CHUNK_VERTICES *
+        tileMap.widthInChunks * tileMap.heightInChunks;
+    vertexBufferSizes[VERTEX_BUFFER_SPRITE_RECORDS] = recordBufferSize;
     
     /*
-    *  Define Color Blend State Create Info
+    *  Frame Render Graphs
     */
     
-    VkFlags colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT |
-        VK_COLOR_COMPONENT_G_BIT |
-        VK_COLOR_COMPONENT_B_BIT |
-        VK_COLOR_COMPONENT_A_BIT;
-    
-    VkPipelineColorBlendAttachmentState colorBlendAttachment =
+    FrameContext frame = {0};
+    frame.cullPipeline = cullPipeline;
+    frame.cullPipelineLayout = cullPipelineLayout;
+    frame.cullDescSet = cullDescSet;
+    frame.drawCountBuffer = drawCountBuffer;
+    frame.objectCount = spriteCount;
+    frame.extent = vk.swapchainExtents;
+    frame.drawQueue = &drawQueue;
+    frame.drawStateTable = drawStateTable;
+    frame.text = text;
+    frame.tileMap = &tileMap;
+    frame.sceneVertices = sceneVertices;
+    frame.sceneBounds = sceneBounds;
+    frame.streamer = streamer;
+    frame.uploadQueue = vk.uploadQueue;
+    
+    if (exporting)
     {
-        VK_TRUE, // blendEnable
-        VK_BLEND_FACTOR_SRC_ALPHA,
-        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-        VK_BLEND_OP_ADD,
-        VK_BLEND_FACTOR_SRC_ALPHA,
-        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-        VK_BLEND_OP_ADD,
-        colorWriteMask,
-    };
+        frame.readback = (Readback *)malloc(sizeof(Readback));
+        if (!readback_init(frame.readback, &vk, exportFileName))
+        {
+            assert(!"Failed to create the export file");
+        }
+    }
+    
+    GpuStats gpuStats;
+    gpu_stats_init(&gpuStats, &vk, vk.pipelineStatisticsQuery);
+    frame.gpuStats = &gpuStats;
     
-    VkPipelineColorBlendAttachmentState
-        colorBlendAttachments[] = { colorBlendAttachment };
+    /* One graph per culling mode and depth setting, indexed by
+       globalDepthPass * 2 + globalGpuCulling. They all declare the same
+       passes, but only in the GPU ones does the main pass read what the
+       culling passes write, so the CPU ones compile them away. */
+    RenderGraph frameGraphs[4] = {0};
+    u32 swapchainResources[4];
     
-    VkPipelineColorBlendStateCreateInfo colorBlendStateInfo =
+    for (u32 graphIndex = 0; graphIndex < 4; graphIndex++)
     {
-        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_FALSE,
-        VK_LOGIC_OP_CLEAR,
-        array_count(colorBlendAttachments),
-        colorBlendAttachments,
-        {0, 0, 0, 0}
-    };
+        RenderGraph *graph = &frameGraphs[graphIndex];
+        bool depthPass = graphIndex >= 2;
+        bool gpuCulling = graphIndex & 1;
+        
+        // Acquired with a semaphore wait, handed to present when done
+        u32 swapchain = rg_import_image(graph, "swapchain",
+                                        VK_IMAGE_ASPECT_COLOR_BIT,
+                                        RG_ACCESS_SWAPCHAIN_ACQUIRE,
+                                        RG_ACCESS_PRESENT);
+        
+        // Cleared on load every frame, nothing to keep, so the graph
+        // creates it and places it with its other transients
+        u32 depth = rg_create_transient_image(graph, "depth", depthFormat,
+                                              vk.swapchainExtents,
+                                              VK_IMAGE_ASPECT_DEPTH_BIT);
+        
+        // Edited sprites are copied in before culling and drawing
+        u32 bounds = rg_import_buffer(graph, "object bounds",
+                                      sceneBounds->buffer,
+                                      RG_ACCESS_COMPUTE_READ,
+                                      RG_ACCESS_COMPUTE_READ);
+        u32 scene = rg_import_buffer(graph, "scene vertices",
+                                     sceneVertices->buffer,
+                                     RG_ACCESS_VERTEX_READ,
+                                     RG_ACCESS_VERTEX_READ);
+        u32 records = rg_import_buffer(graph, "draw records",
+                                       drawRecordBuffer,
+                                       RG_ACCESS_NONE, RG_ACCESS_NONE);
+        u32 commands = rg_import_buffer(graph, "indirect commands",
+                                        indirectCommandBuffer,
+                                        RG_ACCESS_NONE, RG_ACCESS_NONE);
+        u32 count = rg_import_buffer(graph, "draw count", drawCountBuffer,
+                                     RG_ACCESS_NONE, RG_ACCESS_NONE);
+        
+        // First, with barriers of its own around whatever it copies
+        u32 uploadPass = rg_add_pass(graph, "upload queue",
+                                     upload_queue_pass, &frame);
+        rg_pass_side_effects(graph, uploadPass);
+        
+        // Sampled between frames, cells are patched in before the main pass
+        u32 atlas = rg_import_image(graph, "glyph atlas",
+                                    VK_IMAGE_ASPECT_COLOR_BIT,
+                                    RG_ACCESS_FRAGMENT_SAMPLED_READ,
+                                    RG_ACCESS_FRAGMENT_SAMPLED_READ);
+        rg_set_image(graph, atlas, text->atlasImage, text->atlasView);
+        
+        u32 atlasPass = rg_add_pass(graph, "glyph atlas upload",
+                                    text_atlas_upload_pass, &frame);
+        rg_pass_access(graph, atlasPass, atlas, RG_ACCESS_TRANSFER_WRITE);
+        
+        // Baked at startup, edited chunks are copied in before drawing
+        u32 tiles = rg_import_buffer(graph, "tile map vertices",
+                                     tileMap.vertexBuffer,
+                                     RG_ACCESS_VERTEX_READ,
+                                     RG_ACCESS_VERTEX_READ);
+        
+        u32 tilesPass = rg_add_pass(graph, "tile map upload",
+                                    tilemap_upload_pass, &frame);
+        rg_pass_access(graph, tilesPass, tiles, RG_ACCESS_TRANSFER_WRITE);
+        
+        u32 scenePass = rg_add_pass(graph, "scene upload",
+                                    scene_upload_pass, &frame);
+        rg_pass_access(graph, scenePass, bounds, RG_ACCESS_TRANSFER_WRITE);
+        rg_pass_access(graph, scenePass, scene, RG_ACCESS_TRANSFER_WRITE);
+        
+        // Manages the barriers of its own images, nothing for the graph
+        u32 streamPass = rg_add_pass(graph, "texture streaming",
+                                     texture_stream_pass, &frame);
+        rg_pass_side_effects(graph, streamPass);
+        
+        u32 clearPass = rg_add_pass(graph, "clear draw count",
+                                    clear_draw_count_pass, &frame);
+        rg_pass_access(graph, clearPass, count, RG_ACCESS_TRANSFER_WRITE);
+        
+        u32 cullPass = rg_add_pass(graph, "cull", cull_pass, &frame);
+        rg_pass_access(graph, cullPass, bounds, RG_ACCESS_COMPUTE_READ);
+        rg_pass_access(graph, cullPass, records, RG_ACCESS_COMPUTE_READ);
+        rg_pass_access(graph, cullPass, commands, RG_ACCESS_COMPUTE_WRITE);
+        rg_pass_access(graph, cullPass, count, RG_ACCESS_COMPUTE_READ_WRITE);
+        
+        u32 mainPass = rg_add_pass(graph, "main", main_pass, &frame);
+        if (gpuCulling)
+        {
+            rg_pass_access(graph, mainPass, commands, RG_ACCESS_INDIRECT_READ);
+            rg_pass_access(graph, mainPass, count, RG_ACCESS_INDIRECT_READ);
+            rg_pass_access(graph, mainPass, scene, RG_ACCESS_VERTEX_READ);
+        }
+        rg_pass_access(graph, mainPass, atlas, RG_ACCESS_FRAGMENT_SAMPLED_READ);
+        rg_pass_access(graph, mainPass, tiles, RG_ACCESS_VERTEX_READ);
+        rg_pass_access(graph, mainPass, swapchain,
+                       RG_ACCESS_COLOR_ATTACHMENT_WRITE);
+        if (depthPass)
+        {
+            rg_pass_access(graph, mainPass, depth,
+                           RG_ACCESS_DEPTH_ATTACHMENT_WRITE);
+        }
+        
+        // The copy is read by the CPU a frame later, hence the host read
+        if (frame.readback)
+        {
+            u32 ring = rg_import_buffer(graph, "readback ring",
+                                        frame.readback->buffer,
+                                        RG_ACCESS_HOST_READ,
+                                        RG_ACCESS_HOST_READ);
+            
+            u32 readbackPass = rg_add_pass(graph, "readback", readback_pass,
+                                           &frame);
+            rg_pass_access(graph, readbackPass, swapchain,
+                           RG_ACCESS_TRANSFER_READ);
+            rg_pass_access(graph, readbackPass, ring,
+                           RG_ACCESS_TRANSFER_WRITE);
+        }
+        
+        rg_compile(graph, &vk);
+        swapchainResources[graphIndex] = swapchain;
+        
+        // The depth image only exists once the graph is compiled
+        for (u32 i = 0; depthPass && i < array_count(vk.swapchainImageViews);
+             i++)
+        {
+            VkImageView attachments[] =
+            {
+                vk.swapchainImageViews[i],
+                rg_image_view(graph, depth)
+            };
+            
+            VkFramebufferCreateInfo framebufferInfo =
+            {
+                VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+                NULL,
+                0,
+                depthRenderPass,
+                array_count(attachments),
+                attachments,
+                vk.swapchainExtents.width,
+                vk.swapchainExtents.height,
+                1, // layers
+            };
+            
+            if (vkCreateFramebuffer(vk.device, &framebufferInfo, NULL,
+                                    &depthFramebuffers[graphIndex][i]) !=
+                VK_SUCCESS)
+            {
+                assert(!"Failed to create depth framebuffer");
+            }
+        }
+    }
     
     /*
-    *  Create Pipeline Layout
+    *  Replay the Captured Startup Uploads
     */
     
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        NULL,
-        0,
-        array_count(descSetLayouts),
-        descSetLayouts,
-        0, NULL // (no push constant ranges)
-    };
+    ReplayReport replayReport = {0};
+    LARGE_INTEGER replayStart = {0};
+    LARGE_INTEGER replayLastFrame = {0};
+    u64 replayLastTicks = 0;
     
-    if (vkCreatePipelineLayout(vk.device, &pipelineLayoutInfo, NULL,
-                               &pipelineLayout) != VK_SUCCESS)
+    // Staging for the replayed uploads, queued and copied in by the frames
+    UploadStaging replayStaging = {0};
+    if (replaying)
     {
-        assert(!"Failed to create pipeline layout!");
+        upload_staging_init(&replayStaging, &vk, 4 * 1024 * 1024);
     }
     
-    /*
-    *  Create Graphics Pipeline
-    */
+    LARGE_INTEGER perfFrequency;
+    QueryPerformanceFrequency(&perfFrequency);
     
-    VkGraphicsPipelineCreateInfo pipelineInfo =
+    if (replaying)
     {
-        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        NULL,
-        0,
-        array_count(shaderStageInfo),
-        shaderStageInfo,
-        &vertexInputStateInfo,
-        &inputAssemblyStateInfo,
-        NULL, // pTessellationState
-        &viewportStateInfo,
-        &rasterizationStateInfo,
-        &multisampleStateInfo,
-        NULL, // pDepthStencilState
-        &colorBlendStateInfo,
-        &dynamicStateInfo,
-        pipelineLayout,
-        renderPass,
-        0, // subpass index
-        NULL, 0 // (no base pipeline)
-    };
-    
-    // Create the graphics pipeline
-    if (vkCreateGraphicsPipelines(vk.device, VK_NULL_HANDLE, 1,
-                                  &pipelineInfo, NULL,
-                                  &graphicsPipeline) != VK_SUCCESS)
-    {
-        assert(!"Failed to create graphics pipeline!");
+        // Everything before the first FRAME record
+        while (!capture_next_is_frame(&replay))
+        {
+            CaptureRecordType type;
+            u32 size;
+            void *payload = capture_next_record(&replay, &type, &size);
+            
+            if (type == CAPTURE_RECORD_BUFFER)
+            {
+                CaptureBuffer *buffer = (CaptureBuffer *)payload;
+                assert(buffer->slot < DRAW_MAX_VERTEX_BUFFERS);
+                assert(drawStateTable->vertexBuffers[buffer->slot]);
+                assert(buffer->size == vertexBufferSizes[buffer->slot] &&
+                       "Captured buffer size differs from this run's");
+            }
+            else if (type == CAPTURE_RECORD_UPLOAD)
+            {
+                replay_upload(&vk, drawStateTable, batchVertices,
+                              spriteRecords, NULL, (CaptureUpload *)payload);
+            }
+        }
+        
+        QueryPerformanceCounter(&replayStart);
+        replayLastFrame = replayStart;
     }
     
-    /*
-    *  Destroy Shader Modules and Create Frame Fence
-    */
+    Simulation simulation;
+    sim_start(&simulation, worldWidth, (f32)vk.swapchainExtents.width);
     
-    vkDestroyShaderModule(vk.device, vertShaderModule, NULL);
-    vkDestroyShaderModule(vk.device, fragShaderModule, NULL);
+    u32 frameIndex = 0;
     
-    VkFenceCreateInfo fenceInfo =
-    {
-        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        NULL,
-        0
-    };
+    // First of the sprites the edit demo spins
+    u32 selectionFirst = 0;
     
-    vkCreateFence(vk.device, &fenceInfo, NULL,
-                  &frameFence);
+    // For the frame time shown on screen
+    LARGE_INTEGER lastFrameStart;
+    QueryPerformanceCounter(&lastFrameStart);
+    f32 frameMilliseconds = 0;
     
-    /*
-    *  Main Loop
-    */
+    // Timeline value of the last frame submitted, one frame is in flight
+    u64 frameValue = 0;
+    
+    startup_stage(&startup, "first frame");
     
     globalRunning = true;
     while (globalRunning)
     {
         /*
-        *  Wait for the Frame Fence, then Reset it
+        *  Wait for the Previous Frame on the GPU Timeline
+        */
+        
+        gpu_timeline_wait(&vk, frameValue);
+        destroy_queue_collect(&vk);
+        
+        if (frame.readback)
+        {
+            readback_collect(frame.readback, &vk);
+        }
+        
+        /*
+        *  Latch Input from the Window Thread
+        */
+        
+        // Once, before anything reads the toggles, so they hold all frame
+        PlatformEvent event;
+        while (event_ring_pop(&globalEvents, &event))
+        {
+            if (event.type == PLATFORM_EVENT_KEY_DOWN)
+            {
+                handle_key_down(event.key);
+            }
+        }
+        
+        if (globalEvents.quitRequested)
+        {
+            globalRunning = false;
+            break;
+        }
+        
+        /*
+        *  Read the Next Replayed Frame
+        */
+        
+        CaptureFrame *replayFrame = NULL;
+        if (replaying)
+        {
+            CaptureRecordType type;
+            u32 size;
+            replayFrame = (CaptureFrame *)capture_next_record(&replay, &type,
+                                                              &size);
+            
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            
+            if (frameIndex > 0)
+            {
+                // The previous frame, from one timeline wait to the next
+                f32 replayedMs = 1000.0f *
+                    (f32)(now.QuadPart - replayLastFrame.QuadPart) /
+                    (f32)perfFrequency.QuadPart;
+                f32 recordedMs = replayFrame ? 1000.0f *
+                    (f32)(replayFrame->ticks - replayLastTicks) /
+                    (f32)replay.header->ticksPerSecond : 0.0f;
+                replay_report_add(&replayReport, replayedMs, recordedMs);
+            }
+            replayLastFrame = now;
+            
+            if (!replayFrame)
+            {
+                break;
+            }
+            assert(type == CAPTURE_RECORD_FRAME);
+            replayLastTicks = replayFrame->ticks;
+            
+            // Modes come from the capture, not from the keyboard
+            u32 flags = replayFrame->flags;
+            globalGpuCulling = (flags & CAPTURE_FRAME_GPU_CULLING) != 0;
+            globalDepthPass = (flags & CAPTURE_FRAME_DEPTH_PASS) != 0;
+            globalOverdraw = (flags & CAPTURE_FRAME_OVERDRAW) != 0;
+            
+            if (replayTimed)
+            {
+                // Hold the frame back until the point it was recorded at
+                u64 target = replayFrame->ticks *
+                    (u64)perfFrequency.QuadPart /
+                    replay.header->ticksPerSecond;
+                do
+                {
+                    QueryPerformanceCounter(&now);
+                    YieldProcessor();
+                }
+                while ((u64)(now.QuadPart - replayStart.QuadPart) < target);
+            }
+        }
+        
+        frameIndex++;
+        
+        // Counters of a frame the GPU finished earlier, if available
+        gpu_stats_new_frame(&gpuStats, &vk, frameIndex);
+        
+        text_new_frame(text, frameIndex);
+        
+        LARGE_INTEGER frameStart;
+        QueryPerformanceCounter(&frameStart);
+        frameMilliseconds = 1000.0f *
+            (f32)(frameStart.QuadPart - lastFrameStart.QuadPart) /
+            (f32)perfFrequency.QuadPart;
+        lastFrameStart = frameStart;
+        
+        /*
+        *  Cull the Sprite Scene and Batch the Visible Sprites
+        */
+        
+        // Wherever the simulation has got to, sampled once for the frame
+        SimState simState = sim_interpolate(&simulation, frameStart.QuadPart);
+        f32 cameraX = simState.cameraX;
+        f32 cameraY = simState.cameraY;
+        
+        Rect2 view =
+        {
+            cameraX, cameraY,
+            cameraX + (f32)vk.swapchainExtents.width,
+            cameraY + (f32)vk.swapchainExtents.height
+        };
+        
+        if (replayFrame)
+        {
+            view = replayFrame->view;
+        }
+        
+        /*
+        *  Edit a Few Hundred Sprites
         */
         
-        vkWaitForFences(vk.device, 1, &frameFence, VK_TRUE, UINT64_MAX);
-        vkResetFences(vk.device, 1, &frameFence);
+        /* Like an editor dragging a selection around: a run of consecutive
+           sprites spins, plus a few strays anywhere. Only their vertices
+           and bounds are written to the shadow copies, and only those
+           ranges get copied to the GPU. Replays bring their own uploads. */
+        if (!replaying)
+        {
+            if (frameIndex % 120 == 1)
+            {
+                selectionFirst = random_next(&randomState) %
+                    (spriteCount - SELECTION_SIZE);
+            }
+            
+            u32 edited[SELECTION_SIZE + SELECTION_STRAYS];
+            for (u32 i = 0; i < SELECTION_SIZE; i++)
+            {
+                edited[i] = selectionFirst + i;
+            }
+            for (u32 i = 0; i < SELECTION_STRAYS; i++)
+            {
+                edited[SELECTION_SIZE + i] =
+                    random_next(&randomState) % spriteCount;
+            }
+            
+            SpriteBoundsWork boundsWork = { &sprites, &spriteBounds };
+            f32 *shadowBounds = (f32 *)sceneBounds->shadow;
+            VkDeviceSize spriteBytes = sceneStride * VERTICES_PER_SPRITE;
+            
+            for (u32 i = 0; i < array_count(edited); i++)
+            {
+                u32 sprite = edited[i];
+                sprites.rotation[sprite] += 0.02f;
+                
+                compute_sprite_bounds_chunk(&boundsWork, sprite, 1, 0);
+                shadowBounds[sprite * 4 + 0] = spriteBounds.minX[sprite];
+                shadowBounds[sprite * 4 + 1] = spriteBounds.minY[sprite];
+                shadowBounds[sprite * 4 + 2] = spriteBounds.maxX[sprite];
+                shadowBounds[sprite * 4 + 3] = spriteBounds.maxY[sprite];
+                shadow_buffer_mark(sceneBounds, sprite * 4 * sizeof(f32),
+                                   4 * sizeof(f32));
+                
+                Vertex spriteVertices[VERTICES_PER_SPRITE];
+                generate_sprite_vertices(&sprites, sprite, 1, spriteVertices);
+                vertex_quantize(sceneLayout, &sceneQuantization,
+                                spriteVertices, VERTICES_PER_SPRITE,
+                                spriteColors[sprite],
+                                sceneVertices->shadow + sprite * spriteBytes);
+                shadow_buffer_mark(sceneVertices, sprite * spriteBytes,
+                                   spriteBytes);
+            }
+        }
+        
+        shadow_buffer_flush(sceneVertices, frameIndex);
+        shadow_buffer_flush(sceneBounds, frameIndex);
+        
+        // With GPU culling on, this is all done by cull.comp instead
+        u32 visibleSpriteCount = 0;
+        if (!globalGpuCulling && !replaying)
+        {
+            visibleSpriteCount = cull_bounds(&jobQueue, &spriteBounds,
+                                             spriteCount, view,
+                                             visibleSprites);
+            
+            // The timeline wait above guarantees the GPU is done with it
+            if (globalVertexPulling)
+            {
+                batch_sprite_records(&jobQueue, &sprites, visibleSprites,
+                                     visibleSpriteCount, spriteRecords);
+            }
+            else
+            {
+                batch_sprites(&jobQueue, &sprites, visibleSprites,
+                              visibleSpriteCount, batchVertices);
+            }
+        }
         
         /*
         *  Acquire the "Next" Swap Chain Image
@@ -1771,16 +4189,376 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         assert(imageIndex != UINT32_MAX);
         
         /*
-        *  Process Windows' messages
+        *  Build the Draw Queue
+        */
+        
+        draw_queue_reset(&drawQueue);
+        
+        if (replayFrame)
+        {
+            // The recorded draws with their keys, then the frame's uploads
+            while (!capture_next_is_frame(&replay))
+            {
+                CaptureRecordType type;
+                u32 size;
+                void *payload = capture_next_record(&replay, &type, &size);
+                
+                if (type == CAPTURE_RECORD_DRAW)
+                {
+                    CaptureDraw *draw = (CaptureDraw *)payload;
+                    DrawCommand command = capture_draw_command(draw);
+                    
+                    // Indirect arguments are this run's, written by cull.comp
+                    if (command.kind == DRAW_KIND_INDIRECT_COUNT)
+                    {
+                        command.indirectBuffer = indirectCommandBuffer;
+                        command.countBuffer = drawCountBuffer;
+                    }
+                    
+                    draw_queue_push_keyed(&drawQueue, draw->key, &command);
+                }
+                else if (type == CAPTURE_RECORD_UPLOAD)
+                {
+                    replay_upload(&vk, drawStateTable, batchVertices,
+                                  spriteRecords, &replayStaging,
+                                  (CaptureUpload *)payload);
+                }
+            }
+        }
+        else
+        {
+            /* Without depth, everything blends in painter's order: the
+               tiles, the sprites, then the quads. With depth, opaque draws
+               go first, nearest first, so early-Z rejects what they cover,
+               and the blended ones follow back-to-front without writing
+               depth. */
+            f32 tileDepth = 0.95f;
+            f32 spriteDepth = 0.9f;
+            
+            // The overdraw view swaps every pipeline for its heat variant
+            u32 pipelineBase = globalOverdraw ? PIPELINE_OVERDRAW : 0;
+            
+            // Dig and fill a tile in view now and then, only the chunk it
+            // is in gets rebuilt and uploaded
+            if (frameIndex % 8 == 0)
+            {
+                u32 tileX = (u32)(random_range(&randomState, view.minX,
+                                               view.maxX) / TILEMAP_TILE_SIZE);
+                u32 tileY = (u32)(random_range(&randomState, view.minY,
+                                               view.maxY) / TILEMAP_TILE_SIZE);
+                
+                if (tileX < tileMap.widthInTiles &&
+                    tileY < tileMap.heightInTiles)
+                {
+                    tilemap_set_tile(&tileMap, tileX, tileY,
+                                     (TileType)(random_next(&randomState) %
+                                                TILE_TYPE_COUNT));
+                }
+            }
+            
+            tilemap_prepare_uploads(&tileMap);
+            
+            // One draw per non-empty chunk in view
+            u32 chunkFirstX, chunkFirstY, chunkEndX, chunkEndY;
+            tilemap_chunks_in_view(&tileMap, view, &chunkFirstX, &chunkFirstY,
+                                   &chunkEndX, &chunkEndY);
+            
+            for (u32 chunkY = chunkFirstY; chunkY < chunkEndY; chunkY++)
+            {
+                for (u32 chunkX = chunkFirstX; chunkX < chunkEndX; chunkX++)
+                {
+                    u32 chunk = chunkY * tileMap.widthInChunks + chunkX;
+                    u32 vertexCount = tileMap.chunks[chunk].vertexCount;
+                    if (vertexCount == 0)
+                    {
+                        continue;
+                    }
+                    
+                    DrawCommand tileDraw = {0};
+                    tileDraw.kind = DRAW_KIND_DIRECT;
+                    tileDraw.pipeline = pipelineBase + PIPELINE_SPRITE;
+                    tileDraw.descriptorSet = DESC_SET_TEXTURE;
+                    tileDraw.vertexBuffer = VERTEX_BUFFER_TILEMAP;
+                    tileDraw.vertexCount = vertexCount;
+                    tileDraw.firstVertex = chunk * TILEMAP_CHUNK_VERTICES;
+                    tileDraw.pushConstants =
+                        push_constants_make(-cameraX, -cameraY, 1.0f, 0.0f,
+                                            0.7f, 0.9f, 0.7f, 1);
+                    tileDraw.pushConstants.depth = tileDepth;
+                    
+                    if (globalDepthPass)
+                    {
+                        draw_queue_push_depth_pass(
+                            &drawQueue, opaqueTextures,
+                            pipelineBase + PIPELINE_SPRITE_OPAQUE,
+                            pipelineBase + PIPELINE_SPRITE_TRANSPARENT,
+                            tileDepth, &tileDraw);
+                    }
+                    else
+                    {
+                        draw_queue_push(&drawQueue, LAYER_TILES, tileDepth,
+                                        false, &tileDraw);
+                    }
+                }
+            }
+            
+            // The sprite scene is behind all but the tiles, the camera is a
+            // push constant
+            DrawCommand spriteDraw = {0};
+            spriteDraw.pipeline = pipelineBase + PIPELINE_SPRITE;
+            spriteDraw.descriptorSet = DESC_SET_TEXTURE;
+            spriteDraw.pushConstants =
+                push_constants_make(-cameraX, -cameraY, 1.0f, 0.0f, 1, 1, 1, 1);
+            spriteDraw.pushConstants.depth = spriteDepth;
+            
+            // The depth pass variants of whichever pipeline draws them
+            u32 spriteOpaquePipeline = PIPELINE_SPRITE_OPAQUE;
+            u32 spriteTransparentPipeline = PIPELINE_SPRITE_TRANSPARENT;
+            
+            if (globalGpuCulling)
+            {
+                /* A constant number of CPU commands however many objects exist.
+                   The compute pass appends draws in no particular order, which
+                   is fine for these sprites but not for order-dependent
+                   blending. */
+                spriteDraw.kind = DRAW_KIND_INDIRECT_COUNT;
+                spriteDraw.pipeline = pipelineBase + PIPELINE_SCENE;
+                spriteOpaquePipeline = PIPELINE_SCENE_OPAQUE;
+                spriteTransparentPipeline = PIPELINE_SCENE_TRANSPARENT;
+                spriteDraw.vertexBuffer = VERTEX_BUFFER_SPRITE_SCENE;
+                spriteDraw.indirectBuffer = indirectCommandBuffer;
+                spriteDraw.countBuffer = drawCountBuffer;
+                spriteDraw.maxDrawCount = spriteCount;
+            }
+            else
+            {
+                spriteDraw.kind = DRAW_KIND_DIRECT;
+                spriteDraw.vertexBuffer = VERTEX_BUFFER_SPRITE_BATCH;
+                spriteDraw.vertexCount =
+                    visibleSpriteCount * VERTICES_PER_SPRITE;
+                
+                if (globalVertexPulling)
+                {
+                    spriteDraw.pipeline = pipelineBase + PIPELINE_SPRITE_PULL;
+                    spriteDraw.vertexBuffer = DRAW_NO_VERTEX_BUFFER;
+                    spriteOpaquePipeline = PIPELINE_SPRITE_PULL_OPAQUE;
+                    spriteTransparentPipeline =
+                        PIPELINE_SPRITE_PULL_TRANSPARENT;
+                }
+            }
+            
+            if (globalDepthPass)
+            {
+                draw_queue_push_depth_pass(
+                    &drawQueue, opaqueTextures,
+                    pipelineBase + spriteOpaquePipeline,
+                    pipelineBase + spriteTransparentPipeline,
+                    spriteDepth, &spriteDraw);
+            }
+            else
+            {
+                draw_queue_push(&drawQueue, LAYER_SPRITES, spriteDepth, false,
+                                &spriteDraw);
+            }
+            
+            // The quads on top, 6 vertices (2 triangles) each, later ones
+            // nearer
+            for (u32 i = 0; i < array_count(quadDraws); i++)
+            {
+                DrawCommand quadDraw = {0};
+                quadDraw.kind = DRAW_KIND_DIRECT;
+                quadDraw.pipeline = pipelineBase + PIPELINE_SPRITE;
+                quadDraw.descriptorSet = DESC_SET_TEXTURE;
+                quadDraw.vertexBuffer = VERTEX_BUFFER_QUAD;
+                quadDraw.vertexCount = VERTICES_PER_SPRITE;
+                quadDraw.pushConstants = quadDraws[i];
+                
+                if (globalDepthPass)
+                {
+                    f32 depth = 0.5f - 0.1f * (f32)i;
+                    quadDraw.pushConstants.depth = depth;
+                    
+                    draw_queue_push_depth_pass(
+                        &drawQueue, opaqueTextures,
+                        pipelineBase + PIPELINE_SPRITE_OPAQUE,
+                        pipelineBase + PIPELINE_SPRITE_TRANSPARENT,
+                        depth, &quadDraw);
+                }
+                else
+                {
+                    draw_queue_push(&drawQueue, LAYER_QUADS, (f32)i, false,
+                                    &quadDraw);
+                }
+            }
+            
+            // The panels in view, each asking for its texture at the size
+            // it is drawn
+            f32 panelSpacing = worldWidth / (f32)PANEL_COUNT;
+            f32 panelDepth = 0.7f;
+            for (u32 i = 0; i < PANEL_COUNT; i++)
+            {
+                f32 scale = 0.5f + 1.75f * (1.0f + sinf(simState.panelPhase +
+                                                        (f32)i));
+                f32 size = s * scale; // the quad is s pixels across
+                f32 x = ((f32)i + 0.5f) * panelSpacing;
+                f32 y = 100.0f + 100.0f * (f32)(i % 3);
+                
+                if (x + size < view.minX || x > view.maxX ||
+                    y + size < view.minY || y > view.maxY)
+                {
+                    continue;
+                }
+                
+                stream_request(streamer, i, size, frameIndex);
+                
+                DrawCommand panelDraw = {0};
+                panelDraw.kind = DRAW_KIND_DIRECT;
+                panelDraw.pipeline = pipelineBase + PIPELINE_SPRITE;
+                panelDraw.descriptorSet = DESC_SET_PANEL_FIRST + i;
+                panelDraw.vertexBuffer = VERTEX_BUFFER_QUAD;
+                panelDraw.vertexCount = VERTICES_PER_SPRITE;
+                panelDraw.pushConstants =
+                    push_constants_make(x - cameraX, y - cameraY, scale, 0.0f,
+                                        1, 1, 1, 1);
+                panelDraw.pushConstants.depth = panelDepth;
+                
+                if (globalDepthPass)
+                {
+                    draw_queue_push_depth_pass(
+                        &drawQueue, opaqueTextures,
+                        pipelineBase + PIPELINE_SPRITE_OPAQUE,
+                        pipelineBase + PIPELINE_SPRITE_TRANSPARENT,
+                        panelDepth, &panelDraw);
+                }
+                else
+                {
+                    draw_queue_push(&drawQueue, LAYER_PANELS, panelDepth,
+                                    false, &panelDraw);
+                }
+            }
+        }
+        
+        if (capture.file)
+        {
+            u32 flags = (globalGpuCulling ? CAPTURE_FRAME_GPU_CULLING : 0) |
+                (globalDepthPass ? CAPTURE_FRAME_DEPTH_PASS : 0) |
+                (globalOverdraw ? CAPTURE_FRAME_OVERDRAW : 0);
+            capture_frame(&capture, frameIndex, flags, view, &drawQueue);
+            
+            // Read back from the mapped buffer, slow but only when capturing
+            if (visibleSpriteCount && globalVertexPulling)
+            {
+                capture_upload(&capture, VERTEX_BUFFER_SPRITE_RECORDS, 0,
+                               spriteRecords,
+                               visibleSpriteCount * sizeof(SpriteRecord));
+            }
+            else if (visibleSpriteCount)
+            {
+                capture_upload(&capture, VERTEX_BUFFER_SPRITE_BATCH, 0,
+                               batchVertices,
+                               visibleSpriteCount * VERTICES_PER_SPRITE *
+                               sizeof(Vertex));
+            }
+            
+            for (u32 i = 0; i < tileMap.copyCount; i++)
+            {
+                VkBufferCopy *copy = &tileMap.copies[i];
+                capture_upload(&capture, VERTEX_BUFFER_TILEMAP,
+                               copy->dstOffset,
+                               (u8 *)tileMap.staging + copy->srcOffset,
+                               copy->size);
+            }
+            
+            u8 *sceneStaging =
+                sceneVertices->staging[sceneVertices->stagingIndex];
+            for (u32 i = 0; i < sceneVertices->copyCount; i++)
+            {
+                VkBufferCopy *copy = &sceneVertices->copies[i];
+                capture_upload(&capture, VERTEX_BUFFER_SPRITE_SCENE,
+                               copy->dstOffset, sceneStaging + copy->srcOffset,
+                               copy->size);
+            }
+        }
+        
+        /*
+        *  Add the Text Labels
         */
         
-        MSG message;
-        while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE))
+        // After the capture, which doesn't include the glyph atlas
         {
-            TranslateMessage(&message);
-            DispatchMessage(&message);
+            char label[64];
+            
+            sprintf_s(label, sizeof(label), "frame %u  %.2f ms  %u draws",
+                      frameIndex, frameMilliseconds, frame.drawStats.draws);
+            text_label(text, 10, 24, 18, 0, 0, 0, 1, label);
+            
+            for (u32 i = 0; i < array_count(quadDraws); i++)
+            {
+                sprintf_s(label, sizeof(label), "quad %u", i);
+                text_label(text, quadDraws[i].offset[0],
+                           quadDraws[i].offset[1] - 6, 16, 0.1f, 0.1f, 0.6f,
+                           1, label);
+            }
+            
+            if (globalSpriteLabels)
+            {
+                // GPU culling and replays leave no visible list behind
+                if (globalGpuCulling || replaying)
+                {
+                    visibleSpriteCount = cull_bounds(&jobQueue, &spriteBounds,
+                                                     spriteCount, view,
+                                                     visibleSprites);
+                }
+                
+                for (u32 i = 0; i < visibleSpriteCount; i++)
+                {
+                    u32 sprite = visibleSprites[i];
+                    sprintf_s(label, sizeof(label), "%u", sprite);
+                    text_label(text, sprites.centerX[sprite] - view.minX,
+                               sprites.centerY[sprite] - view.minY, 12,
+                               1, 1, 1, 1, label);
+                }
+            }
+            
+            text_end_frame(text, batchVertices + textFirstVertex,
+                           textFirstVertex);
+            
+            u32 textPipeline = (globalOverdraw ? PIPELINE_OVERDRAW : 0) +
+                (globalDepthPass ? PIPELINE_TEXT_TRANSPARENT : PIPELINE_TEXT);
+            
+            // One draw per color, on top of everything else
+            for (u32 i = 0; i < text->batchCount; i++)
+            {
+                TextBatch *batch = &text->batches[i];
+                
+                DrawCommand textDraw = {0};
+                textDraw.kind = DRAW_KIND_DIRECT;
+                textDraw.pipeline = textPipeline;
+                textDraw.descriptorSet = DESC_SET_TEXT;
+                textDraw.vertexBuffer = VERTEX_BUFFER_SPRITE_BATCH;
+                textDraw.vertexCount = batch->vertexCount;
+                textDraw.firstVertex = batch->firstVertex;
+                textDraw.pushConstants =
+                    push_constants_make(0, 0, 1.0f, 0.0f,
+                                        batch->color[0], batch->color[1],
+                                        batch->color[2], batch->color[3]);
+                
+                if (globalDepthPass)
+                {
+                    draw_queue_push(&drawQueue, LAYER_TRANSPARENT, 0.0f, true,
+                                    &textDraw);
+                }
+                else
+                {
+                    draw_queue_push(&drawQueue, LAYER_TEXT, (f32)i, false,
+                                    &textDraw);
+                }
+            }
         }
         
+        // Sorted now, emitted by the main pass while the graph records
+        draw_queue_sort(&drawQueue);
+        
         /*
         *  Reset and Begin Command Buffer
         */
@@ -1798,69 +4576,94 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         vkBeginCommandBuffer(graphicsCommandBuffer, &beginInfo);
         
         /*
-        *  Begin Render Pass
+        *  Execute the Frame Graph
         */
         
-        VkOffset2D renderAreaOffset = { 0, 0 };
-        VkRect2D renderArea =
-        {
-            renderAreaOffset,
-            vk.swapchainExtents
-        };
-        
-        VkClearColorValue clearColor = {1, 1, 0, 1}; // yellow
+        u32 graphIndex = (globalDepthPass ? 2 : 0) + (globalGpuCulling ? 1 : 0);
+        RenderGraph *frameGraph = &frameGraphs[graphIndex];
+        rg_set_image(frameGraph, swapchainResources[graphIndex],
+                     vk.swapchainImages[imageIndex],
+                     vk.swapchainImageViews[imageIndex]);
         
-        VkClearValue clearValue = { clearColor };
+        frame.view = view;
+        frame.overdraw = globalOverdraw;
+        frame.renderPass = globalDepthPass ? depthRenderPass : renderPass;
+        frame.framebuffer = globalDepthPass ?
+            depthFramebuffers[graphIndex][imageIndex] :
+            swapchainFramebuffers[imageIndex];
+        frame.swapchainImage = vk.swapchainImages[imageIndex];
         
-        VkClearValue clearValues[] = { clearValue };
+        // Requests are in, swap panel textures before anything samples them
+        stream_update(streamer, frameIndex);
         
-        VkRenderPassBeginInfo renderPassBeginInfo =
+        if (frame.readback)
         {
-            VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-            NULL,
-            renderPass,
-            swapchainFramebuffers[imageIndex], // framebuffer
-            renderArea,
-            array_count(clearValues),
-            clearValues
-        };
-        
-        vkCmdBeginRenderPass(graphicsCommandBuffer, &renderPassBeginInfo,
-                             VK_SUBPASS_CONTENTS_INLINE);
-        
-        /*
-        *  Finish the Command Buffer
-        */
-        
-        // Bind the pipeline
-        vkCmdBindPipeline(graphicsCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          graphicsPipeline);
-        
-        // Bind descriptor set
-        VkDescriptorSet descSets[] = { descSet };
-        vkCmdBindDescriptorSets(graphicsCommandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                pipelineLayout, 0,
-                                array_count(descSets),
-                                descSets,
-                                0, NULL);
-        
-        /*
-        *  Bind Vertex Buffer
-        */
-        
-        VkDeviceSize offsets[] = { 0 };
-        VkBuffer vertexBuffers[] = { vertexBuffer };
-        vkCmdBindVertexBuffers(graphicsCommandBuffer, 0,
-                               array_count(vertexBuffers),
-                               vertexBuffers,
-                               offsets);
+            readback_begin_frame(frame.readback, frameIndex);
+        }
         
-        // Draw 6 vertices (2 triangles)
-        vkCmdDraw(graphicsCommandBuffer, 6, 1, 0, 0);
+        rg_execute(frameGraph, graphicsCommandBuffer);
         
-        // End the render pass
-        vkCmdEndRenderPass(graphicsCommandBuffer);
+        if (frameIndex % 600 == 0)
+        {
+            DrawQueueStats drawStats = frame.drawStats;
+            
+            char statsText[256];
+            sprintf_s(statsText, sizeof(statsText),
+                      "Draw queue: %u draws, binds issued/avoided: "
+                      "pipeline %u/%u, descriptor set %u/%u, "
+                      "vertex buffer %u/%u, push constants %u/%u\n",
+                      drawStats.draws,
+                      drawStats.pipelineBinds, drawStats.pipelineBindsSkipped,
+                      drawStats.descriptorBinds,
+                      drawStats.descriptorBindsSkipped,
+                      drawStats.vertexBufferBinds,
+                      drawStats.vertexBufferBindsSkipped,
+                      drawStats.pushConstantUpdates,
+                      drawStats.pushConstantUpdatesSkipped);
+            OutputDebugString(statsText);
+            
+            sprintf_s(statsText, sizeof(statsText),
+                      "Scene uploads: vertices %u regions/%llu bytes, "
+                      "bounds %u regions/%llu bytes\n",
+                      sceneVertices->copyCount, sceneVertices->copyBytes,
+                      sceneBounds->copyCount, sceneBounds->copyBytes);
+            OutputDebugString(statsText);
+            
+            sprintf_s(statsText, sizeof(statsText),
+                      "Texture streaming: %.1f of %.1f MB resident, "
+                      "%u mips streamed in, %u evicted\n",
+                      (f32)streamer->bytesResident / (1024.0f * 1024.0f),
+                      (f32)streamer->budget / (1024.0f * 1024.0f),
+                      streamer->mipsStreamedIn, streamer->mipsEvicted);
+            OutputDebugString(statsText);
+            
+            sprintf_s(statsText, sizeof(statsText),
+                      "Upload queue: %llu copies, %ld pushes turned down\n",
+                      vk.uploadQueue->uploadedTotal,
+                      vk.uploadQueue->pushesRejected);
+            OutputDebugString(statsText);
+            
+            if (gpuStats.enabled)
+            {
+                GpuFrameCounters *counters = &gpuStats.latest;
+                
+                // Average number of times each pixel was shaded
+                f32 pixelCount = (f32)vk.swapchainExtents.width *
+                    (f32)vk.swapchainExtents.height;
+                f32 overdraw = (f32)counters->fragmentInvocations / pixelCount;
+                
+                sprintf_s(statsText, sizeof(statsText),
+                          "GPU (frame %u): %llu vertex invocations, "
+                          "%llu primitives after clipping, "
+                          "%llu fragment invocations (%.2fx overdraw)\n",
+                          counters->frameIndex,
+                          counters->vertexInvocations,
+                          counters->clippingPrimitives,
+                          counters->fragmentInvocations,
+                          overdraw);
+                OutputDebugString(statsText);
+            }
+        }
         
         // End the command buffer
         vkEndCommandBuffer(graphicsCommandBuffer);
@@ -1869,36 +4672,25 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         *  Submit Command Buffer
         */
         
-        VkCommandBuffer commandBuffers[] = { graphicsCommandBuffer };
+        frameValue =
+            gpu_timeline_submit(&vk, graphicsCommandBuffer,
+                                imageAvailableSemaphore,
+                                VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                renderFinishedSemaphore);
         
-        VkSemaphore imageAvailableSemaphores[] = { imageAvailableSemaphore };
+        // Whatever this frame read is reused once frameValue is reached
+        shadow_buffer_submitted(sceneVertices, frameValue);
+        shadow_buffer_submitted(sceneBounds, frameValue);
+        stream_submitted(streamer, frameValue);
+        upload_queue_submitted(vk.uploadQueue, &vk, frameValue);
         
-        VkPipelineStageFlags waitStages[] =
+        if (frame.readback)
         {
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-        };
+            readback_submitted(frame.readback, frameValue);
+        }
         
         VkSemaphore renderFinishedSemaphores[] = { renderFinishedSemaphore };
         
-        VkSubmitInfo submitInfo =
-        {
-            VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            NULL,
-            array_count(imageAvailableSemaphores),
-            imageAvailableSemaphores,
-            waitStages,
-            array_count(commandBuffers),
-            commandBuffers,
-            array_count(renderFinishedSemaphores),
-            renderFinishedSemaphores
-        };
-        
-        if (vkQueueSubmit(vk.graphicsAndPresentQueue, 1, &submitInfo,
-                          frameFence) != VK_SUCCESS)
-        {
-            assert(!"failed to submit draw command buffer!");
-        }
-        
         /*
         *  Present the image
         */
@@ -1923,7 +4715,150 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         {
             // TODO: Handle window resize - recreate swapchain
         }
+        
+        if (frameIndex == 1)
+        {
+            startup_report(&startup);
+        }
+    }
+    
+    sim_stop(&simulation);
+    
+    if (frame.readback)
+    {
+        readback_finish(frame.readback, &vk);
+    }
+    
+    capture_end(&capture);
+    
+    if (replaying)
+    {
+        replay_report_write(&replayReport, "replay_timing.csv");
+    }
+    
+    /*
+    *  Destroy Everything, Newest First
+    */
+    
+    // Waits for the GPU once, everything below is idle after this
+    destroy_queue_flush(&vk);
+    free(vk.destroyQueue);
+    
+    upload_queue_destroy(vk.uploadQueue, &vk);
+    free(vk.uploadQueue);
+    
+    if (replaying)
+    {
+        upload_staging_destroy(&replayStaging);
+    }
+    
+    for (u32 graphIndex = 0; graphIndex < array_count(frameGraphs);
+         graphIndex++)
+    {
+        // Before the graph takes the depth image view with it
+        for (u32 i = 0; i < array_count(depthFramebuffers[graphIndex]); i++)
+        {
+            if (depthFramebuffers[graphIndex][i])
+            {
+                vkDestroyFramebuffer(vk.device,
+                                     depthFramebuffers[graphIndex][i], NULL);
+            }
+        }
+        
+        rg_destroy(&frameGraphs[graphIndex], &vk);
+    }
+    
+    gpu_stats_destroy(&gpuStats, &vk);
+    pipeline_cache_destroy(pipelineCache);
+    free(pipelineCache);
+    
+    vkDestroyPipeline(vk.device, cullPipeline, NULL);
+    vkDestroyPipelineLayout(vk.device, cullPipelineLayout, NULL);
+    vkDestroyDescriptorPool(vk.device, cullDescPool, NULL);
+    vkDestroyDescriptorSetLayout(vk.device, cullDescSetLayout, NULL);
+    
+    vkDestroyBuffer(vk.device, drawCountBuffer, NULL);
+    vkFreeMemory(vk.device, drawCountBufferMemory, NULL);
+    vkDestroyBuffer(vk.device, indirectCommandBuffer, NULL);
+    vkFreeMemory(vk.device, indirectCommandBufferMemory, NULL);
+    
+    tilemap_destroy(&tileMap, &vk);
+    
+    shadow_buffer_destroy(sceneVertices);
+    free(sceneVertices);
+    vkDestroyBuffer(vk.device, drawRecordBuffer, NULL);
+    vkFreeMemory(vk.device, drawRecordBufferMemory, NULL);
+    shadow_buffer_destroy(sceneBounds);
+    free(sceneBounds);
+    
+    vkDestroyBuffer(vk.device, spriteRecordBuffer, NULL);
+    vkFreeMemory(vk.device, spriteRecordBufferMemory, NULL);
+    vkDestroyBuffer(vk.device, batchVertexBuffer, NULL);
+    vkFreeMemory(vk.device, batchVertexBufferMemory, NULL);
+    vkDestroyBuffer(vk.device, vertexBuffer, NULL);
+    vkFreeMemory(vk.device, vertexBufferMemory, NULL);
+    
+    stream_destroy(streamer);
+    free(streamer);
+    
+    vkDestroyBuffer(vk.device, uniformBuffer, NULL);
+    vkFreeMemory(vk.device, uniformBufferMemory, NULL);
+    
+    text_destroy(text, &vk);
+    free(text);
+    
+    vkDestroySampler(vk.device, texSampler, NULL);
+    vkDestroyImageView(vk.device, texImageView, NULL);
+    vkDestroyImage(vk.device, texImage, NULL);
+    vkFreeMemory(vk.device, texImageMemory, NULL);
+    
+    // Frees the descriptor sets allocated from it too
+    vkDestroyDescriptorPool(vk.device, descPool, NULL);
+    vkDestroyDescriptorSetLayout(vk.device, descSetLayout, NULL);
+    vkDestroyPipelineLayout(vk.device, pipelineLayout, NULL);
+    
+    vkDestroyShaderModule(vk.device, pullShaderModule, NULL);
+    vkDestroyShaderModule(vk.device, colorShaderModule, NULL);
+    vkDestroyShaderModule(vk.device, sdfShaderModule, NULL);
+    vkDestroyShaderModule(vk.device, overdrawShaderModule, NULL);
+    vkDestroyShaderModule(vk.device, fragShaderModule, NULL);
+    vkDestroyShaderModule(vk.device, vertShaderModule, NULL);
+    
+    // Frees graphicsCommandBuffer too
+    vkDestroyCommandPool(vk.device, vk.graphicsCommandPool, NULL);
+    
+    vkDestroySemaphore(vk.device, renderFinishedSemaphore, NULL);
+    vkDestroySemaphore(vk.device, imageAvailableSemaphore, NULL);
+    vkDestroySemaphore(vk.device, vk.timeline, NULL);
+    
+    for (u32 i = 0; i < array_count(swapchainFramebuffers); i++)
+    {
+        vkDestroyFramebuffer(vk.device, swapchainFramebuffers[i], NULL);
+    }
+    
+    vkDestroyRenderPass(vk.device, depthRenderPass, NULL);
+    vkDestroyRenderPass(vk.device, renderPass, NULL);
+    
+    for (u32 i = 0; i < array_count(vk.swapchainImageViews); i++)
+    {
+        vkDestroyImageView(vk.device, vk.swapchainImageViews[i], NULL);
     }
+    vkDestroySwapchainKHR(vk.device, vk.swapchain, NULL);
+    
+    vkDestroyDevice(vk.device, NULL);
+    
+    PFN_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessengerEXT =
+    (PFN_vkDestroyDebugUtilsMessengerEXT)
+        vkGetInstanceProcAddr(vk.instance, "vkDestroyDebugUtilsMessengerEXT");
+    vkDestroyDebugUtilsMessengerEXT(vk.instance, vk.debugMessenger, NULL);
+    
+    vkDestroySurfaceKHR(vk.instance, vk.surface, NULL);
+    vkDestroyInstance(vk.instance, NULL);
+    
+    // Nothing uses the window anymore, let its thread destroy it
+    PostThreadMessage(windowThreadId, WM_QUIT, 0, 0);
+    WaitForSingleObject(windowThread, INFINITE);
+    CloseHandle(windowThread);
     
     return 0;
 }
\ No newline at end of file
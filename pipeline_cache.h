@@ -0,0 +1,619 @@
+/*
+*  Pipeline state cache
+*
+*  Graphics pipelines are described by a small fixed-size key and created
+*  the first time a key is asked for. Lookups hash the key and probe an
+*  open addressed table without taking a lock. Only a miss takes the lock,
+*  builds the pipeline and publishes the entry by writing its hash last.
+*  Entries are never removed while the cache is alive.
+*
+*  Viewport and scissor are always dynamic. With extended dynamic state,
+*  cull mode and front face are too, and those fields are cleared from the
+*  key before hashing so keys that only differ there share one pipeline.
+*
+*  Shader features and the decode of quantized positions are part of the
+*  key and reach the shaders as specialization constants, so each variant
+*  is compiled with its features folded in instead of branching per pixel.
+*/
+
+#define PIPELINE_CACHE_SIZE 1024 // must be a power of two
+
+typedef enum
+{
+    BLEND_MODE_OPAQUE,
+    BLEND_MODE_ALPHA, // source alpha over the destination
+    BLEND_MODE_ADDITIVE,
+    
+    BLEND_MODE_COUNT
+    
+} BlendMode;
+
+// Specialization constants 0, 1 and 2 of shader.frag
+typedef enum
+{
+    SHADER_FEATURE_TEXTURE = 1 << 0, // sample the texture, white without
+    SHADER_FEATURE_ALPHA_TEST = 1 << 1, // discard below half alpha
+    SHADER_FEATURE_TINT = 1 << 2, // multiply by the vertex shader's tint
+    
+} ShaderFeature;
+
+typedef enum
+{
+    DEPTH_MODE_NONE, // render pass without a depth attachment
+    DEPTH_MODE_TEST, // test against opaque geometry, don't write
+    DEPTH_MODE_TEST_WRITE,
+    
+    DEPTH_MODE_COUNT
+    
+} DepthMode;
+
+/* Build keys with pipeline_key_make so unused fields and padding are zero,
+   the whole struct is hashed and compared as bytes. */
+typedef struct
+{
+    VkShaderModule vertexShader;
+    VkShaderModule fragmentShader;
+    VkPipelineLayout pipelineLayout;
+    VkRenderPass renderPass;
+    
+    u8 vertexLayout; // VertexLayout
+    u8 blendMode; // BlendMode
+    u8 topology; // VkPrimitiveTopology
+    u8 cullMode; // VkCullModeFlags, dynamic if supported
+    u8 frontFace; // VkFrontFace, dynamic if supported
+    u8 depthMode; // DepthMode
+    u8 features; // ShaderFeature bits
+    u8 padding;
+    
+    // Specialization constants 0 to 3 of shader.vert and color.vert
+    f32 decodeScale[2]; // position = stored * scale + bias
+    f32 decodeBias[2];
+    
+} PipelineKey;
+
+typedef struct
+{
+    volatile LONG64 hash; // 0 while the entry is free
+    PipelineKey key;
+    VkPipeline pipeline;
+    
+} PipelineCacheEntry;
+
+typedef struct
+{
+    PipelineCacheEntry entries[PIPELINE_CACHE_SIZE];
+    SRWLOCK createLock;
+    
+    VulkanContext *vk;
+    VkPipelineCache driverCache; // lets the driver reuse compiled shaders
+    bool dynamicRasterState;
+    
+    u32 pipelineCount;
+    
+} PipelineCache;
+
+PipelineKey
+pipeline_key_make(VkShaderModule vertexShader, VkShaderModule fragmentShader,
+                  VkPipelineLayout pipelineLayout, VkRenderPass renderPass,
+                  VertexLayout vertexLayout, BlendMode blendMode,
+                  DepthMode depthMode)
+{
+    PipelineKey key;
+    memset(&key, 0, sizeof(key));
+    
+    key.vertexShader = vertexShader;
+    key.fragmentShader = fragmentShader;
+    key.pipelineLayout = pipelineLayout;
+    key.renderPass = renderPass;
+    key.vertexLayout = (u8)vertexLayout;
+    key.blendMode = (u8)blendMode;
+    key.depthMode = (u8)depthMode;
+    key.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    key.cullMode = VK_CULL_MODE_BACK_BIT;
+    key.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    key.features = SHADER_FEATURE_TEXTURE | SHADER_FEATURE_TINT;
+    key.decodeScale[0] = 1;
+    key.decodeScale[1] = 1;
+    
+    return key;
+}
+
+// For vertex layouts quantized with quantization
+void
+pipeline_key_set_decode(PipelineKey *key, VertexQuantization *quantization)
+{
+    key->decodeScale[0] = quantization->scale[0];
+    key->decodeScale[1] = quantization->scale[1];
+    key->decodeBias[0] = quantization->bias[0];
+    key->decodeBias[1] = quantization->bias[1];
+}
+
+// FNV-1a over the key bytes, never 0 since 0 marks a free entry
+u64
+pipeline_key_hash(PipelineKey *key)
+{
+    u8 *bytes = (u8 *)key;
+    u64 hash = 14695981039346656037ull;
+    
+    for (u32 i = 0; i < sizeof(PipelineKey); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    
+    return hash ? hash : 1;
+}
+
+void
+pipeline_cache_init(PipelineCache *cache, VulkanContext *vk,
+                    bool dynamicRasterState)
+{
+    memset(cache->entries, 0, sizeof(cache->entries));
+    InitializeSRWLock(&cache->createLock);
+    
+    cache->vk = vk;
+    cache->dynamicRasterState = dynamicRasterState;
+    cache->pipelineCount = 0;
+    
+    VkPipelineCacheCreateInfo cacheInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        NULL,
+        0,
+        0, NULL // no initial data
+    };
+    
+    if (vkCreatePipelineCache(vk->device, &cacheInfo, NULL,
+                              &cache->driverCache) != VK_SUCCESS)
+    {
+        assert(!"Failed to create pipeline cache");
+    }
+}
+
+/*
+*  Pipeline creation from a key
+*/
+
+VkPipeline
+pipeline_cache_create_pipeline(PipelineCache *cache, PipelineKey *key)
+{
+    VulkanContext *vk = cache->vk;
+    
+    /*
+    *  Shader variant
+    */
+    
+    // Constant ids are the array indices, modules ignore ids they lack
+    f32 vertexConstants[] =
+    {
+        key->decodeScale[0], key->decodeScale[1],
+        key->decodeBias[0], key->decodeBias[1]
+    };
+    
+    VkBool32 fragmentConstants[] =
+    {
+        (key->features & SHADER_FEATURE_TEXTURE) != 0,
+        (key->features & SHADER_FEATURE_ALPHA_TEST) != 0,
+        (key->features & SHADER_FEATURE_TINT) != 0
+    };
+    
+    VkSpecializationMapEntry vertexEntries[array_count(vertexConstants)];
+    for (u32 i = 0; i < array_count(vertexConstants); i++)
+    {
+        VkSpecializationMapEntry entry =
+        {
+            i, // constantID
+            (u32)(i * sizeof(f32)), // offset
+            sizeof(f32)
+        };
+        vertexEntries[i] = entry;
+    }
+    
+    VkSpecializationMapEntry fragmentEntries[array_count(fragmentConstants)];
+    for (u32 i = 0; i < array_count(fragmentConstants); i++)
+    {
+        VkSpecializationMapEntry entry =
+        {
+            i, // constantID
+            (u32)(i * sizeof(VkBool32)), // offset
+            sizeof(VkBool32)
+        };
+        fragmentEntries[i] = entry;
+    }
+    
+    VkSpecializationInfo vertSpecializationInfo =
+    {
+        array_count(vertexEntries),
+        vertexEntries,
+        sizeof(vertexConstants),
+        vertexConstants
+    };
+    
+    VkSpecializationInfo fragSpecializationInfo =
+    {
+        array_count(fragmentEntries),
+        fragmentEntries,
+        sizeof(fragmentConstants),
+        fragmentConstants
+    };
+    
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_SHADER_STAGE_VERTEX_BIT,
+        key->vertexShader,
+        "main", // entry point
+        &vertSpecializationInfo
+    };
+    
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_SHADER_STAGE_FRAGMENT_BIT,
+        key->fragmentShader,
+        "main", // entry point
+        &fragSpecializationInfo
+    };
+    
+    VkPipelineShaderStageCreateInfo shaderStageInfo[] =
+    {
+        vertShaderStageInfo,
+        fragShaderStageInfo
+    };
+    
+    /*
+    *  Vertex layout
+    */
+    
+    VkVertexInputBindingDescription vertInputBindDescs[1];
+    VkVertexInputAttributeDescription vertInputAttrDescs[3];
+    u32 vertInputBindDescCount = 0;
+    u32 vertInputAttrDescCount = 0;
+    
+    assert(key->vertexLayout < VERTEX_LAYOUT_COUNT);
+    VertexLayoutInfo *layout = &vertexLayouts[key->vertexLayout];
+    
+    // Pulled layouts have no bindings or attributes at all
+    if (layout->positionFormat != VK_FORMAT_UNDEFINED)
+    {
+        VkVertexInputBindingDescription vertInputBindDesc =
+        {
+            0, // binding index
+            layout->stride, // stride
+            VK_VERTEX_INPUT_RATE_VERTEX // per-vertex data
+        };
+        
+        VkVertexInputAttributeDescription positionAttrDesc =
+        {
+            0, // location in the shader
+            0, // binding (same as buffer binding)
+            layout->positionFormat,
+            0 // byte offset in the vertex
+        };
+        
+        VkVertexInputAttributeDescription uvAttrDesc =
+        {
+            1, // location in the shader
+            0, // binding
+            layout->uvFormat,
+            layout->uvOffset // byte offset
+        };
+        
+        vertInputBindDescs[vertInputBindDescCount++] = vertInputBindDesc;
+        vertInputAttrDescs[vertInputAttrDescCount++] = positionAttrDesc;
+        vertInputAttrDescs[vertInputAttrDescCount++] = uvAttrDesc;
+        
+        // Only read by color.vert
+        if (layout->colorFormat != VK_FORMAT_UNDEFINED)
+        {
+            VkVertexInputAttributeDescription colorAttrDesc =
+            {
+                2, // location in the shader
+                0, // binding
+                layout->colorFormat,
+                layout->colorOffset // byte offset
+            };
+            
+            vertInputAttrDescs[vertInputAttrDescCount++] = colorAttrDesc;
+        }
+    }
+    
+    VkPipelineVertexInputStateCreateInfo vertexInputStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        NULL,
+        0,
+        vertInputBindDescCount,
+        vertInputBindDescs,
+        vertInputAttrDescCount,
+        vertInputAttrDescs
+    };
+    
+    VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+        NULL,
+        0,
+        (VkPrimitiveTopology)key->topology,
+        VK_FALSE // primitiveRestartEnable
+    };
+    
+    /*
+    *  Dynamic state
+    */
+    
+    VkDynamicState dynamicStates[4];
+    u32 dynamicStateCount = 0;
+    
+    dynamicStates[dynamicStateCount++] = VK_DYNAMIC_STATE_VIEWPORT;
+    dynamicStates[dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+    
+    if (cache->dynamicRasterState)
+    {
+        dynamicStates[dynamicStateCount++] = VK_DYNAMIC_STATE_CULL_MODE;
+        dynamicStates[dynamicStateCount++] = VK_DYNAMIC_STATE_FRONT_FACE;
+    }
+    
+    VkPipelineDynamicStateCreateInfo dynamicStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        NULL,
+        0,
+        dynamicStateCount,
+        dynamicStates
+    };
+    
+    // Only the counts matter, the rectangles are set when recording
+    VkPipelineViewportStateCreateInfo viewportStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        NULL,
+        0,
+        1, NULL, // viewport
+        1, NULL // scissor
+    };
+    
+    /*
+    *  Rasterization and multisampling
+    */
+    
+    VkPipelineRasterizationStateCreateInfo rasterizationStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_FALSE, // depthClampEnable
+        VK_FALSE, // rasterizerDiscardEnable
+        VK_POLYGON_MODE_FILL, // polygonMode (solid triangles)
+        key->cullMode, // cullMode (ignored when dynamic)
+        (VkFrontFace)key->frontFace, // frontFace (ignored when dynamic)
+        VK_FALSE, 0, 0, 0, // no depth bias
+        1.0f // lineWidth
+    };
+    
+    VkPipelineMultisampleStateCreateInfo multisampleStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_SAMPLE_COUNT_1_BIT, // rasterizationSamples
+        VK_FALSE, // sampleShadingEnable
+        0, // minSampleShading
+        NULL, // pSampleMask
+        VK_FALSE, // alphaToCoverageEnable
+        VK_FALSE, // alphaToOneEnable
+    };
+    
+    /*
+    *  Depth
+    */
+    
+    // Less, so the nearest opaque draw wins and early-Z rejects the rest
+    VkPipelineDepthStencilStateCreateInfo depthStencilStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_TRUE, // depthTestEnable
+        key->depthMode == DEPTH_MODE_TEST_WRITE, // depthWriteEnable
+        VK_COMPARE_OP_LESS,
+        VK_FALSE, // depthBoundsTestEnable
+        VK_FALSE, // stencilTestEnable
+        {0}, {0}, // front, back stencil ops (unused)
+        0.0f, 1.0f // depth bounds (unused)
+    };
+    
+    /*
+    *  Blending
+    */
+    
+    VkFlags colorWriteMask =
+        VK_COLOR_COMPONENT_R_BIT |
+        VK_COLOR_COMPONENT_G_BIT |
+        VK_COLOR_COMPONENT_B_BIT |
+        VK_COLOR_COMPONENT_A_BIT;
+    
+    VkPipelineColorBlendAttachmentState colorBlendAttachment =
+    {
+        VK_FALSE, // blendEnable
+        VK_BLEND_FACTOR_ONE,
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_OP_ADD,
+        VK_BLEND_FACTOR_ONE,
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_OP_ADD,
+        colorWriteMask,
+    };
+    
+    switch (key->blendMode)
+    {
+        case BLEND_MODE_OPAQUE:
+        {
+        } break;
+        
+        case BLEND_MODE_ALPHA:
+        {
+            colorBlendAttachment.blendEnable = VK_TRUE;
+            colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+            colorBlendAttachment.dstColorBlendFactor =
+                VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+            colorBlendAttachment.dstAlphaBlendFactor =
+                VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        } break;
+        
+        case BLEND_MODE_ADDITIVE:
+        {
+            colorBlendAttachment.blendEnable = VK_TRUE;
+            colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+            colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        } break;
+        
+        default:
+        {
+            assert(!"Unknown blend mode");
+        } break;
+    }
+    
+    VkPipelineColorBlendAttachmentState
+        colorBlendAttachments[] = { colorBlendAttachment };
+    
+    VkPipelineColorBlendStateCreateInfo colorBlendStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_FALSE,
+        VK_LOGIC_OP_CLEAR,
+        array_count(colorBlendAttachments),
+        colorBlendAttachments,
+        {0, 0, 0, 0}
+    };
+    
+    VkGraphicsPipelineCreateInfo pipelineInfo =
+    {
+        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        NULL,
+        0,
+        array_count(shaderStageInfo),
+        shaderStageInfo,
+        &vertexInputStateInfo,
+        &inputAssemblyStateInfo,
+        NULL, // pTessellationState
+        &viewportStateInfo,
+        &rasterizationStateInfo,
+        &multisampleStateInfo,
+        key->depthMode != DEPTH_MODE_NONE ? &depthStencilStateInfo : NULL,
+        &colorBlendStateInfo,
+        &dynamicStateInfo,
+        key->pipelineLayout,
+        key->renderPass,
+        0, // subpass index
+        NULL, 0 // (no base pipeline)
+    };
+    
+    VkPipeline pipeline;
+    if (vkCreateGraphicsPipelines(vk->device, cache->driverCache, 1,
+                                  &pipelineInfo, NULL,
+                                  &pipeline) != VK_SUCCESS)
+    {
+        assert(!"Failed to create graphics pipeline!");
+    }
+    
+    return pipeline;
+}
+
+/*
+*  Lookup
+*/
+
+// Returns the entry holding key, or the free entry where it belongs
+PipelineCacheEntry *
+pipeline_cache_probe(PipelineCache *cache, PipelineKey *key, u64 hash)
+{
+    u32 mask = PIPELINE_CACHE_SIZE - 1;
+    u32 index = (u32)hash & mask;
+    
+    for (u32 probe = 0; probe < PIPELINE_CACHE_SIZE; probe++)
+    {
+        PipelineCacheEntry *entry = &cache->entries[(index + probe) & mask];
+        
+        /* The hash is written after the key, so a matching hash means the
+           key and pipeline next to it are complete. */
+        u64 entryHash = (u64)entry->hash;
+        if (entryHash == 0 ||
+            (entryHash == hash &&
+             memcmp(&entry->key, key, sizeof(PipelineKey)) == 0))
+        {
+            return entry;
+        }
+    }
+    
+    assert(!"Pipeline cache is full");
+    return NULL;
+}
+
+// Safe to call from any thread
+VkPipeline
+pipeline_cache_get(PipelineCache *cache, PipelineKey *requestedKey)
+{
+    PipelineKey key = *requestedKey;
+    if (cache->dynamicRasterState)
+    {
+        key.cullMode = 0;
+        key.frontFace = 0;
+    }
+    
+    u64 hash = pipeline_key_hash(&key);
+    
+    /* The probe may stop at a free slot that another thread fills with a
+       different key before we look again, so the hash is read only once
+       and anything but our own key goes through the lock. */
+    PipelineCacheEntry *entry = pipeline_cache_probe(cache, &key, hash);
+    u64 entryHash = (u64)entry->hash;
+    if (entryHash == hash &&
+        memcmp(&entry->key, &key, sizeof(PipelineKey)) == 0)
+    {
+        return entry->pipeline;
+    }
+    
+    AcquireSRWLockExclusive(&cache->createLock);
+    
+    // Another thread may have created it while we waited on the lock
+    entry = pipeline_cache_probe(cache, &key, hash);
+    if (entry->hash == 0)
+    {
+        entry->key = key;
+        entry->pipeline = pipeline_cache_create_pipeline(cache, &key);
+        cache->pipelineCount++;
+        
+        // Publish the entry only once its contents are visible
+        MemoryBarrier();
+        InterlockedExchange64(&entry->hash, (LONG64)hash);
+    }
+    
+    ReleaseSRWLockExclusive(&cache->createLock);
+    
+    return entry->pipeline;
+}
+
+void
+pipeline_cache_destroy(PipelineCache *cache)
+{
+    for (u32 i = 0; i < PIPELINE_CACHE_SIZE; i++)
+    {
+        if (cache->entries[i].hash != 0)
+        {
+            vkDestroyPipeline(cache->vk->device, cache->entries[i].pipeline,
+                              NULL);
+        }
+    }
+    
+    vkDestroyPipelineCache(cache->vk->device, cache->driverCache, NULL);
+}
@@ -0,0 +1,644 @@
+/*
+*  Asynchronous frame readback
+*
+*  Each exported frame ends with a copy of the swapchain image into one slot
+*  of a ring of host-visible buffers (host cached when the device has it,
+*  reading uncached memory from the CPU is very slow). Each slot keeps the
+*  timeline value of the frame that copied into it, and once the timeline
+*  reaches it the slot is handed to a worker thread that encodes it while
+*  the render loop moves on. The render loop never waits for the worker:
+*  when the slot it would copy into next has not been encoded yet, that
+*  frame is dropped and counted instead.
+*
+*  Slots go FREE -> COPYING (render thread) -> READY (render thread) ->
+*  FREE (worker), strictly in ring order on both sides, so a semaphore
+*  release per READY slot is all the worker needs to know what to read.
+*
+*  Encodings, picked by the extension of the export file name:
+*
+*    .y4m  YUV4MPEG2 video, I420 in full-range BT.601
+*    .png  one numbered file per frame, RGB with stored deflate blocks
+*          (no compression, so encoding costs little more than the CRC)
+*    else  raw BGRA8 frames back to back, the size is printed at startup
+*/
+
+#define READBACK_SLOTS 3
+#define READBACK_NO_SLOT UINT32_MAX
+
+typedef enum
+{
+    READBACK_FORMAT_RAW,
+    READBACK_FORMAT_PNG,
+    READBACK_FORMAT_Y4M
+    
+} ReadbackFormat;
+
+typedef enum
+{
+    READBACK_SLOT_FREE,
+    READBACK_SLOT_COPYING, // recorded into a frame the GPU hasn't finished
+    READBACK_SLOT_READY // copy done, waiting for the worker
+    
+} ReadbackSlotState;
+
+typedef struct
+{
+    ReadbackFormat format;
+    char baseName[MAX_PATH]; // PNG: file name without the extension
+    FILE *file; // raw and Y4M frames go to one file
+    
+    u32 width, height;
+    VkDeviceSize slotSize; // a multiple of nonCoherentAtomSize
+    
+    VkDevice device;
+    VkBuffer buffer; // READBACK_SLOTS slots of width * height BGRA8
+    VkDeviceMemory memory;
+    u8 *mapped;
+    bool coherent; // otherwise each slot is invalidated before reading
+    
+    volatile LONG slotStates[READBACK_SLOTS]; // ReadbackSlotState
+    u32 slotFrames[READBACK_SLOTS]; // frame index copied into each slot
+    u64 slotValues[READBACK_SLOTS]; // timeline value the copy lands at
+    
+    // Render thread
+    u32 writeSlot; // the next one to copy into
+    u32 landSlot; // the oldest one still COPYING
+    u32 copyingSlot; // copied by the frame being recorded, or READBACK_NO_SLOT
+    u32 framesDropped;
+    
+    // Worker thread
+    HANDLE readySemaphore; // one release per READY slot, one more to quit
+    HANDLE thread;
+    u32 readSlot;
+    u8 *scratch; // PNG rows or I420 planes
+    u32 framesWritten;
+    
+} Readback;
+
+/*
+*  PNG
+*/
+
+static u32 readbackCrcTable[256];
+
+void
+readback_crc_init(void)
+{
+    for (u32 i = 0; i < 256; i++)
+    {
+        u32 c = i;
+        for (u32 bit = 0; bit < 8; bit++)
+        {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        readbackCrcTable[i] = c;
+    }
+}
+
+u32
+readback_crc_update(u32 crc, u8 *data, u32 size)
+{
+    for (u32 i = 0; i < size; i++)
+    {
+        crc = readbackCrcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    
+    return crc;
+}
+
+u32
+readback_adler32(u8 *data, u32 size)
+{
+    u32 a = 1;
+    u32 b = 0;
+    
+    // 5552 is the most bytes b can take before it has to be reduced
+    while (size)
+    {
+        u32 run = size < 5552 ? size : 5552;
+        size -= run;
+        
+        while (run--)
+        {
+            a += *data++;
+            b += a;
+        }
+        
+        a %= 65521;
+        b %= 65521;
+    }
+    
+    return (b << 16) | a;
+}
+
+void
+readback_put_u32_be(u8 *out, u32 value)
+{
+    out[0] = (u8)(value >> 24);
+    out[1] = (u8)(value >> 16);
+    out[2] = (u8)(value >> 8);
+    out[3] = (u8)value;
+}
+
+// Writes part of a chunk's data and keeps its CRC up to date
+void
+readback_png_write(FILE *file, void *data, u32 size, u32 *crc)
+{
+    fwrite(data, size, 1, file);
+    *crc = readback_crc_update(*crc, (u8 *)data, size);
+}
+
+void
+readback_png_chunk_begin(FILE *file, char *type, u32 length, u32 *crc)
+{
+    u8 lengthBytes[4];
+    readback_put_u32_be(lengthBytes, length);
+    fwrite(lengthBytes, 4, 1, file);
+    
+    *crc = 0xFFFFFFFF;
+    readback_png_write(file, type, 4, crc);
+}
+
+void
+readback_png_chunk_end(FILE *file, u32 crc)
+{
+    u8 crcBytes[4];
+    readback_put_u32_be(crcBytes, crc ^ 0xFFFFFFFF);
+    fwrite(crcBytes, 4, 1, file);
+}
+
+void
+readback_encode_png(Readback *readback, u8 *pixels, u32 frameIndex)
+{
+    u32 width = readback->width;
+    u32 height = readback->height;
+    
+    // Filter type 0 (none) in front of every row, BGRA to RGB
+    u32 rowSize = 1 + width * 3;
+    u8 *rows = readback->scratch;
+    for (u32 y = 0; y < height; y++)
+    {
+        u8 *row = rows + y * rowSize;
+        u8 *src = pixels + y * width * 4;
+        
+        *row++ = 0;
+        for (u32 x = 0; x < width; x++, src += 4)
+        {
+            *row++ = src[2];
+            *row++ = src[1];
+            *row++ = src[0];
+        }
+    }
+    
+    u32 rawSize = rowSize * height;
+    
+    char fileName[MAX_PATH];
+    sprintf_s(fileName, sizeof(fileName), "%s_%06u.png", readback->baseName,
+              frameIndex);
+    
+    FILE *file;
+    fopen_s(&file, fileName, "wb");
+    if (!file)
+    {
+        return;
+    }
+    
+    static u8 signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    fwrite(signature, sizeof(signature), 1, file);
+    
+    u32 crc;
+    
+    u8 header[13];
+    readback_put_u32_be(header + 0, width);
+    readback_put_u32_be(header + 4, height);
+    header[8] = 8; // bit depth
+    header[9] = 2; // color type, RGB
+    header[10] = 0; // compression
+    header[11] = 0; // filter method
+    header[12] = 0; // no interlace
+    
+    readback_png_chunk_begin(file, "IHDR", sizeof(header), &crc);
+    readback_png_write(file, header, sizeof(header), &crc);
+    readback_png_chunk_end(file, crc);
+    
+    // A zlib stream of stored deflate blocks, 5 header bytes per block
+    u32 blockCount = (rawSize + 65534) / 65535;
+    u32 dataSize = 2 + blockCount * 5 + rawSize + 4;
+    
+    readback_png_chunk_begin(file, "IDAT", dataSize, &crc);
+    
+    u8 zlibHeader[2] = { 0x78, 0x01 };
+    readback_png_write(file, zlibHeader, sizeof(zlibHeader), &crc);
+    
+    for (u32 offset = 0; offset < rawSize; offset += 65535)
+    {
+        u32 blockSize = rawSize - offset < 65535 ? rawSize - offset : 65535;
+        bool last = offset + blockSize == rawSize;
+        
+        u8 blockHeader[5] =
+        {
+            (u8)(last ? 1 : 0), // BFINAL, BTYPE 00 (stored)
+            (u8)blockSize, (u8)(blockSize >> 8), // LEN
+            (u8)~blockSize, (u8)(~blockSize >> 8) // NLEN
+        };
+        
+        readback_png_write(file, blockHeader, sizeof(blockHeader), &crc);
+        readback_png_write(file, rows + offset, blockSize, &crc);
+    }
+    
+    u8 adler[4];
+    readback_put_u32_be(adler, readback_adler32(rows, rawSize));
+    readback_png_write(file, adler, sizeof(adler), &crc);
+    
+    readback_png_chunk_end(file, crc);
+    
+    readback_png_chunk_begin(file, "IEND", 0, &crc);
+    readback_png_chunk_end(file, crc);
+    
+    fclose(file);
+}
+
+/*
+*  Y4M
+*/
+
+/* Full-range BT.601 in 8.8 fixed point. Chroma is taken from the average
+   of each 2x2 block, odd sizes repeat the last row and column. */
+void
+readback_encode_y4m(Readback *readback, u8 *pixels)
+{
+    u32 width = readback->width;
+    u32 height = readback->height;
+    u32 chromaWidth = (width + 1) / 2;
+    u32 chromaHeight = (height + 1) / 2;
+    
+    u8 *planeY = readback->scratch;
+    u8 *planeU = planeY + width * height;
+    u8 *planeV = planeU + chromaWidth * chromaHeight;
+    
+    for (u32 y = 0; y < height; y++)
+    {
+        u8 *src = pixels + y * width * 4;
+        u8 *out = planeY + y * width;
+        
+        for (u32 x = 0; x < width; x++, src += 4)
+        {
+            s32 b = src[0];
+            s32 g = src[1];
+            s32 r = src[2];
+            out[x] = (u8)((77 * r + 150 * g + 29 * b + 128) >> 8);
+        }
+    }
+    
+    for (u32 cy = 0; cy < chromaHeight; cy++)
+    {
+        u32 y0 = cy * 2;
+        u32 y1 = y0 + 1 < height ? y0 + 1 : y0;
+        
+        for (u32 cx = 0; cx < chromaWidth; cx++)
+        {
+            u32 x0 = cx * 2;
+            u32 x1 = x0 + 1 < width ? x0 + 1 : x0;
+            
+            u8 *p00 = pixels + (y0 * width + x0) * 4;
+            u8 *p01 = pixels + (y0 * width + x1) * 4;
+            u8 *p10 = pixels + (y1 * width + x0) * 4;
+            u8 *p11 = pixels + (y1 * width + x1) * 4;
+            
+            s32 b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+            s32 g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+            s32 r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+            
+            // The 128 offset is added before the shift to stay positive
+            s32 u = (-43 * r - 85 * g + 128 * b + 32768 + 128) >> 8;
+            s32 v = (128 * r - 107 * g - 21 * b + 32768 + 128) >> 8;
+            
+            u32 index = cy * chromaWidth + cx;
+            planeU[index] = (u8)(u > 255 ? 255 : u);
+            planeV[index] = (u8)(v > 255 ? 255 : v);
+        }
+    }
+    
+    fputs("FRAME\n", readback->file);
+    fwrite(readback->scratch, width * height +
+           2 * chromaWidth * chromaHeight, 1, readback->file);
+}
+
+/*
+*  Worker
+*/
+
+DWORD WINAPI
+readback_worker_thread(LPVOID parameter)
+{
+    Readback *readback = (Readback *)parameter;
+    
+    for (;;)
+    {
+        WaitForSingleObjectEx(readback->readySemaphore, INFINITE, FALSE);
+        
+        // Slots become ready in ring order, a release without one is quit
+        u32 slot = readback->readSlot;
+        if (readback->slotStates[slot] != READBACK_SLOT_READY)
+        {
+            break;
+        }
+        
+        VkDeviceSize offset = slot * readback->slotSize;
+        if (!readback->coherent)
+        {
+            VkMappedMemoryRange range =
+            {
+                VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                NULL,
+                readback->memory,
+                offset,
+                readback->slotSize
+            };
+            vkInvalidateMappedMemoryRanges(readback->device, 1, &range);
+        }
+        
+        u8 *pixels = readback->mapped + offset;
+        switch (readback->format)
+        {
+            case READBACK_FORMAT_RAW:
+            {
+                fwrite(pixels, readback->width * readback->height * 4, 1,
+                       readback->file);
+            } break;
+            
+            case READBACK_FORMAT_PNG:
+            {
+                readback_encode_png(readback, pixels,
+                                    readback->slotFrames[slot]);
+            } break;
+            
+            case READBACK_FORMAT_Y4M:
+            {
+                readback_encode_y4m(readback, pixels);
+            } break;
+        }
+        
+        readback->framesWritten++;
+        readback->readSlot = (slot + 1) % READBACK_SLOTS;
+        InterlockedExchange(&readback->slotStates[slot], READBACK_SLOT_FREE);
+    }
+    
+    return 0;
+}
+
+/*
+*  Render thread
+*/
+
+/* The swapchain must have been created with TRANSFER_SRC usage. Returns
+   false when the export file can't be created. */
+bool
+readback_init(Readback *readback, VulkanContext *vk, char *fileName)
+{
+    memset(readback, 0, sizeof(*readback));
+    readback->device = vk->device;
+    readback->width = vk->swapchainExtents.width;
+    readback->height = vk->swapchainExtents.height;
+    readback->copyingSlot = READBACK_NO_SLOT;
+    
+    assert(vk->swapchainReadable);
+    
+    char *extension = strrchr(fileName, '.');
+    if (extension && _stricmp(extension, ".png") == 0)
+    {
+        readback->format = READBACK_FORMAT_PNG;
+    }
+    else if (extension && _stricmp(extension, ".y4m") == 0)
+    {
+        readback->format = READBACK_FORMAT_Y4M;
+    }
+    
+    u32 width = readback->width;
+    u32 height = readback->height;
+    
+    if (readback->format == READBACK_FORMAT_PNG)
+    {
+        strcpy_s(readback->baseName, sizeof(readback->baseName), fileName);
+        readback->baseName[extension - fileName] = 0;
+        readback_crc_init();
+    }
+    else
+    {
+        fopen_s(&readback->file, fileName, "wb");
+        if (!readback->file)
+        {
+            return false;
+        }
+        
+        if (readback->format == READBACK_FORMAT_Y4M)
+        {
+            // The frame rate is nominal, every presented frame is written
+            fprintf(readback->file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 "
+                    "C420jpeg XCOLORRANGE=FULL\n", width, height);
+        }
+        else
+        {
+            char message[128];
+            sprintf_s(message, sizeof(message),
+                      "Exporting raw %ux%u BGRA8 frames\n", width, height);
+            OutputDebugString(message);
+        }
+    }
+    
+    // Big enough for either the PNG rows or the I420 planes
+    u32 pngSize = (1 + width * 3) * height;
+    u32 y4mSize = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    readback->scratch = (u8 *)malloc(pngSize > y4mSize ? pngSize : y4mSize);
+    
+    /*
+    *  The slot ring
+    */
+    
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk->physicalDevice, &properties);
+    VkDeviceSize atom = properties.limits.nonCoherentAtomSize;
+    
+    // Slots start on atom boundaries so each can be invalidated alone
+    readback->slotSize = ((VkDeviceSize)width * height * 4 + atom - 1) /
+        atom * atom;
+    
+    VkBufferCreateInfo bufferInfo =
+    {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        NULL,
+        0,
+        readback->slotSize * READBACK_SLOTS,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL
+    };
+    
+    if (vkCreateBuffer(vk->device, &bufferInfo, NULL,
+                       &readback->buffer) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the readback buffer");
+    }
+    
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(vk->device, readback->buffer,
+                                  &memRequirements);
+    
+    // Cached first, every pixel is read back by the CPU
+    VkMemoryPropertyFlags preferences[] =
+    {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    };
+    
+    u32 typeFilter = memRequirements.memoryTypeBits;
+    u32 memoryTypeIndex = UINT32_MAX;
+    for (u32 i = 0; i < array_count(preferences); i++)
+    {
+        memoryTypeIndex = vk_try_find_memory_type(vk, typeFilter,
+                                                  preferences[i]);
+        if (memoryTypeIndex != UINT32_MAX)
+        {
+            readback->coherent = (preferences[i] &
+                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+            break;
+        }
+    }
+    assert(memoryTypeIndex != UINT32_MAX);
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        memRequirements.size,
+        memoryTypeIndex
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &readback->memory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate the readback memory");
+    }
+    
+    vkBindBufferMemory(vk->device, readback->buffer, readback->memory, 0);
+    vkMapMemory(vk->device, readback->memory, 0, VK_WHOLE_SIZE, 0,
+                (void **)&readback->mapped);
+    
+    readback->readySemaphore = CreateSemaphoreEx(NULL, 0, READBACK_SLOTS + 1,
+                                                 NULL, 0,
+                                                 SEMAPHORE_ALL_ACCESS);
+    assert(readback->readySemaphore);
+    
+    readback->thread = CreateThread(NULL, 0, readback_worker_thread,
+                                    readback, 0, NULL);
+    assert(readback->thread);
+    
+    return true;
+}
+
+// Hands every slot whose copy has landed to the worker, in ring order
+void
+readback_collect(Readback *readback, VulkanContext *vk)
+{
+    u32 slot = readback->landSlot;
+    while (readback->slotStates[slot] == READBACK_SLOT_COPYING &&
+           gpu_timeline_reached(vk, readback->slotValues[slot]))
+    {
+        InterlockedExchange(&readback->slotStates[slot], READBACK_SLOT_READY);
+        ReleaseSemaphore(readback->readySemaphore, 1, NULL);
+        slot = (slot + 1) % READBACK_SLOTS;
+    }
+    readback->landSlot = slot;
+}
+
+/* Claims the next slot for this frame's copy. If the worker hasn't
+   encoded it yet the frame is dropped, never waited for. */
+void
+readback_begin_frame(Readback *readback, u32 frameIndex)
+{
+    u32 slot = readback->writeSlot;
+    if (readback->slotStates[slot] != READBACK_SLOT_FREE)
+    {
+        readback->framesDropped++;
+        return;
+    }
+    
+    readback->slotStates[slot] = READBACK_SLOT_COPYING;
+    readback->slotFrames[slot] = frameIndex;
+    readback->slotValues[slot] = UINT64_MAX; // until the frame is submitted
+    readback->copyingSlot = slot;
+    readback->writeSlot = (slot + 1) % READBACK_SLOTS;
+}
+
+// image is in TRANSFER_SRC_OPTIMAL, the ring in TRANSFER_WRITE
+void
+readback_record(Readback *readback, VkCommandBuffer commandBuffer,
+                VkImage image)
+{
+    if (readback->copyingSlot == READBACK_NO_SLOT)
+    {
+        return;
+    }
+    
+    VkBufferImageCopy region =
+    {
+        readback->copyingSlot * readback->slotSize, // bufferOffset
+        0, // bufferRowLength (tightly packed)
+        0, // bufferImageHeight
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 }, // imageSubresource
+        { 0, 0, 0 }, // imageOffset
+        { readback->width, readback->height, 1 } // imageExtent
+    };
+    
+    vkCmdCopyImageToBuffer(commandBuffer, image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           readback->buffer, 1, &region);
+}
+
+// value is the timeline value of the submission that recorded the copy
+void
+readback_submitted(Readback *readback, u64 value)
+{
+    if (readback->copyingSlot != READBACK_NO_SLOT)
+    {
+        readback->slotValues[readback->copyingSlot] = value;
+        readback->copyingSlot = READBACK_NO_SLOT;
+    }
+}
+
+/* Waits for the copies still on the GPU, lets the worker finish
+   everything queued and closes the export. */
+void
+readback_finish(Readback *readback, VulkanContext *vk)
+{
+    gpu_timeline_wait_all(vk);
+    readback_collect(readback, vk);
+    
+    ReleaseSemaphore(readback->readySemaphore, 1, NULL);
+    WaitForSingleObject(readback->thread, INFINITE);
+    CloseHandle(readback->thread);
+    CloseHandle(readback->readySemaphore);
+    
+    if (readback->file)
+    {
+        fclose(readback->file);
+    }
+    
+    char message[128];
+    sprintf_s(message, sizeof(message),
+              "Export: %u frames written, %u dropped\n",
+              readback->framesWritten, readback->framesDropped);
+    OutputDebugString(message);
+    
+    vkUnmapMemory(readback->device, readback->memory);
+    vkDestroyBuffer(readback->device, readback->buffer, NULL);
+    vkFreeMemory(readback->device, readback->memory, NULL);
+    free(readback->scratch);
+}
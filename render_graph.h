@@ -0,0 +1,852 @@
+/*
+*  Render graph
+*
+*  Passes declare which resources they read and write and how. Compiling the
+*  graph culls passes that contribute nothing to an exported resource,
+*  computes the barriers between passes (synchronization2, one batched
+*  vkCmdPipelineBarrier2 per pass) and places transient images with
+*  disjoint lifetimes at overlapping offsets of a single memory allocation.
+*
+*  Passes run in the order they were added, which must be a valid order.
+*/
+
+#define RG_MAX_RESOURCES 32
+#define RG_MAX_PASSES 32
+#define RG_MAX_PASS_ACCESSES 8
+
+typedef enum
+{
+    RG_ACCESS_NONE, // undefined contents, nothing to wait for
+    RG_ACCESS_SWAPCHAIN_ACQUIRE, // the acquire semaphore's wait stage
+    RG_ACCESS_COLOR_ATTACHMENT_WRITE,
+    RG_ACCESS_DEPTH_ATTACHMENT_WRITE,
+    RG_ACCESS_FRAGMENT_SAMPLED_READ,
+    RG_ACCESS_COMPUTE_READ,
+    RG_ACCESS_COMPUTE_WRITE,
+    RG_ACCESS_COMPUTE_READ_WRITE,
+    RG_ACCESS_INDIRECT_READ,
+    RG_ACCESS_VERTEX_READ, // bound as a vertex buffer
+    RG_ACCESS_TRANSFER_READ,
+    RG_ACCESS_TRANSFER_WRITE,
+    RG_ACCESS_HOST_READ, // mapped and read by the CPU after a timeline wait
+    RG_ACCESS_PRESENT,
+    
+    RG_ACCESS_COUNT
+    
+} RenderGraphAccess;
+
+typedef struct
+{
+    VkPipelineStageFlags2 stages;
+    VkAccessFlags2 access;
+    VkImageLayout layout;
+    bool write;
+    VkImageUsageFlags imageUsage; // needed by transient images
+    
+} RenderGraphAccessInfo;
+
+static RenderGraphAccessInfo rgAccessInfos[RG_ACCESS_COUNT] =
+{
+    // RG_ACCESS_NONE
+    { VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+      VK_IMAGE_LAYOUT_UNDEFINED, false, 0 },
+    
+    // RG_ACCESS_SWAPCHAIN_ACQUIRE
+    { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_NONE,
+      VK_IMAGE_LAYOUT_UNDEFINED, false, 0 },
+    
+    // RG_ACCESS_COLOR_ATTACHMENT_WRITE
+    { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT |
+      VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+      VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT },
+    
+    // RG_ACCESS_DEPTH_ATTACHMENT_WRITE
+    { VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT |
+      VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+      VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+      VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true,
+      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT },
+    
+    // RG_ACCESS_FRAGMENT_SAMPLED_READ
+    { VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false,
+      VK_IMAGE_USAGE_SAMPLED_BIT },
+    
+    // RG_ACCESS_COMPUTE_READ
+    { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+      VK_IMAGE_LAYOUT_GENERAL, false, VK_IMAGE_USAGE_STORAGE_BIT },
+    
+    // RG_ACCESS_COMPUTE_WRITE
+    { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+      VK_IMAGE_LAYOUT_GENERAL, true, VK_IMAGE_USAGE_STORAGE_BIT },
+    
+    // RG_ACCESS_COMPUTE_READ_WRITE
+    { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+      VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+      VK_IMAGE_LAYOUT_GENERAL, true, VK_IMAGE_USAGE_STORAGE_BIT },
+    
+    // RG_ACCESS_INDIRECT_READ
+    { VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+      VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED, false, 0 },
+    
+    // RG_ACCESS_VERTEX_READ
+    { VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+      VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED, false, 0 },
+    
+    // RG_ACCESS_TRANSFER_READ
+    { VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false,
+      VK_IMAGE_USAGE_TRANSFER_SRC_BIT },
+    
+    // RG_ACCESS_TRANSFER_WRITE
+    { VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true,
+      VK_IMAGE_USAGE_TRANSFER_DST_BIT },
+    
+    // RG_ACCESS_HOST_READ
+    { VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED, false, 0 },
+    
+    // RG_ACCESS_PRESENT (the present waits on a semaphore, no stages)
+    { VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+      VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false, 0 },
+};
+
+typedef struct RenderGraph RenderGraph;
+typedef void RenderGraphPassCallback(RenderGraph *graph,
+                                     VkCommandBuffer commandBuffer,
+                                     void *userData);
+
+typedef enum
+{
+    RG_RESOURCE_IMAGE,
+    RG_RESOURCE_BUFFER
+    
+} RenderGraphResourceType;
+
+typedef struct
+{
+    char *name;
+    RenderGraphResourceType type;
+    bool imported;
+    
+    // Imported resources enter in initialAccess and leave in finalAccess.
+    // A final access other than RG_ACCESS_NONE exports the resource.
+    RenderGraphAccess initialAccess;
+    RenderGraphAccess finalAccess;
+    
+    VkImage image;
+    VkImageView imageView;
+    VkBuffer buffer;
+    
+    // Transient images only
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageAspectFlags aspect;
+    VkImageUsageFlags usage;
+    VkDeviceSize memoryOffset;
+    VkDeviceSize memorySize;
+    VkDeviceSize memoryAlignment;
+    u32 firstPass; // lifetime in live pass order
+    u32 lastPass;
+    
+} RenderGraphResource;
+
+typedef struct
+{
+    u32 resource;
+    RenderGraphAccess access;
+    
+} RenderGraphPassAccess;
+
+typedef struct
+{
+    char *name;
+    RenderGraphPassCallback *callback;
+    void *userData;
+    bool sideEffects; // never culled
+    
+    RenderGraphPassAccess accesses[RG_MAX_PASS_ACCESSES];
+    u32 accessCount;
+    
+    bool live;
+    
+    // Barriers recorded before the pass, handles patched in at execute
+    u32 barrierFirst;
+    u32 barrierCount;
+    
+} RenderGraphPass;
+
+typedef struct
+{
+    u32 resource;
+    VkPipelineStageFlags2 srcStages;
+    VkAccessFlags2 srcAccess;
+    VkPipelineStageFlags2 dstStages;
+    VkAccessFlags2 dstAccess;
+    VkImageLayout oldLayout;
+    VkImageLayout newLayout;
+    
+} RenderGraphBarrier;
+
+// Where a resource was left by the passes compiled so far
+typedef struct
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags2 writeStages; // last write or layout transition
+    VkAccessFlags2 writeAccess;
+    VkPipelineStageFlags2 readStages; // reads since then (for WAR)
+    VkPipelineStageFlags2 visibleStages; // reads already synchronized
+    VkAccessFlags2 visibleAccess;
+    
+} RenderGraphResourceState;
+
+struct RenderGraph
+{
+    RenderGraphResource resources[RG_MAX_RESOURCES];
+    u32 resourceCount;
+    
+    RenderGraphPass passes[RG_MAX_PASSES];
+    u32 passCount;
+    
+    // One list for all passes, plus the exports after the last pass
+    RenderGraphBarrier barriers[RG_MAX_PASSES * RG_MAX_PASS_ACCESSES +
+                                RG_MAX_RESOURCES];
+    u32 barrierCount;
+    u32 finalBarrierFirst;
+    u32 finalBarrierCount;
+    
+    VkDeviceMemory transientMemory;
+    VkDeviceSize transientMemorySize;
+    VkDeviceSize transientMemoryUnaliased; // what separate allocations need
+    
+    u32 livePassCount;
+};
+
+/*
+*  Building the graph
+*/
+
+u32
+rg_add_resource(RenderGraph *graph, RenderGraphResource *resource)
+{
+    assert(graph->resourceCount < RG_MAX_RESOURCES);
+    
+    u32 index = graph->resourceCount++;
+    graph->resources[index] = *resource;
+    
+    return index;
+}
+
+// The image handle can change every frame, see rg_set_image
+u32
+rg_import_image(RenderGraph *graph, char *name, VkImageAspectFlags aspect,
+                RenderGraphAccess initialAccess,
+                RenderGraphAccess finalAccess)
+{
+    RenderGraphResource resource = {0};
+    resource.name = name;
+    resource.type = RG_RESOURCE_IMAGE;
+    resource.imported = true;
+    resource.initialAccess = initialAccess;
+    resource.finalAccess = finalAccess;
+    resource.aspect = aspect;
+    
+    return rg_add_resource(graph, &resource);
+}
+
+u32
+rg_import_buffer(RenderGraph *graph, char *name, VkBuffer buffer,
+                 RenderGraphAccess initialAccess,
+                 RenderGraphAccess finalAccess)
+{
+    RenderGraphResource resource = {0};
+    resource.name = name;
+    resource.type = RG_RESOURCE_BUFFER;
+    resource.imported = true;
+    resource.initialAccess = initialAccess;
+    resource.finalAccess = finalAccess;
+    resource.buffer = buffer;
+    
+    return rg_add_resource(graph, &resource);
+}
+
+// Created, placed in aliased memory and destroyed by the graph
+u32
+rg_create_transient_image(RenderGraph *graph, char *name, VkFormat format,
+                          VkExtent2D extent, VkImageAspectFlags aspect)
+{
+    RenderGraphResource resource = {0};
+    resource.name = name;
+    resource.type = RG_RESOURCE_IMAGE;
+    resource.initialAccess = RG_ACCESS_NONE;
+    resource.finalAccess = RG_ACCESS_NONE;
+    resource.format = format;
+    resource.extent = extent;
+    resource.aspect = aspect;
+    
+    return rg_add_resource(graph, &resource);
+}
+
+u32
+rg_add_pass(RenderGraph *graph, char *name,
+            RenderGraphPassCallback *callback, void *userData)
+{
+    assert(graph->passCount < RG_MAX_PASSES);
+    
+    u32 index = graph->passCount++;
+    RenderGraphPass *pass = &graph->passes[index];
+    
+    memset(pass, 0, sizeof(*pass));
+    pass->name = name;
+    pass->callback = callback;
+    pass->userData = userData;
+    
+    return index;
+}
+
+// Each resource can be declared once per pass
+void
+rg_pass_access(RenderGraph *graph, u32 passIndex, u32 resource,
+               RenderGraphAccess access)
+{
+    RenderGraphPass *pass = &graph->passes[passIndex];
+    assert(pass->accessCount < RG_MAX_PASS_ACCESSES);
+    
+    for (u32 i = 0; i < pass->accessCount; i++)
+    {
+        assert(pass->accesses[i].resource != resource);
+    }
+    
+    RenderGraphPassAccess passAccess = { resource, access };
+    pass->accesses[pass->accessCount++] = passAccess;
+}
+
+/* For passes that do work the graph can't see, on resources they manage
+   themselves, so they are never culled */
+void
+rg_pass_side_effects(RenderGraph *graph, u32 passIndex)
+{
+    graph->passes[passIndex].sideEffects = true;
+}
+
+/*
+*  Compiling
+*/
+
+void
+rg_cull_passes(RenderGraph *graph)
+{
+    bool needed[RG_MAX_RESOURCES] = {0};
+    
+    // Walk backwards: a pass lives if something later needs what it writes
+    for (s32 p = (s32)graph->passCount - 1; p >= 0; p--)
+    {
+        RenderGraphPass *pass = &graph->passes[p];
+        pass->live = pass->sideEffects;
+        
+        for (u32 a = 0; a < pass->accessCount; a++)
+        {
+            RenderGraphPassAccess *access = &pass->accesses[a];
+            RenderGraphResource *resource = &graph->resources[access->resource];
+            
+            bool exported = resource->imported &&
+                resource->finalAccess != RG_ACCESS_NONE;
+            
+            if (rgAccessInfos[access->access].write &&
+                (needed[access->resource] || exported))
+            {
+                pass->live = true;
+            }
+        }
+        
+        if (pass->live)
+        {
+            for (u32 a = 0; a < pass->accessCount; a++)
+            {
+                RenderGraphPassAccess *access = &pass->accesses[a];
+                if (!rgAccessInfos[access->access].write ||
+                    access->access == RG_ACCESS_COMPUTE_READ_WRITE ||
+                    access->access == RG_ACCESS_COLOR_ATTACHMENT_WRITE ||
+                    access->access == RG_ACCESS_DEPTH_ATTACHMENT_WRITE)
+                {
+                    // Read-modify-write accesses need the earlier contents
+                    needed[access->resource] = true;
+                }
+            }
+        }
+    }
+}
+
+/* Records the barrier (if any) that moves a resource from its current state
+   to the given access, then updates the state. */
+void
+rg_transition(RenderGraph *graph, RenderGraphResourceState *state,
+              u32 resourceIndex, RenderGraphAccess access)
+{
+    RenderGraphAccessInfo *info = &rgAccessInfos[access];
+    RenderGraphResource *resource = &graph->resources[resourceIndex];
+    
+    bool isImage = resource->type == RG_RESOURCE_IMAGE;
+    bool layoutChange = isImage && state->layout != info->layout;
+    
+    RenderGraphBarrier barrier = {0};
+    barrier.resource = resourceIndex;
+    barrier.dstStages = info->stages;
+    barrier.dstAccess = info->access;
+    barrier.oldLayout = state->layout;
+    barrier.newLayout = isImage ? info->layout : VK_IMAGE_LAYOUT_UNDEFINED;
+    
+    bool needBarrier = false;
+    if (layoutChange || info->write)
+    {
+        // Wait for the last write (WAW) and every read since (WAR)
+        barrier.srcStages = state->writeStages | state->readStages;
+        barrier.srcAccess = state->writeAccess;
+        needBarrier = layoutChange || barrier.srcStages != 0;
+    }
+    else if (state->writeStages &&
+             ((info->stages & ~state->visibleStages) ||
+              (info->access & ~state->visibleAccess)))
+    {
+        // Read after write that no earlier barrier made visible here
+        barrier.srcStages = state->writeStages;
+        barrier.srcAccess = state->writeAccess;
+        needBarrier = true;
+    }
+    
+    if (needBarrier)
+    {
+        assert(graph->barrierCount < array_count(graph->barriers));
+        graph->barriers[graph->barrierCount++] = barrier;
+    }
+    
+    if (info->write)
+    {
+        state->writeStages = info->stages;
+        state->writeAccess = info->access;
+        state->readStages = 0;
+        state->visibleStages = 0;
+        state->visibleAccess = 0;
+    }
+    else if (layoutChange)
+    {
+        // The transition itself is a write the next readers must wait on
+        state->writeStages = info->stages;
+        state->writeAccess = VK_ACCESS_2_NONE;
+        state->readStages = info->stages;
+        state->visibleStages = info->stages;
+        state->visibleAccess = info->access;
+    }
+    else
+    {
+        state->readStages |= info->stages;
+        if (needBarrier)
+        {
+            state->visibleStages |= info->stages;
+            state->visibleAccess |= info->access;
+        }
+    }
+    
+    state->layout = barrier.newLayout;
+}
+
+/* Places transient images in one allocation. Biggest first, each at the
+   lowest offset that does not overlap an already placed image whose
+   lifetime overlaps its own. */
+void
+rg_allocate_transients(RenderGraph *graph, VulkanContext *vk)
+{
+    u32 order[RG_MAX_RESOURCES];
+    u32 transientCount = 0;
+    u32 memoryTypeBits = UINT32_MAX;
+    
+    for (u32 r = 0; r < graph->resourceCount; r++)
+    {
+        RenderGraphResource *resource = &graph->resources[r];
+        if (resource->imported || resource->firstPass == UINT32_MAX)
+        {
+            continue; // imported, or only used by culled passes
+        }
+        
+        VkImageCreateInfo imageInfo =
+        {
+            VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            NULL,
+            0,
+            VK_IMAGE_TYPE_2D,
+            resource->format,
+            { resource->extent.width, resource->extent.height, 1 },
+            1, // mipLevels
+            1, // arrayLayers
+            VK_SAMPLE_COUNT_1_BIT,
+            VK_IMAGE_TILING_OPTIMAL,
+            resource->usage,
+            VK_SHARING_MODE_EXCLUSIVE,
+            0, NULL, // queue families ignored
+            VK_IMAGE_LAYOUT_UNDEFINED
+        };
+        
+        if (vkCreateImage(vk->device, &imageInfo, NULL,
+                          &resource->image) != VK_SUCCESS)
+        {
+            assert(!"Failed to create transient image");
+        }
+        
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(vk->device, resource->image,
+                                     &requirements);
+        
+        resource->memorySize = requirements.size;
+        resource->memoryAlignment = requirements.alignment;
+        memoryTypeBits &= requirements.memoryTypeBits;
+        
+        graph->transientMemoryUnaliased += resource->memorySize;
+        
+        // Insertion sort by size, descending
+        u32 slot = transientCount++;
+        while (slot > 0 &&
+               graph->resources[order[slot - 1]].memorySize <
+               resource->memorySize)
+        {
+            order[slot] = order[slot - 1];
+            slot--;
+        }
+        order[slot] = r;
+    }
+    
+    if (transientCount == 0)
+    {
+        return;
+    }
+    
+    assert(memoryTypeBits && "Transient images have no common memory type");
+    
+    VkDeviceSize totalSize = 0;
+    for (u32 i = 0; i < transientCount; i++)
+    {
+        RenderGraphResource *resource = &graph->resources[order[i]];
+        VkDeviceSize offset = 0;
+        
+        // Bump past any overlapping neighbour until the range is free
+        bool moved = true;
+        while (moved)
+        {
+            moved = false;
+            for (u32 j = 0; j < i; j++)
+            {
+                RenderGraphResource *other = &graph->resources[order[j]];
+                
+                bool livesOverlap = resource->firstPass <= other->lastPass &&
+                    other->firstPass <= resource->lastPass;
+                bool memoryOverlaps =
+                    offset < other->memoryOffset + other->memorySize &&
+                    other->memoryOffset < offset + resource->memorySize;
+                
+                // Past its end, then up to this image's own alignment,
+                // which need not be the neighbour's
+                if (livesOverlap && memoryOverlaps)
+                {
+                    VkDeviceSize alignment = resource->memoryAlignment;
+                    offset = other->memoryOffset + other->memorySize;
+                    offset = (offset + alignment - 1) / alignment * alignment;
+                    moved = true;
+                }
+            }
+        }
+        
+        resource->memoryOffset = offset;
+        if (offset + resource->memorySize > totalSize)
+        {
+            totalSize = offset + resource->memorySize;
+        }
+    }
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        totalSize,
+        vk_find_memory_type(vk, memoryTypeBits,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &graph->transientMemory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate transient memory");
+    }
+    
+    graph->transientMemorySize = totalSize;
+    
+    for (u32 i = 0; i < transientCount; i++)
+    {
+        RenderGraphResource *resource = &graph->resources[order[i]];
+        
+        vkBindImageMemory(vk->device, resource->image, graph->transientMemory,
+                          resource->memoryOffset);
+        
+        resource->imageView = vk_create_image_view(vk, resource->image,
+                                                   resource->format,
+                                                   resource->aspect);
+    }
+}
+
+void
+rg_compile(RenderGraph *graph, VulkanContext *vk)
+{
+    rg_cull_passes(graph);
+    
+    // Lifetimes and usage of transient images over the live passes
+    for (u32 r = 0; r < graph->resourceCount; r++)
+    {
+        graph->resources[r].firstPass = UINT32_MAX;
+        graph->resources[r].lastPass = 0;
+    }
+    
+    u32 liveIndex = 0;
+    for (u32 p = 0; p < graph->passCount; p++)
+    {
+        RenderGraphPass *pass = &graph->passes[p];
+        if (!pass->live)
+        {
+            continue;
+        }
+        
+        for (u32 a = 0; a < pass->accessCount; a++)
+        {
+            RenderGraphResource *resource =
+                &graph->resources[pass->accesses[a].resource];
+            
+            if (resource->firstPass == UINT32_MAX)
+            {
+                resource->firstPass = liveIndex;
+            }
+            resource->lastPass = liveIndex;
+            resource->usage |= rgAccessInfos[pass->accesses[a].access].imageUsage;
+        }
+        
+        liveIndex++;
+    }
+    graph->livePassCount = liveIndex;
+    
+    rg_allocate_transients(graph, vk);
+    
+    // Each transient's last use, for the aliasing barriers below
+    VkPipelineStageFlags2 lastUseStages[RG_MAX_RESOURCES] = {0};
+    VkAccessFlags2 lastUseWrites[RG_MAX_RESOURCES] = {0};
+    
+    RenderGraphResourceState states[RG_MAX_RESOURCES];
+    for (u32 r = 0; r < graph->resourceCount; r++)
+    {
+        RenderGraphAccessInfo *initial =
+            &rgAccessInfos[graph->resources[r].initialAccess];
+        
+        RenderGraphResourceState state =
+        {
+            initial->layout,
+            initial->stages, // writeStages
+            initial->access, // writeAccess
+            0, 0, 0
+        };
+        
+        states[r] = state;
+    }
+    
+    liveIndex = 0;
+    for (u32 p = 0; p < graph->passCount; p++)
+    {
+        RenderGraphPass *pass = &graph->passes[p];
+        if (!pass->live)
+        {
+            continue;
+        }
+        
+        pass->barrierFirst = graph->barrierCount;
+        
+        for (u32 a = 0; a < pass->accessCount; a++)
+        {
+            u32 r = pass->accesses[a].resource;
+            RenderGraphResource *resource = &graph->resources[r];
+            
+            /* First use of an aliased transient: whatever used the same
+               memory before must be done with it first. */
+            if (!resource->imported && resource->firstPass == liveIndex)
+            {
+                for (u32 o = 0; o < graph->resourceCount; o++)
+                {
+                    RenderGraphResource *other = &graph->resources[o];
+                    if (o != r && !other->imported &&
+                        other->firstPass != UINT32_MAX &&
+                        other->lastPass < liveIndex &&
+                        resource->memoryOffset <
+                        other->memoryOffset + other->memorySize &&
+                        other->memoryOffset <
+                        resource->memoryOffset + resource->memorySize)
+                    {
+                        states[r].writeStages |= lastUseStages[o];
+                        states[r].writeAccess |= lastUseWrites[o];
+                    }
+                }
+            }
+            
+            RenderGraphAccessInfo *info = &rgAccessInfos[pass->accesses[a].access];
+            rg_transition(graph, &states[r], r, pass->accesses[a].access);
+            
+            lastUseStages[r] = info->stages;
+            lastUseWrites[r] = info->write ? info->access : VK_ACCESS_2_NONE;
+        }
+        
+        pass->barrierCount = graph->barrierCount - pass->barrierFirst;
+        liveIndex++;
+    }
+    
+    // Leave exported resources the way the outside world expects them
+    graph->finalBarrierFirst = graph->barrierCount;
+    for (u32 r = 0; r < graph->resourceCount; r++)
+    {
+        RenderGraphResource *resource = &graph->resources[r];
+        if (resource->imported && resource->finalAccess != RG_ACCESS_NONE)
+        {
+            rg_transition(graph, &states[r], r, resource->finalAccess);
+        }
+    }
+    graph->finalBarrierCount = graph->barrierCount - graph->finalBarrierFirst;
+}
+
+/*
+*  Executing
+*/
+
+void
+rg_set_image(RenderGraph *graph, u32 resource, VkImage image,
+             VkImageView imageView)
+{
+    assert(graph->resources[resource].imported);
+    graph->resources[resource].image = image;
+    graph->resources[resource].imageView = imageView;
+}
+
+VkImageView
+rg_image_view(RenderGraph *graph, u32 resource)
+{
+    return graph->resources[resource].imageView;
+}
+
+void
+rg_record_barriers(RenderGraph *graph, VkCommandBuffer commandBuffer,
+                   u32 first, u32 count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    
+    VkImageMemoryBarrier2 imageBarriers[RG_MAX_RESOURCES];
+    VkBufferMemoryBarrier2 bufferBarriers[RG_MAX_RESOURCES];
+    u32 imageBarrierCount = 0;
+    u32 bufferBarrierCount = 0;
+    
+    for (u32 i = first; i < first + count; i++)
+    {
+        RenderGraphBarrier *barrier = &graph->barriers[i];
+        RenderGraphResource *resource = &graph->resources[barrier->resource];
+        
+        if (resource->type == RG_RESOURCE_IMAGE)
+        {
+            VkImageMemoryBarrier2 imageBarrier =
+            {
+                VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                NULL,
+                barrier->srcStages,
+                barrier->srcAccess,
+                barrier->dstStages,
+                barrier->dstAccess,
+                barrier->oldLayout,
+                barrier->newLayout,
+                VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+                VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+                resource->image,
+                { resource->aspect, 0, 1, 0, 1 } // all of it
+            };
+            
+            imageBarriers[imageBarrierCount++] = imageBarrier;
+        }
+        else
+        {
+            VkBufferMemoryBarrier2 bufferBarrier =
+            {
+                VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                NULL,
+                barrier->srcStages,
+                barrier->srcAccess,
+                barrier->dstStages,
+                barrier->dstAccess,
+                VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+                VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+                resource->buffer,
+                0, VK_WHOLE_SIZE
+            };
+            
+            bufferBarriers[bufferBarrierCount++] = bufferBarrier;
+        }
+    }
+    
+    VkDependencyInfo dependencyInfo =
+    {
+        VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        NULL,
+        0, // dependencyFlags
+        0, NULL, // no global memory barriers
+        bufferBarrierCount, bufferBarriers,
+        imageBarrierCount, imageBarriers
+    };
+    
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+// Records every live pass, each preceded by its batched barriers
+void
+rg_execute(RenderGraph *graph, VkCommandBuffer commandBuffer)
+{
+    for (u32 p = 0; p < graph->passCount; p++)
+    {
+        RenderGraphPass *pass = &graph->passes[p];
+        if (!pass->live)
+        {
+            continue;
+        }
+        
+        rg_record_barriers(graph, commandBuffer, pass->barrierFirst,
+                           pass->barrierCount);
+        
+        pass->callback(graph, commandBuffer, pass->userData);
+    }
+    
+    rg_record_barriers(graph, commandBuffer, graph->finalBarrierFirst,
+                       graph->finalBarrierCount);
+}
+
+void
+rg_destroy(RenderGraph *graph, VulkanContext *vk)
+{
+    for (u32 r = 0; r < graph->resourceCount; r++)
+    {
+        RenderGraphResource *resource = &graph->resources[r];
+        if (!resource->imported && resource->image)
+        {
+            vkDestroyImageView(vk->device, resource->imageView, NULL);
+            vkDestroyImage(vk->device, resource->image, NULL);
+        }
+    }
+    
+    if (graph->transientMemory)
+    {
+        vkFreeMemory(vk->device, graph->transientMemory, NULL);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+*  Embedded SPIR-V
+*
+*  build.bat compiles every shader with glslc -mfmt=c, which writes the
+*  SPIR-V words as a C initializer list, one .inc file per shader in bin.
+*  They are included here as u32 arrays, so the code is word aligned and
+*  can go to vkCreateShaderModule as it is, and nothing is read from disk
+*  at startup.
+*
+*  To try out a shader without rebuilding, compile it to <name>.spv the
+*  way the README shows and run with -shaders <directory>: every shader
+*  with a .spv file there is loaded from it instead, the rest stay
+*  embedded.
+*/
+
+typedef enum
+{
+    SHADER_VERT, // shader.vert
+    SHADER_FRAG, // shader.frag
+    SHADER_OVERDRAW, // overdraw.frag
+    SHADER_SDF, // sdf.frag
+    SHADER_COLOR, // color.vert
+    SHADER_PULL, // pull.vert
+    SHADER_CULL, // cull.comp
+    
+    SHADER_COUNT
+    
+} ShaderId;
+
+static const u32 shaderVertCode[] =
+#include "vert.inc"
+;
+static const u32 shaderFragCode[] =
+#include "frag.inc"
+;
+static const u32 shaderOverdrawCode[] =
+#include "overdraw.inc"
+;
+static const u32 shaderSdfCode[] =
+#include "sdf.inc"
+;
+static const u32 shaderColorCode[] =
+#include "color.inc"
+;
+static const u32 shaderPullCode[] =
+#include "pull.inc"
+;
+static const u32 shaderCullCode[] =
+#include "cull.inc"
+;
+
+typedef struct
+{
+    char *name; // <name>.spv in the override directory
+    const u32 *code;
+    size_t size; // in bytes
+    
+} EmbeddedShader;
+
+static EmbeddedShader embeddedShaders[SHADER_COUNT] =
+{
+    { "vert", shaderVertCode, sizeof(shaderVertCode) },
+    { "frag", shaderFragCode, sizeof(shaderFragCode) },
+    { "overdraw", shaderOverdrawCode, sizeof(shaderOverdrawCode) },
+    { "sdf", shaderSdfCode, sizeof(shaderSdfCode) },
+    { "color", shaderColorCode, sizeof(shaderColorCode) },
+    { "pull", shaderPullCode, sizeof(shaderPullCode) },
+    { "cull", shaderCullCode, sizeof(shaderCullCode) }
+};
+
+/* The shader's code, read from overrideDirectory if it has the shader's
+   .spv file, embedded otherwise. overrideDirectory may be NULL. fromDisk
+   is set when the code was read, it is then the caller's to free once
+   the shader module exists, the embedded code never is. */
+LoadedFile
+shader_code(ShaderId id, char *overrideDirectory, bool *fromDisk)
+{
+    assert(id < SHADER_COUNT);
+    EmbeddedShader *shader = &embeddedShaders[id];
+    *fromDisk = false;
+    
+    if (overrideDirectory)
+    {
+        char path[MAX_PATH];
+        sprintf_s(path, sizeof(path), "%s\\%s.spv", overrideDirectory,
+                  shader->name);
+        
+        if (GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES)
+        {
+            char message[MAX_PATH + 32];
+            sprintf_s(message, sizeof(message), "Shader override: %s\n",
+                      path);
+            OutputDebugString(message);
+            
+            *fromDisk = true;
+            return load_entire_file(path);
+        }
+    }
+    
+    LoadedFile result;
+    result.data = (void *)shader->code;
+    result.size = shader->size;
+    
+    return result;
+}
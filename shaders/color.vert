@@ -0,0 +1,42 @@
+#version 450
+
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec2 inUV;
+layout(location = 2) in vec4 inColor; // RGBA8, unpacked by vertex fetch
+
+layout(location = 0) out vec2 outUV;
+layout(location = 1) out vec4 outTint;
+
+layout(set = 0, binding = 1) uniform UniformBufferObject
+{
+    layout(row_major) mat4 projection;
+} ubo;
+
+// Decode of quantized positions (see vertex_format.h), fixed per pipeline
+layout(constant_id = 0) const float DECODE_SCALE_X = 1.0;
+layout(constant_id = 1) const float DECODE_SCALE_Y = 1.0;
+layout(constant_id = 2) const float DECODE_BIAS_X = 0.0;
+layout(constant_id = 3) const float DECODE_BIAS_Y = 0.0;
+
+// Per-draw data, see PushConstants in main.c
+layout(push_constant) uniform PushConstants
+{
+    vec4 transform; // row-major 2x2 (rotation and scale)
+    vec2 offset; // translation in pixels
+    float depth; // 0 (near) to 1 (far)
+    vec4 tint; // RGBA color multiplier
+} pc;
+
+// shader.vert with a per-vertex color multiplied into the tint
+void main()
+{
+    vec2 local = inPosition * vec2(DECODE_SCALE_X, DECODE_SCALE_Y) +
+                 vec2(DECODE_BIAS_X, DECODE_BIAS_Y);
+    
+    vec2 position = vec2(dot(pc.transform.xy, local),
+                         dot(pc.transform.zw, local)) + pc.offset;
+    
+    gl_Position = ubo.projection * vec4(position, pc.depth, 1.0);
+    outUV = inUV;
+    outTint = pc.tint * inColor;
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#version 450
+
+layout(location = 0) in vec2 inUV;
+layout(location = 1) in vec4 inTint;
+
+layout(location = 0) out vec4 outColor;
+
+// Debug overdraw view: every fragment shaded adds the same amount of heat
+// (additive blending), so bright areas are the ones shaded many times.
+void main()
+{
+    outColor = vec4(0.1, 0.04, 0.01, 1.0);
+}
\ No newline at end of file
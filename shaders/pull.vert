@@ -0,0 +1,57 @@
+#version 450
+
+layout(location = 0) out vec2 outUV;
+layout(location = 1) out vec4 outTint;
+
+layout(set = 0, binding = 1) uniform UniformBufferObject
+{
+    layout(row_major) mat4 projection;
+} ubo;
+
+// One per sprite, see SpriteRecord in main.c
+struct SpriteRecord
+{
+    vec2 center;
+    uint size; // width and height as half floats, width in the low bits
+    float rotation;
+};
+
+layout(std430, set = 0, binding = 2) readonly buffer SpriteRecords
+{
+    SpriteRecord records[];
+};
+
+// Per-draw data, see PushConstants in main.c
+layout(push_constant) uniform PushConstants
+{
+    vec4 transform; // row-major 2x2 (rotation and scale)
+    vec2 offset; // translation in pixels
+    float depth; // 0 (near) to 1 (far)
+    vec4 tint; // RGBA color multiplier
+} pc;
+
+// Corner UVs of the two triangles, in the order emit_sprite_lanes writes
+// the vertices, so the winding matches the vertex buffer path
+const vec2 corners[6] = vec2[6](vec2(0, 0), vec2(1, 0), vec2(1, 1),
+                                vec2(0, 0), vec2(1, 1), vec2(0, 1));
+
+// No vertex input, six invocations per record build its quad
+void main()
+{
+    SpriteRecord record = records[gl_VertexIndex / 6];
+    vec2 corner = corners[gl_VertexIndex % 6];
+    
+    vec2 local = (corner * 2.0 - 1.0) * 0.5 * unpackHalf2x16(record.size);
+    float s = sin(record.rotation);
+    float c = cos(record.rotation);
+    
+    vec2 world = record.center + vec2(local.x * c - local.y * s,
+                                      local.x * s + local.y * c);
+    
+    vec2 position = vec2(dot(pc.transform.xy, world),
+                         dot(pc.transform.zw, world)) + pc.offset;
+    
+    gl_Position = ubo.projection * vec4(position, pc.depth, 1.0);
+    outUV = corner;
+    outTint = pc.tint;
+}
\ No newline at end of file
@@ -0,0 +1,19 @@
+#version 450
+
+layout(location = 0) in vec2 inUV;
+layout(location = 1) in vec4 inTint;
+layout(set = 0, binding = 0) uniform sampler2D atlasSampler;
+
+layout(location = 0) out vec4 outColor;
+
+// Glyph atlas texels hold 0.5 on the outline, more inside, less outside
+void main()
+{
+    float distance = texture(atlasSampler, inUV).r;
+    
+    // About one pixel of antialiasing whatever the scale
+    float width = max(fwidth(distance), 0.0001);
+    float coverage = smoothstep(0.5 - width, 0.5 + width, distance);
+    
+    outColor = vec4(inTint.rgb, inTint.a * coverage);
+}
\ No newline at end of file
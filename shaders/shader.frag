@@ -1,11 +1,34 @@
 #version 450
 
 layout(location = 0) in vec2 inUV;
+layout(location = 1) in vec4 inTint;
 layout(set = 0, binding = 0) uniform sampler2D texSampler;
 
 layout(location = 0) out vec4 outColor;
 
+// Fixed per pipeline (see ShaderFeature in pipeline_cache.h), so the
+// branches below are resolved when the pipeline is compiled
+layout(constant_id = 0) const bool TEXTURED = true;
+layout(constant_id = 1) const bool ALPHA_TEST = false;
+layout(constant_id = 2) const bool TINTED = true;
+
 void main()
 {
-    outColor = texture(texSampler, inUV);
+    vec4 color = vec4(1.0);
+    if (TEXTURED)
+    {
+        color = texture(texSampler, inUV);
+    }
+    
+    if (ALPHA_TEST && color.a < 0.5)
+    {
+        discard;
+    }
+    
+    if (TINTED)
+    {
+        color *= inTint;
+    }
+    
+    outColor = color;
 }
\ No newline at end of file
@@ -0,0 +1,268 @@
+/*
+*  Shadow buffers with dirty ranges
+*
+*  A device-local buffer with a full copy of its contents in CPU memory.
+*  Edits go to the shadow copy and mark byte ranges dirty. The dirty list
+*  stays sorted and coalesced: ranges that overlap or sit within
+*  SHADOW_MERGE_GAP bytes of each other become one, since copying a few
+*  extra bytes is cheaper than another region. Once per frame the dirty
+*  bytes are packed into that frame's staging buffer and turned into a
+*  minimal list of VkBufferCopy regions.
+*
+*  There is one staging buffer per frame in flight, so packing the next
+*  frame never overwrites bytes a previous frame's copy is still reading.
+*  Each one remembers the timeline value of the frame that read it last,
+*  and packing waits for that value, which has normally long passed.
+*/
+
+#define SHADOW_STAGING_FRAMES 2
+#define SHADOW_MAX_RANGES 512
+#define SHADOW_MERGE_GAP 256 // bytes
+
+typedef struct
+{
+    VkDeviceSize begin;
+    VkDeviceSize end;
+    
+} ShadowRange;
+
+typedef struct
+{
+    VulkanContext *vk;
+    VkDeviceSize size;
+    u8 *shadow;
+    
+    VkBuffer buffer; // device local
+    VkDeviceMemory bufferMemory;
+    
+    VkDeviceSize stagingCapacity; // dirty bytes that fit in one frame
+    VkBuffer stagingBuffers[SHADOW_STAGING_FRAMES];
+    VkDeviceMemory stagingMemories[SHADOW_STAGING_FRAMES];
+    u8 *staging[SHADOW_STAGING_FRAMES];
+    u64 stagingValues[SHADOW_STAGING_FRAMES]; // reusable once reached
+    u32 stagingIndex; // the one shadow_buffer_flush filled last
+    
+    ShadowRange ranges[SHADOW_MAX_RANGES]; // sorted, disjoint
+    u32 rangeCount;
+    
+    VkBufferCopy copies[SHADOW_MAX_RANGES];
+    u32 copyCount;
+    VkDeviceSize copyBytes;
+    
+} ShadowBuffer;
+
+/* Creates the device-local buffer with initialData (or zeroes) in it and
+   in the shadow copy. Frames copy at most stagingCapacity bytes, the rest
+   of the dirty ranges carry over to the next frame. */
+void
+shadow_buffer_init(ShadowBuffer *shadow, VulkanContext *vk, VkDeviceSize size,
+                   VkBufferUsageFlags usage, void *initialData,
+                   VkDeviceSize stagingCapacity)
+{
+    memset(shadow, 0, sizeof(*shadow));
+    shadow->vk = vk;
+    shadow->size = size;
+    shadow->stagingCapacity = stagingCapacity;
+    
+    shadow->shadow = (u8 *)calloc(1, (size_t)size);
+    assert(shadow->shadow);
+    
+    if (initialData)
+    {
+        memcpy(shadow->shadow, initialData, (size_t)size);
+    }
+    
+    vk_create_device_local_buffer(vk, size, usage, shadow->shadow,
+                                  &shadow->buffer, &shadow->bufferMemory);
+    
+    for (u32 i = 0; i < SHADOW_STAGING_FRAMES; i++)
+    {
+        vk_create_buffer(vk, stagingCapacity,
+                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         &shadow->stagingBuffers[i],
+                         &shadow->stagingMemories[i]);
+        
+        vkMapMemory(vk->device, shadow->stagingMemories[i], 0,
+                    stagingCapacity, 0, (void **)&shadow->staging[i]);
+        assert(shadow->staging[i]);
+    }
+}
+
+// Adds [offset, offset + size) to the dirty list, merging where it can
+void
+shadow_buffer_mark(ShadowBuffer *shadow, VkDeviceSize offset,
+                   VkDeviceSize size)
+{
+    assert(offset + size <= shadow->size);
+    
+    VkDeviceSize begin = offset;
+    VkDeviceSize end = offset + size;
+    ShadowRange *ranges = shadow->ranges;
+    
+    // First range that ends close enough to begin to merge with
+    u32 low = 0;
+    u32 high = shadow->rangeCount;
+    while (low < high)
+    {
+        u32 middle = (low + high) / 2;
+        if (ranges[middle].end + SHADOW_MERGE_GAP < begin)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    // Swallow every range from there that starts close enough to end
+    u32 first = low;
+    u32 last = first;
+    while (last < shadow->rangeCount &&
+           ranges[last].begin <= end + SHADOW_MERGE_GAP)
+    {
+        begin = ranges[last].begin < begin ? ranges[last].begin : begin;
+        end = ranges[last].end > end ? ranges[last].end : end;
+        last++;
+    }
+    
+    if (last > first)
+    {
+        ranges[first].begin = begin;
+        ranges[first].end = end;
+        
+        memmove(ranges + first + 1, ranges + last,
+                (shadow->rangeCount - last) * sizeof(ShadowRange));
+        shadow->rangeCount -= last - first - 1;
+        return;
+    }
+    
+    if (shadow->rangeCount == SHADOW_MAX_RANGES)
+    {
+        // No room for another range, grow the nearer neighbour instead
+        VkDeviceSize gapBefore = first > 0 ?
+            begin - ranges[first - 1].end : (VkDeviceSize)-1;
+        VkDeviceSize gapAfter = first < shadow->rangeCount ?
+            ranges[first].begin - end : (VkDeviceSize)-1;
+        
+        if (gapBefore <= gapAfter)
+        {
+            ranges[first - 1].end = end;
+        }
+        else
+        {
+            ranges[first].begin = begin;
+        }
+        return;
+    }
+    
+    memmove(ranges + first + 1, ranges + first,
+            (shadow->rangeCount - first) * sizeof(ShadowRange));
+    ranges[first].begin = begin;
+    ranges[first].end = end;
+    shadow->rangeCount++;
+}
+
+// Copies data into the shadow copy and marks it dirty
+void
+shadow_buffer_write(ShadowBuffer *shadow, VkDeviceSize offset, void *data,
+                    VkDeviceSize size)
+{
+    memcpy(shadow->shadow + offset, data, (size_t)size);
+    shadow_buffer_mark(shadow, offset, size);
+}
+
+/* Packs as many dirty bytes as fit into the staging buffer of frameIndex
+   and queues their copies. A range cut off by the capacity keeps its
+   remainder dirty for next time. */
+void
+shadow_buffer_flush(ShadowBuffer *shadow, u32 frameIndex)
+{
+    shadow->stagingIndex = frameIndex % SHADOW_STAGING_FRAMES;
+    u8 *staging = shadow->staging[shadow->stagingIndex];
+    
+    gpu_timeline_wait(shadow->vk, shadow->stagingValues[shadow->stagingIndex]);
+    
+    shadow->copyCount = 0;
+    shadow->copyBytes = 0;
+    
+    u32 done = 0;
+    for (; done < shadow->rangeCount; done++)
+    {
+        ShadowRange *range = &shadow->ranges[done];
+        
+        VkDeviceSize room = shadow->stagingCapacity - shadow->copyBytes;
+        if (room == 0)
+        {
+            break;
+        }
+        
+        VkDeviceSize size = range->end - range->begin;
+        if (size > room)
+        {
+            size = room;
+        }
+        
+        memcpy(staging + shadow->copyBytes, shadow->shadow + range->begin,
+               (size_t)size);
+        
+        VkBufferCopy copy =
+        {
+            shadow->copyBytes, // srcOffset
+            range->begin, // dstOffset
+            size
+        };
+        
+        shadow->copies[shadow->copyCount++] = copy;
+        shadow->copyBytes += size;
+        
+        if (range->begin + size < range->end)
+        {
+            range->begin += size;
+            break; // the rest waits for the next frame
+        }
+    }
+    
+    memmove(shadow->ranges, shadow->ranges + done,
+            (shadow->rangeCount - done) * sizeof(ShadowRange));
+    shadow->rangeCount -= done;
+}
+
+// Records the copies queued by shadow_buffer_flush
+void
+shadow_buffer_record(ShadowBuffer *shadow, VkCommandBuffer commandBuffer)
+{
+    if (shadow->copyCount)
+    {
+        vkCmdCopyBuffer(commandBuffer,
+                        shadow->stagingBuffers[shadow->stagingIndex],
+                        shadow->buffer, shadow->copyCount, shadow->copies);
+    }
+}
+
+// value is the timeline value of the submission that recorded the copies
+void
+shadow_buffer_submitted(ShadowBuffer *shadow, u64 value)
+{
+    shadow->stagingValues[shadow->stagingIndex] = value;
+}
+
+// Once the GPU is done with the buffer and every staging buffer
+void
+shadow_buffer_destroy(ShadowBuffer *shadow)
+{
+    VkDevice device = shadow->vk->device;
+    
+    vkDestroyBuffer(device, shadow->buffer, NULL);
+    vkFreeMemory(device, shadow->bufferMemory, NULL);
+    
+    for (u32 i = 0; i < SHADOW_STAGING_FRAMES; i++)
+    {
+        vkDestroyBuffer(device, shadow->stagingBuffers[i], NULL);
+        vkFreeMemory(device, shadow->stagingMemories[i], NULL);
+    }
+    
+    free(shadow->shadow);
+}
@@ -0,0 +1,257 @@
+/*
+*  Fixed-timestep simulation
+*
+*  The world state that moves over time (the camera scrolling across the
+*  world, the panels pulsing) is stepped on its own thread at SIM_TICK_RATE
+*  ticks per second, whatever the display does. Each tick is scheduled at
+*  start + tick / SIM_TICK_RATE; a thread woken late runs the ticks it
+*  missed back to back, up to SIM_MAX_CATCH_UP, and skips the rest rather
+*  than spiralling.
+*
+*  Ticks are handed to the render thread through a triple buffer without
+*  locks: the simulation fills its own snapshot, then swaps it with the
+*  shared middle one in a single InterlockedExchange that also marks it
+*  fresh, and the render thread swaps its own snapshot for the middle one
+*  whenever that is fresh. Neither side ever waits for the other, and the
+*  render thread always gets the newest tick.
+*
+*  A snapshot holds the state after its tick and after the tick before.
+*  The renderer draws one tick in the past, interpolating between the two
+*  by how far the current time is past the newer one's scheduled time, so
+*  motion stays smooth at any frame rate.
+*/
+
+#define SIM_TICK_RATE 60 // ticks per second
+#define SIM_MAX_CATCH_UP 8 // ticks run per wake-up at most
+#define SIM_SNAPSHOT_FRESH 4 // flag next to the index in middleSnapshot
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef struct
+{
+    f32 cameraX, cameraY; // top left of the view in the world
+    f32 panelPhase; // radians, each panel adds its index
+    
+} SimState;
+
+typedef struct
+{
+    SimState previous; // after tick - 1
+    SimState current; // after tick
+    u64 tick;
+    
+} SimSnapshot;
+
+typedef struct
+{
+    SimSnapshot snapshots[3];
+    volatile LONG middleSnapshot; // index, | SIM_SNAPSHOT_FRESH when new
+    u32 renderSnapshot; // render thread only
+    
+    // Simulation thread only
+    u32 simSnapshot;
+    SimState state;
+    u64 tick;
+    u32 ticksSkipped;
+    
+    f32 worldWidth;
+    f32 viewWidth;
+    
+    LONGLONG start; // QueryPerformanceCounter at tick 0
+    LONGLONG countsPerTick;
+    
+    HANDLE thread;
+    HANDLE timer;
+    volatile LONG quit;
+    
+} Simulation;
+
+/*
+*  Simulation thread
+*/
+
+void
+sim_step(Simulation *sim, SimState *state)
+{
+    f32 dt = 1.0f / (f32)SIM_TICK_RATE;
+    
+    // Scroll across the world, wrapping around at the end
+    state->cameraX += 240.0f * dt;
+    if (state->cameraX > sim->worldWidth - sim->viewWidth)
+    {
+        state->cameraX = 0;
+    }
+    
+    state->panelPhase += 0.6f * dt;
+}
+
+// Sleeps until the performance counter reaches target
+void
+sim_wait_until(Simulation *sim, LONGLONG target)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (now.QuadPart >= target)
+    {
+        return;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    
+    // Relative due times are negative, in 100 nanosecond units
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -(LONGLONG)((target - now.QuadPart) * 10000000 /
+                                   frequency.QuadPart);
+    
+    if (sim->timer && SetWaitableTimerEx(sim->timer, &dueTime, 0, NULL, NULL,
+                                         NULL, 0))
+    {
+        WaitForSingleObject(sim->timer, INFINITE);
+    }
+    else
+    {
+        Sleep((DWORD)(-dueTime.QuadPart / 10000));
+    }
+}
+
+DWORD WINAPI
+sim_thread(LPVOID parameter)
+{
+    Simulation *sim = (Simulation *)parameter;
+    
+    while (!sim->quit)
+    {
+        sim_wait_until(sim, sim->start + (LONGLONG)(sim->tick + 1) *
+                       sim->countsPerTick);
+        
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        u64 due = (u64)((now.QuadPart - sim->start) / sim->countsPerTick);
+        
+        // Too far behind to catch up, the schedule moves on without us
+        if (due > sim->tick + SIM_MAX_CATCH_UP)
+        {
+            sim->ticksSkipped += (u32)(due - sim->tick - SIM_MAX_CATCH_UP);
+            sim->start += (LONGLONG)(due - sim->tick - SIM_MAX_CATCH_UP) *
+                sim->countsPerTick;
+            due = sim->tick + SIM_MAX_CATCH_UP;
+        }
+        
+        if (due <= sim->tick)
+        {
+            continue; // woken early
+        }
+        
+        SimSnapshot *snapshot = &sim->snapshots[sim->simSnapshot];
+        while (sim->tick < due)
+        {
+            snapshot->previous = sim->state;
+            sim_step(sim, &sim->state);
+            sim->tick++;
+        }
+        snapshot->current = sim->state;
+        snapshot->tick = sim->tick;
+        
+        // Publish it and take back whichever one was in the middle
+        LONG old = InterlockedExchange(&sim->middleSnapshot,
+                                       (LONG)sim->simSnapshot |
+                                       SIM_SNAPSHOT_FRESH);
+        sim->simSnapshot = (u32)(old & ~SIM_SNAPSHOT_FRESH);
+    }
+    
+    return 0;
+}
+
+/*
+*  Render thread
+*/
+
+void
+sim_start(Simulation *sim, f32 worldWidth, f32 viewWidth)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->worldWidth = worldWidth;
+    sim->viewWidth = viewWidth;
+    
+    for (u32 i = 0; i < array_count(sim->snapshots); i++)
+    {
+        sim->snapshots[i].previous = sim->state;
+        sim->snapshots[i].current = sim->state;
+    }
+    sim->renderSnapshot = 0;
+    sim->middleSnapshot = 1;
+    sim->simSnapshot = 2;
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    sim->countsPerTick = frequency.QuadPart / SIM_TICK_RATE;
+    
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    sim->start = now.QuadPart;
+    
+    // Sleep's default granularity is most of a tick, ask for better
+    sim->timer = CreateWaitableTimerEx(NULL, NULL,
+                                       CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                       TIMER_ALL_ACCESS);
+    if (!sim->timer)
+    {
+        sim->timer = CreateWaitableTimerEx(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+    
+    sim->thread = CreateThread(NULL, 0, sim_thread, sim, 0, NULL);
+    assert(sim->thread);
+}
+
+/* The state to draw at time now (QueryPerformanceCounter), one tick behind
+   the newest tick, interpolated between the newest two. */
+SimState
+sim_interpolate(Simulation *sim, LONGLONG now)
+{
+    if (sim->middleSnapshot & SIM_SNAPSHOT_FRESH)
+    {
+        LONG old = InterlockedExchange(&sim->middleSnapshot,
+                                       (LONG)sim->renderSnapshot);
+        sim->renderSnapshot = (u32)(old & ~SIM_SNAPSHOT_FRESH);
+    }
+    
+    SimSnapshot *snapshot = &sim->snapshots[sim->renderSnapshot];
+    SimState *a = &snapshot->previous;
+    SimState *b = &snapshot->current;
+    
+    /* start only moves when the simulation thread skips ticks, reading it
+       torn would at worst misplace one frame */
+    LONGLONG tickTime = sim->start + (LONGLONG)snapshot->tick *
+        sim->countsPerTick;
+    f32 t = (f32)(now - tickTime) / (f32)sim->countsPerTick;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    
+    SimState result;
+    result.cameraX = a->cameraX + (b->cameraX - a->cameraX) * t;
+    result.cameraY = a->cameraY + (b->cameraY - a->cameraY) * t;
+    result.panelPhase = a->panelPhase + (b->panelPhase - a->panelPhase) * t;
+    
+    // Don't sweep back across the world when the camera wraps around
+    if (b->cameraX < a->cameraX)
+    {
+        result.cameraX = b->cameraX;
+    }
+    
+    return result;
+}
+
+void
+sim_stop(Simulation *sim)
+{
+    InterlockedExchange(&sim->quit, 1);
+    WaitForSingleObject(sim->thread, INFINITE);
+    CloseHandle(sim->thread);
+    
+    if (sim->timer)
+    {
+        CloseHandle(sim->timer);
+    }
+}
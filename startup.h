@@ -0,0 +1,248 @@
+/*
+*  Startup task graph and timing
+*
+*  Most of startup is a chain where every Vulkan object needs the one
+*  before it, and that chain stays on the main thread. The work that
+*  doesn't need Vulkan at all (reading files, generating and filtering
+*  texels, laying out the scene) is split into tasks that start on the job
+*  queue before the window and the device exist. A task runs as soon as
+*  the tasks it depends on are done, and the main thread waits for a task
+*  only right before it needs the result, running queued jobs meanwhile.
+*
+*  The main thread's own work is timed in named stages. Once the first
+*  frame is presented, the stages and the tasks are printed with their
+*  start times, durations and threads, along with the time to first frame.
+*/
+
+#define STARTUP_MAX_TASKS 32 // one bit each in doneMask
+#define STARTUP_MAX_STAGES 32
+
+typedef struct Startup Startup;
+
+typedef struct
+{
+    char *name;
+    JobCallback *callback;
+    void *data;
+    u32 dependencies; // bits of the tasks that must be done first
+    
+    Startup *startup;
+    volatile LONG launched;
+    volatile LONG done;
+    
+    LONGLONG begin, end; // QueryPerformanceCounter
+    DWORD threadId;
+    
+} StartupTask;
+
+typedef struct
+{
+    char *name;
+    LONGLONG begin, end;
+    LONGLONG waited; // of it, spent waiting on tasks
+    
+} StartupStage;
+
+struct Startup
+{
+    JobQueue *queue;
+    
+    StartupTask tasks[STARTUP_MAX_TASKS];
+    volatile LONG taskCount;
+    volatile LONG doneMask;
+    
+    StartupStage stages[STARTUP_MAX_STAGES];
+    u32 stageCount;
+    
+    LONGLONG start;
+    LONGLONG frequency;
+    DWORD mainThreadId;
+    
+};
+
+LONGLONG
+startup_now(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void
+startup_begin(Startup *startup, JobQueue *queue)
+{
+    memset(startup, 0, sizeof(*startup));
+    startup->queue = queue;
+    startup->mainThreadId = GetCurrentThreadId();
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    startup->frequency = frequency.QuadPart;
+    startup->start = startup_now();
+}
+
+void startup_launch_ready(Startup *startup);
+
+void
+startup_task_job(void *data)
+{
+    StartupTask *task = (StartupTask *)data;
+    Startup *startup = task->startup;
+    
+    task->threadId = GetCurrentThreadId();
+    task->begin = startup_now();
+    task->callback(task->data);
+    task->end = startup_now();
+    
+    u32 index = (u32)(task - startup->tasks);
+    InterlockedExchange(&task->done, 1);
+    InterlockedOr(&startup->doneMask, (LONG)(1u << index));
+    
+    // Whatever was only waiting on this one can go now
+    startup_launch_ready(startup);
+}
+
+// Pushes every task whose dependencies are done, each exactly once
+void
+startup_launch_ready(Startup *startup)
+{
+    LONG taskCount = startup->taskCount;
+    
+    // Don't look at a task before the count that published it
+    MemoryBarrier();
+    
+    for (LONG i = 0; i < taskCount; i++)
+    {
+        StartupTask *task = &startup->tasks[i];
+        LONG doneMask = startup->doneMask;
+        
+        if (!task->launched &&
+            (task->dependencies & (u32)doneMask) == task->dependencies &&
+            InterlockedCompareExchange(&task->launched, 1, 0) == 0)
+        {
+            jobs_push(startup->queue, startup_task_job, task, NULL);
+        }
+    }
+}
+
+/* Main thread only. Returns the task's index for the dependencies of later
+   tasks and for startup_wait. */
+u32
+startup_task(Startup *startup, char *name, JobCallback *callback,
+             void *data, u32 dependencies)
+{
+    assert(startup->taskCount < STARTUP_MAX_TASKS);
+    
+    u32 index = (u32)startup->taskCount;
+    StartupTask *task = &startup->tasks[index];
+    task->name = name;
+    task->callback = callback;
+    task->data = data;
+    task->dependencies = dependencies;
+    task->startup = startup;
+    
+    // Make the task visible before publishing the new count
+    MemoryBarrier();
+    startup->taskCount = index + 1;
+    
+    startup_launch_ready(startup);
+    
+    return index;
+}
+
+// Runs queued jobs until the task is done, the time goes to the stage
+void
+startup_wait(Startup *startup, u32 index)
+{
+    StartupTask *task = &startup->tasks[index];
+    if (task->done)
+    {
+        return;
+    }
+    
+    LONGLONG begin = startup_now();
+    while (!task->done)
+    {
+        if (!jobs_run_next(startup->queue))
+        {
+            YieldProcessor();
+        }
+    }
+    
+    if (startup->stageCount)
+    {
+        StartupStage *stage = &startup->stages[startup->stageCount - 1];
+        stage->waited += startup_now() - begin;
+    }
+}
+
+/* Ends the current stage of the main thread and starts the next one, or
+   only ends it when name is NULL */
+void
+startup_stage(Startup *startup, char *name)
+{
+    LONGLONG now = startup_now();
+    
+    if (startup->stageCount &&
+        !startup->stages[startup->stageCount - 1].end)
+    {
+        startup->stages[startup->stageCount - 1].end = now;
+    }
+    
+    if (name)
+    {
+        assert(startup->stageCount < STARTUP_MAX_STAGES);
+        StartupStage *stage = &startup->stages[startup->stageCount++];
+        stage->name = name;
+        stage->begin = now;
+        stage->end = 0;
+        stage->waited = 0;
+    }
+}
+
+f32
+startup_milliseconds(Startup *startup, LONGLONG counts)
+{
+    return 1000.0f * (f32)counts / (f32)startup->frequency;
+}
+
+// Call once the first frame is presented, every task must be done
+void
+startup_report(Startup *startup)
+{
+    startup_stage(startup, NULL);
+    LONGLONG end = startup_now();
+    
+    char line[256];
+    sprintf_s(line, sizeof(line),
+              "Startup: first frame after %.2f ms\n",
+              startup_milliseconds(startup, end - startup->start));
+    OutputDebugString(line);
+    
+    for (u32 i = 0; i < startup->stageCount; i++)
+    {
+        StartupStage *stage = &startup->stages[i];
+        sprintf_s(line, sizeof(line),
+                  "  %-32s at %8.2f ms, %8.2f ms (%.2f ms waiting)\n",
+                  stage->name,
+                  startup_milliseconds(startup, stage->begin - startup->start),
+                  startup_milliseconds(startup, stage->end - stage->begin),
+                  startup_milliseconds(startup, stage->waited));
+        OutputDebugString(line);
+    }
+    
+    for (LONG i = 0; i < startup->taskCount; i++)
+    {
+        StartupTask *task = &startup->tasks[i];
+        assert(task->done);
+        
+        sprintf_s(line, sizeof(line),
+                  "  task %-27s at %8.2f ms, %8.2f ms on thread %lu%s\n",
+                  task->name,
+                  startup_milliseconds(startup, task->begin - startup->start),
+                  startup_milliseconds(startup, task->end - task->begin),
+                  task->threadId,
+                  task->threadId == startup->mainThreadId ? " (main)" : "");
+        OutputDebugString(line);
+    }
+}
@@ -0,0 +1,825 @@
+/*
+*  SDF text
+*
+*  Glyphs are rasterized with GDI the first time they are drawn, turned
+*  into signed distance fields and packed into fixed-size cells of one R8
+*  atlas. Cells are recycled least recently used first, but never one that
+*  the frame being built already uses. Strings are shaped once (advances
+*  and kerning) and the shaped runs are cached by their text.
+*
+*  Labels become glyph quads grouped by color and written into the sprite
+*  batch vertex stream, so all of a frame's text is one draw per color.
+*  The distance field keeps the edges sharp at any size.
+*/
+
+#define TEXT_RASTER_SIZE 32 // em height the glyphs are rasterized at, in px
+#define TEXT_SDF_SPREAD 6 // px on each side of an edge the field covers
+#define TEXT_CELL_SIZE 48 // glyph box plus the spread on both sides
+
+#define TEXT_ATLAS_SIZE 1024
+#define TEXT_ATLAS_CELLS_PER_ROW (TEXT_ATLAS_SIZE / TEXT_CELL_SIZE)
+#define TEXT_ATLAS_CELLS (TEXT_ATLAS_CELLS_PER_ROW * TEXT_ATLAS_CELLS_PER_ROW)
+
+#define TEXT_MAX_CODEPOINT 0x10000 // the Basic Multilingual Plane
+#define TEXT_NO_CELL 0xFFFF
+#define TEXT_NO_CODEPOINT 0xFFFFFFFF
+
+#define TEXT_RUN_CACHE_SIZE 1024 // must be a power of two
+#define TEXT_RUN_PROBES 8
+#define TEXT_MAX_RUN_LENGTH 128 // longer strings are cut off
+
+#define TEXT_MAX_GLYPHS 16384 // quads per frame
+#define TEXT_MAX_BATCHES 8 // distinct colors per frame
+
+typedef struct
+{
+    u32 codepoint; // TEXT_NO_CODEPOINT while the cell is free
+    u32 lastUsedFrame;
+    u16 prev, next; // LRU list, most recently used first
+    bool dirty; // in dirtyCells, waiting for text_record_uploads
+    
+    // Box of the distance field relative to the pen on the baseline,
+    // y down, in raster pixels
+    f32 offsetX, offsetY;
+    f32 width, height;
+    f32 advance;
+    
+} TextGlyph;
+
+typedef struct
+{
+    f32 x; // pen position from the start of the run, in raster pixels
+    u32 codepoint;
+    
+} TextRunGlyph;
+
+typedef struct
+{
+    u64 hash; // 0 for a free entry or one that must be shaped again
+    u32 length; // bytes of text
+    u32 glyphCount;
+    u32 lastUsedFrame;
+    f32 width;
+    char text[TEXT_MAX_RUN_LENGTH];
+    TextRunGlyph glyphs[TEXT_MAX_RUN_LENGTH];
+    
+} TextRun;
+
+typedef struct
+{
+    f32 x0, y0, x1, y1;
+    f32 u0, v0, u1, v1;
+    
+} TextQuad;
+
+typedef struct
+{
+    f32 color[4];
+    u32 quadCount;
+    u32 firstVertex; // set by text_end_frame
+    u32 vertexCount;
+    
+} TextBatch;
+
+typedef struct
+{
+    HDC dc;
+    HFONT font;
+    u8 *coverage; // GGO_GRAY8_BITMAP scratch
+    u32 coverageSize;
+    KERNINGPAIR *kerningPairs; // sorted by text_kerning_key
+    u32 kerningPairCount;
+    
+    VkImage atlasImage;
+    VkDeviceMemory atlasMemory;
+    VkImageView atlasView;
+    VkSampler sampler;
+    
+    // Mirrors the atlas texel for texel, dirty cells are copied from it
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingMemory;
+    u8 *staging;
+    
+    u16 cellOfCodepoint[TEXT_MAX_CODEPOINT];
+    TextGlyph cells[TEXT_ATLAS_CELLS];
+    u16 lruHead, lruTail;
+    u16 dirtyCells[TEXT_ATLAS_CELLS];
+    u32 dirtyCount;
+    
+    TextRun *runs;
+    
+    u32 frameIndex;
+    TextQuad *quads;
+    u8 *quadBatches;
+    u32 quadCount;
+    TextBatch batches[TEXT_MAX_BATCHES];
+    u32 batchCount;
+    
+    // This frame, for the stats output
+    u32 glyphsRasterized;
+    u32 runsShaped;
+    u32 labelsDropped;
+    
+} TextRenderer;
+
+/*
+*  Kerning
+*/
+
+u32
+text_kerning_key(u32 first, u32 second)
+{
+    return (first << 16) | second;
+}
+
+int
+text_compare_kerning_pairs(const void *a, const void *b)
+{
+    KERNINGPAIR *x = (KERNINGPAIR *)a;
+    KERNINGPAIR *y = (KERNINGPAIR *)b;
+    u32 keyX = text_kerning_key(x->wFirst, x->wSecond);
+    u32 keyY = text_kerning_key(y->wFirst, y->wSecond);
+    return (keyX > keyY) - (keyX < keyY);
+}
+
+f32
+text_kerning(TextRenderer *text, u32 first, u32 second)
+{
+    u32 key = text_kerning_key(first, second);
+    
+    u32 low = 0;
+    u32 high = text->kerningPairCount;
+    while (low < high)
+    {
+        u32 middle = (low + high) / 2;
+        KERNINGPAIR *pair = &text->kerningPairs[middle];
+        u32 middleKey = text_kerning_key(pair->wFirst, pair->wSecond);
+        
+        if (middleKey == key)
+        {
+            return (f32)pair->iKernAmount;
+        }
+        else if (middleKey < key)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+*  Setup
+*/
+
+/* The atlas starts out in UNDEFINED layout, the caller copies the zeroed
+   staging buffer over all of it once before the first frame. */
+void
+text_init(TextRenderer *text, VulkanContext *vk, char *fontName)
+{
+    text->dc = CreateCompatibleDC(NULL);
+    assert(text->dc);
+    
+    // A negative height asks for the em height rather than the cell height
+    text->font = CreateFontA(-TEXT_RASTER_SIZE, 0, 0, 0, FW_NORMAL,
+                             FALSE, FALSE, FALSE, DEFAULT_CHARSET,
+                             OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS,
+                             ANTIALIASED_QUALITY, DEFAULT_PITCH | FF_DONTCARE,
+                             fontName);
+    assert(text->font);
+    SelectObject(text->dc, text->font);
+    
+    text->kerningPairCount = GetKerningPairsW(text->dc, 0, NULL);
+    if (text->kerningPairCount)
+    {
+        text->kerningPairs = (KERNINGPAIR *)malloc(
+            text->kerningPairCount * sizeof(KERNINGPAIR));
+        assert(text->kerningPairs);
+        
+        GetKerningPairsW(text->dc, text->kerningPairCount, text->kerningPairs);
+        qsort(text->kerningPairs, text->kerningPairCount,
+              sizeof(KERNINGPAIR), text_compare_kerning_pairs);
+    }
+    
+    // Every cell free and in the LRU list, in atlas order
+    memset(text->cellOfCodepoint, 0xFF, sizeof(text->cellOfCodepoint));
+    for (u32 i = 0; i < TEXT_ATLAS_CELLS; i++)
+    {
+        TextGlyph *cell = &text->cells[i];
+        cell->codepoint = TEXT_NO_CODEPOINT;
+        cell->prev = (u16)(i > 0 ? i - 1 : TEXT_NO_CELL);
+        cell->next = (u16)(i + 1 < TEXT_ATLAS_CELLS ? i + 1 : TEXT_NO_CELL);
+    }
+    text->lruHead = 0;
+    text->lruTail = TEXT_ATLAS_CELLS - 1;
+    
+    text->runs = (TextRun *)calloc(TEXT_RUN_CACHE_SIZE, sizeof(TextRun));
+    text->quads = (TextQuad *)malloc(TEXT_MAX_GLYPHS * sizeof(TextQuad));
+    text->quadBatches = (u8 *)malloc(TEXT_MAX_GLYPHS);
+    assert(text->runs && text->quads && text->quadBatches);
+    
+    /*
+    *  Atlas Image, its View and Sampler
+    */
+    
+    VkExtent2D atlasExtent = { TEXT_ATLAS_SIZE, TEXT_ATLAS_SIZE };
+    vk_create_image(vk, atlasExtent, VK_FORMAT_R8_UNORM,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                    &text->atlasImage, &text->atlasMemory);
+    
+    text->atlasView = vk_create_image_view(vk, text->atlasImage,
+                                           VK_FORMAT_R8_UNORM,
+                                           VK_IMAGE_ASPECT_COLOR_BIT);
+    
+    // Filtered, the shader finds the edge between texels
+    VkSamplerCreateInfo samplerInfo =
+    {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        NULL,
+        0,
+        VK_FILTER_LINEAR,
+        VK_FILTER_LINEAR,
+        VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        0.0f, // mipLodBias
+        VK_FALSE, // anisotropyEnable
+        1.0f, // maxAnisotropy
+        VK_FALSE, // compareEnabled
+        VK_COMPARE_OP_ALWAYS,
+        0.0f, // minLod
+        0.0f, // maxLod
+        VK_BORDER_COLOR_INT_OPAQUE_BLACK,
+        VK_FALSE // unnormalizedCoordinates
+    };
+    
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL,
+                        &text->sampler) != VK_SUCCESS)
+    {
+        assert(!"Failed to create text sampler");
+    }
+    
+    /*
+    *  Staging Buffer (persistently mapped)
+    */
+    
+    VkDeviceSize stagingSize = TEXT_ATLAS_SIZE * TEXT_ATLAS_SIZE;
+    vk_create_buffer(vk, stagingSize,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &text->stagingBuffer, &text->stagingMemory);
+    
+    vkMapMemory(vk->device, text->stagingMemory, 0, stagingSize, 0,
+                (void **)&text->staging);
+    assert(text->staging);
+    memset(text->staging, 0, (size_t)stagingSize);
+}
+
+/*
+*  Glyph atlas
+*/
+
+void
+text_lru_unlink(TextRenderer *text, u16 index)
+{
+    TextGlyph *cell = &text->cells[index];
+    
+    if (cell->prev != TEXT_NO_CELL)
+    {
+        text->cells[cell->prev].next = cell->next;
+    }
+    else
+    {
+        text->lruHead = cell->next;
+    }
+    
+    if (cell->next != TEXT_NO_CELL)
+    {
+        text->cells[cell->next].prev = cell->prev;
+    }
+    else
+    {
+        text->lruTail = cell->prev;
+    }
+}
+
+void
+text_lru_touch(TextRenderer *text, u16 index)
+{
+    TextGlyph *cell = &text->cells[index];
+    cell->lastUsedFrame = text->frameIndex;
+    
+    if (text->lruHead == index)
+    {
+        return;
+    }
+    
+    text_lru_unlink(text, index);
+    
+    cell->prev = TEXT_NO_CELL;
+    cell->next = text->lruHead;
+    text->cells[text->lruHead].prev = index;
+    text->lruHead = index;
+}
+
+/* Rasterizes codepoint with GDI and writes its distance field into cell's
+   part of the staging buffer. Each texel stores 0.5 on the outline, more
+   inside, less outside, reaching 0 or 1 at TEXT_SDF_SPREAD pixels. */
+void
+text_rasterize(TextRenderer *text, u16 index, u32 codepoint)
+{
+    TextGlyph *cell = &text->cells[index];
+    
+    // FIXED is { fract, value }, so this is the identity matrix
+    MAT2 identity = { { 0, 1 }, { 0, 0 }, { 0, 0 }, { 0, 1 } };
+    GLYPHMETRICS metrics = {0};
+    
+    DWORD size = GetGlyphOutlineW(text->dc, codepoint, GGO_GRAY8_BITMAP,
+                                  &metrics, 0, NULL, &identity);
+    if (size == GDI_ERROR)
+    {
+        size = 0;
+        metrics.gmCellIncX = 0;
+    }
+    
+    if (size > text->coverageSize)
+    {
+        text->coverage = (u8 *)realloc(text->coverage, size);
+        assert(text->coverage);
+        text->coverageSize = size;
+    }
+    
+    if (size)
+    {
+        GetGlyphOutlineW(text->dc, codepoint, GGO_GRAY8_BITMAP, &metrics,
+                         size, text->coverage, &identity);
+    }
+    
+    // Rows are DWORD aligned, coverage goes from 0 to 64
+    u32 pitch = (metrics.gmBlackBoxX + 3) & ~3u;
+    
+    // Oversized glyphs are clipped to the cell
+    u32 maxBox = TEXT_CELL_SIZE - 2 * TEXT_SDF_SPREAD;
+    u32 boxWidth = size ? metrics.gmBlackBoxX : 0;
+    u32 boxHeight = size ? metrics.gmBlackBoxY : 0;
+    if (boxWidth > maxBox)
+    {
+        boxWidth = maxBox;
+    }
+    if (boxHeight > maxBox)
+    {
+        boxHeight = maxBox;
+    }
+    
+    u32 cellX = (index % TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE;
+    u32 cellY = (index / TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE;
+    
+    s32 spread = TEXT_SDF_SPREAD;
+    for (s32 y = 0; y < TEXT_CELL_SIZE; y++)
+    {
+        u8 *row = text->staging + (cellY + y) * TEXT_ATLAS_SIZE + cellX;
+        
+        for (s32 x = 0; x < TEXT_CELL_SIZE; x++)
+        {
+            // Position in the coverage bitmap
+            s32 gx = x - spread;
+            s32 gy = y - spread;
+            
+            bool inside = gx >= 0 && gx < (s32)boxWidth &&
+                gy >= 0 && gy < (s32)boxHeight &&
+                text->coverage[gy * pitch + gx] >= 32;
+            
+            // Nearest texel on the other side of the outline
+            s32 nearest = (spread + 1) * (spread + 1);
+            for (s32 dy = -spread; dy <= spread; dy++)
+            {
+                for (s32 dx = -spread; dx <= spread; dx++)
+                {
+                    s32 sx = gx + dx;
+                    s32 sy = gy + dy;
+                    bool sampleInside = sx >= 0 && sx < (s32)boxWidth &&
+                        sy >= 0 && sy < (s32)boxHeight &&
+                        text->coverage[sy * pitch + sx] >= 32;
+                    
+                    s32 distanceSquared = dx * dx + dy * dy;
+                    if (sampleInside != inside && distanceSquared < nearest)
+                    {
+                        nearest = distanceSquared;
+                    }
+                }
+            }
+            
+            // The outline lies half way between the two texels
+            f32 distance = sqrtf((f32)nearest) - 0.5f;
+            if (!inside)
+            {
+                distance = -distance;
+            }
+            
+            f32 value = 0.5f + 0.5f * distance / (f32)spread;
+            value = value < 0 ? 0 : (value > 1 ? 1 : value);
+            row[x] = (u8)(value * 255.0f + 0.5f);
+        }
+    }
+    
+    cell->codepoint = codepoint;
+    cell->offsetX = (f32)(metrics.gmptGlyphOrigin.x - spread);
+    cell->offsetY = (f32)(-metrics.gmptGlyphOrigin.y - spread);
+    cell->width = boxWidth ? (f32)(boxWidth + 2 * spread) : 0;
+    cell->height = boxHeight ? (f32)(boxHeight + 2 * spread) : 0;
+    cell->advance = (f32)metrics.gmCellIncX;
+    
+    if (!cell->dirty)
+    {
+        cell->dirty = true;
+        text->dirtyCells[text->dirtyCount++] = index;
+    }
+    text->glyphsRasterized++;
+}
+
+/* Returns codepoint's cell, rasterizing it into the least recently used one
+   on a miss. NULL when every cell is already in use this frame. */
+TextGlyph *
+text_glyph(TextRenderer *text, u32 codepoint)
+{
+    if (codepoint >= TEXT_MAX_CODEPOINT)
+    {
+        codepoint = '?';
+    }
+    
+    u16 index = text->cellOfCodepoint[codepoint];
+    if (index == TEXT_NO_CELL)
+    {
+        index = text->lruTail;
+        
+        TextGlyph *victim = &text->cells[index];
+        if (victim->lastUsedFrame == text->frameIndex)
+        {
+            return NULL;
+        }
+        
+        if (victim->codepoint != TEXT_NO_CODEPOINT)
+        {
+            text->cellOfCodepoint[victim->codepoint] = TEXT_NO_CELL;
+        }
+        
+        text_rasterize(text, index, codepoint);
+        text->cellOfCodepoint[codepoint] = index;
+    }
+    
+    text_lru_touch(text, index);
+    
+    return &text->cells[index];
+}
+
+/*
+*  Shaped run cache
+*/
+
+// Decodes one UTF-8 sequence, malformed ones come out as '?'
+u32
+text_next_codepoint(char **at, char *end)
+{
+    u8 *bytes = (u8 *)*at;
+    u32 codepoint = bytes[0];
+    u32 length = 1;
+    
+    if (codepoint >= 0xF0)
+    {
+        codepoint &= 0x07;
+        length = 4;
+    }
+    else if (codepoint >= 0xE0)
+    {
+        codepoint &= 0x0F;
+        length = 3;
+    }
+    else if (codepoint >= 0xC0)
+    {
+        codepoint &= 0x1F;
+        length = 2;
+    }
+    else if (codepoint >= 0x80)
+    {
+        codepoint = '?';
+    }
+    
+    if (*at + length > end)
+    {
+        *at = end;
+        return '?';
+    }
+    
+    for (u32 i = 1; i < length; i++)
+    {
+        if ((bytes[i] & 0xC0) != 0x80)
+        {
+            *at += i;
+            return '?';
+        }
+        codepoint = (codepoint << 6) | (bytes[i] & 0x3F);
+    }
+    
+    *at += length;
+    return codepoint;
+}
+
+/* Lays out the glyphs with their advances and kerning. Returns false when
+   the atlas ran out of cells, the layout then misses some advances. */
+bool
+text_shape(TextRenderer *text, char *string, u32 length, TextRun *run)
+{
+    bool complete = true;
+    
+    f32 x = 0;
+    u32 previous = 0;
+    u32 glyphCount = 0;
+    
+    char *at = string;
+    char *end = string + length;
+    while (at < end && glyphCount < TEXT_MAX_RUN_LENGTH)
+    {
+        u32 codepoint = text_next_codepoint(&at, end);
+        
+        x += text_kerning(text, previous, codepoint);
+        
+        TextRunGlyph *runGlyph = &run->glyphs[glyphCount++];
+        runGlyph->x = x;
+        runGlyph->codepoint = codepoint;
+        
+        TextGlyph *glyph = text_glyph(text, codepoint);
+        if (glyph)
+        {
+            x += glyph->advance;
+        }
+        else
+        {
+            complete = false;
+        }
+        
+        previous = codepoint;
+    }
+    
+    run->glyphCount = glyphCount;
+    run->width = x;
+    text->runsShaped++;
+    
+    return complete;
+}
+
+// FNV-1a over the text, never 0 since 0 marks a free entry
+u64
+text_hash(char *string, u32 length)
+{
+    u64 hash = 14695981039346656037ull;
+    
+    for (u32 i = 0; i < length; i++)
+    {
+        hash ^= (u8)string[i];
+        hash *= 1099511628211ull;
+    }
+    
+    return hash ? hash : 1;
+}
+
+/* Looks string up in a small window of the open-addressed cache, shaping
+   it into the least recently used entry of that window on a miss. */
+TextRun *
+text_run(TextRenderer *text, char *string)
+{
+    u32 length = (u32)strlen(string);
+    if (length > TEXT_MAX_RUN_LENGTH)
+    {
+        length = TEXT_MAX_RUN_LENGTH;
+    }
+    
+    u64 hash = text_hash(string, length);
+    
+    TextRun *victim = NULL;
+    for (u32 probe = 0; probe < TEXT_RUN_PROBES; probe++)
+    {
+        u32 slot = (u32)(hash + probe) & (TEXT_RUN_CACHE_SIZE - 1);
+        TextRun *run = &text->runs[slot];
+        
+        if (run->hash == hash && run->length == length &&
+            memcmp(run->text, string, length) == 0)
+        {
+            run->lastUsedFrame = text->frameIndex;
+            return run;
+        }
+        
+        if (!victim || run->lastUsedFrame < victim->lastUsedFrame)
+        {
+            victim = run;
+        }
+    }
+    
+    // Runs are only read while their label is emitted, so any can go
+    bool complete = text_shape(text, string, length, victim);
+    
+    victim->hash = complete ? hash : 0;
+    victim->length = length;
+    victim->lastUsedFrame = text->frameIndex;
+    memcpy(victim->text, string, length);
+    
+    return victim;
+}
+
+/*
+*  Per-frame labels
+*/
+
+void
+text_new_frame(TextRenderer *text, u32 frameIndex)
+{
+    // Frame 0 would look like every free cell was in use
+    text->frameIndex = frameIndex + 1;
+    text->quadCount = 0;
+    text->batchCount = 0;
+    text->glyphsRasterized = 0;
+    text->runsShaped = 0;
+    text->labelsDropped = 0;
+}
+
+/* Adds string with its baseline starting at (x, y), size pixels per em.
+   Labels of the same color share a batch, and so a draw. */
+void
+text_label(TextRenderer *text, f32 x, f32 y, f32 size,
+           f32 r, f32 g, f32 b, f32 a, char *string)
+{
+    u32 batchIndex = 0;
+    for (; batchIndex < text->batchCount; batchIndex++)
+    {
+        f32 *color = text->batches[batchIndex].color;
+        if (color[0] == r && color[1] == g && color[2] == b && color[3] == a)
+        {
+            break;
+        }
+    }
+    
+    if (batchIndex == text->batchCount)
+    {
+        if (text->batchCount == TEXT_MAX_BATCHES)
+        {
+            text->labelsDropped++;
+            return;
+        }
+        
+        TextBatch newBatch = { { r, g, b, a }, 0, 0, 0 };
+        text->batches[text->batchCount++] = newBatch;
+    }
+    
+    TextRun *run = text_run(text, string);
+    f32 scale = size / (f32)TEXT_RASTER_SIZE;
+    f32 texel = 1.0f / (f32)TEXT_ATLAS_SIZE;
+    
+    for (u32 i = 0; i < run->glyphCount; i++)
+    {
+        TextGlyph *glyph = text_glyph(text, run->glyphs[i].codepoint);
+        if (!glyph || glyph->width == 0)
+        {
+            continue; // whitespace, or the atlas is full
+        }
+        
+        if (text->quadCount == TEXT_MAX_GLYPHS)
+        {
+            text->labelsDropped++;
+            return;
+        }
+        
+        u32 index = (u32)(glyph - text->cells);
+        f32 cellX = (f32)((index % TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE);
+        f32 cellY = (f32)((index / TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE);
+        
+        TextQuad *quad = &text->quads[text->quadCount];
+        quad->x0 = x + (run->glyphs[i].x + glyph->offsetX) * scale;
+        quad->y0 = y + glyph->offsetY * scale;
+        quad->x1 = quad->x0 + glyph->width * scale;
+        quad->y1 = quad->y0 + glyph->height * scale;
+        quad->u0 = cellX * texel;
+        quad->v0 = cellY * texel;
+        quad->u1 = (cellX + glyph->width) * texel;
+        quad->v1 = (cellY + glyph->height) * texel;
+        
+        text->quadBatches[text->quadCount++] = (u8)batchIndex;
+        text->batches[batchIndex].quadCount++;
+    }
+}
+
+// Width of string in pixels at size, for aligning labels
+f32
+text_width(TextRenderer *text, f32 size, char *string)
+{
+    return text_run(text, string)->width * size / (f32)TEXT_RASTER_SIZE;
+}
+
+/* Writes the frame's quads to out grouped by batch, out being vertex
+   firstVertex of the stream. Fills in each batch's vertex range and
+   returns the number of vertices written. */
+u32
+text_end_frame(TextRenderer *text, Vertex *out, u32 firstVertex)
+{
+    u32 batchStart[TEXT_MAX_BATCHES];
+    u32 vertexCount = 0;
+    
+    for (u32 i = 0; i < text->batchCount; i++)
+    {
+        TextBatch *batch = &text->batches[i];
+        batch->firstVertex = firstVertex + vertexCount;
+        batch->vertexCount = batch->quadCount * VERTICES_PER_SPRITE;
+        
+        batchStart[i] = vertexCount;
+        vertexCount += batch->vertexCount;
+    }
+    
+    for (u32 i = 0; i < text->quadCount; i++)
+    {
+        TextQuad *quad = &text->quads[i];
+        u32 batchIndex = text->quadBatches[i];
+        
+        Vertex v0 = { quad->x0, quad->y0, quad->u0, quad->v0 };
+        Vertex v1 = { quad->x1, quad->y0, quad->u1, quad->v0 };
+        Vertex v2 = { quad->x1, quad->y1, quad->u1, quad->v1 };
+        Vertex v3 = { quad->x0, quad->y1, quad->u0, quad->v1 };
+        
+        // Same triangles and winding as emit_sprite_lanes
+        Vertex *v = out + batchStart[batchIndex];
+        v[0] = v0;
+        v[1] = v1;
+        v[2] = v2;
+        v[3] = v0;
+        v[4] = v2;
+        v[5] = v3;
+        batchStart[batchIndex] += VERTICES_PER_SPRITE;
+    }
+    
+    return vertexCount;
+}
+
+/* Copies the cells rasterized since the last call from the staging buffer.
+   The atlas must be in TRANSFER_DST_OPTIMAL layout. */
+void
+text_record_uploads(TextRenderer *text, VkCommandBuffer commandBuffer)
+{
+    if (text->dirtyCount == 0)
+    {
+        return;
+    }
+    
+    VkBufferImageCopy regions[TEXT_ATLAS_CELLS];
+    for (u32 i = 0; i < text->dirtyCount; i++)
+    {
+        u32 index = text->dirtyCells[i];
+        text->cells[index].dirty = false;
+        
+        u32 cellX = (index % TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE;
+        u32 cellY = (index / TEXT_ATLAS_CELLS_PER_ROW) * TEXT_CELL_SIZE;
+        
+        VkBufferImageCopy region =
+        {
+            cellY * TEXT_ATLAS_SIZE + cellX, // bufferOffset
+            TEXT_ATLAS_SIZE, // bufferRowLength
+            TEXT_ATLAS_SIZE, // bufferImageHeight
+            { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            { (s32)cellX, (s32)cellY, 0 },
+            { TEXT_CELL_SIZE, TEXT_CELL_SIZE, 1 }
+        };
+        
+        regions[i] = region;
+    }
+    
+    vkCmdCopyBufferToImage(commandBuffer, text->stagingBuffer,
+                           text->atlasImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           text->dirtyCount, regions);
+    
+    text->dirtyCount = 0;
+}
+
+// Once the GPU is done with the atlas and its staging buffer
+void
+text_destroy(TextRenderer *text, VulkanContext *vk)
+{
+    vkDestroySampler(vk->device, text->sampler, NULL);
+    vkDestroyImageView(vk->device, text->atlasView, NULL);
+    vkDestroyImage(vk->device, text->atlasImage, NULL);
+    vkFreeMemory(vk->device, text->atlasMemory, NULL);
+    vkDestroyBuffer(vk->device, text->stagingBuffer, NULL);
+    vkFreeMemory(vk->device, text->stagingMemory, NULL);
+    
+    DeleteObject(text->font);
+    DeleteDC(text->dc);
+    
+    free(text->coverage);
+    free(text->kerningPairs);
+    free(text->runs);
+    free(text->quads);
+    free(text->quadBatches);
+}
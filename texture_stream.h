@@ -0,0 +1,870 @@
+/*
+*  Texture streaming
+*
+*  Each streamed texture keeps its full mip chain in CPU memory (standing in
+*  for the copy on disk) and only the mips it needs in device memory. What
+*  is resident is always a contiguous tail of the chain, [residentMip,
+*  mipCount), held in one image whose level 0 is residentMip, so the sampler
+*  never sees a missing level. The mips of STREAM_TAIL_SIZE and smaller are
+*  loaded at startup and never evicted, every texture is drawable from the
+*  first frame.
+*
+*  Draws request a texture with the size it covers on screen. Once a frame
+*  the streamer compares what was requested with what is resident and
+*  rebuilds some images one level finer (requested, most under-resolved
+*  first) or one level coarser (evicted). A rebuild creates the new image,
+*  copies the levels both share from the old one on the GPU and uploads
+*  only the missing level from a staging buffer, then points the texture's
+*  descriptor set at it. The old image goes to the destroy queue with the
+*  timeline value of the frame that copied from it, and is destroyed once
+*  the GPU is past that frame. A texture therefore only ever goes from one
+*  complete image to another, never through a missing level, and the work
+*  per frame is capped, so no frame waits for a large upload.
+*
+*  Device memory is kept under a budget: STREAM_BUDGET_PERCENT of what the
+*  device-local heap has left for us, from VK_EXT_memory_budget where the
+*  device has it (refreshed every STREAM_BUDGET_REFRESH frames), otherwise
+*  of the heap's size, optionally capped lower by the caller. A level finer
+*  is only streamed in if it fits. If it doesn't, the least recently used
+*  mips make room: the top level of textures not requested for the longest
+*  time, then of requested textures holding finer levels than they were
+*  asked for. The budget is soft by one frame's rebuilds, since an old
+*  image is freed a frame after its replacement is allocated.
+*/
+
+#define STREAM_MAX_TEXTURES 64
+#define STREAM_MAX_MIPS 14
+#define STREAM_TAIL_SIZE 64 // mips this size and smaller are always resident
+#define STREAM_MAX_REBUILDS 8 // images rebuilt per frame, the rest wait
+#define STREAM_STAGING_SIZE (4 * 1024 * 1024) // bytes uploaded per frame
+#define STREAM_BUDGET_PERCENT 50
+#define STREAM_BUDGET_REFRESH 60 // frames
+#define STREAM_FORMAT VK_FORMAT_R8G8B8A8_SRGB
+
+typedef struct
+{
+    u32 size; // width and height of mip 0, a power of two
+    u32 mipCount;
+    u32 tailMip; // first of the always resident mips
+    u8 *mips[STREAM_MAX_MIPS]; // RGBA8 source texels of every level
+    
+    // Levels [residentMip, mipCount) of the texture, level 0 is residentMip
+    u32 residentMip;
+    VkImage image;
+    VkImageView view;
+    VkDeviceMemory memory;
+    VkDeviceSize memorySize;
+    
+    VkDescriptorSet descriptorSet; // binding 0 follows the resident image
+    
+    u32 requestedMip; // finest asked for during lastUsedFrame
+    u32 lastUsedFrame;
+    u32 rebuiltFrame; // at most one rebuild per texture per frame
+    
+} StreamedTexture;
+
+typedef struct
+{
+    StreamedTexture *texture;
+    VkImage oldImage; // VK_NULL_HANDLE when loading the tail
+    u32 oldMip;
+    VkImage newImage;
+    u32 newMip;
+    
+    // Levels [newMip, uploadEnd) come from staging, the rest from oldImage
+    u32 uploadEnd;
+    VkDeviceSize stagingOffset;
+    
+} StreamRebuild;
+
+typedef struct
+{
+    VkImage image;
+    VkImageView view;
+    VkDeviceMemory memory;
+    VkDeviceSize memorySize;
+    
+} StreamRetired;
+
+typedef struct
+{
+    VulkanContext *vk;
+    VkSampler sampler; // trilinear
+    
+    StreamedTexture textures[STREAM_MAX_TEXTURES];
+    u32 textureCount;
+    
+    u32 memoryTypeIndex; // device local
+    u32 heapIndex;
+    VkDeviceSize budgetCap; // 0 for none
+    VkDeviceSize budget;
+    VkDeviceSize bytesResident; // every image not yet handed to be freed
+    
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingMemory;
+    u8 *staging;
+    VkDeviceSize stagingUsed;
+    u64 stagingValue; // timeline value of the last submission reading it
+    
+    StreamRebuild rebuilds[STREAM_MAX_REBUILDS];
+    u32 rebuildCount;
+    StreamRetired retired[STREAM_MAX_REBUILDS]; // by the frame being built
+    u32 retiredCount;
+    
+    // Totals since startup
+    u32 mipsStreamedIn;
+    u32 mipsEvicted;
+    
+} TextureStreamer;
+
+/*
+*  Setup
+*/
+
+void
+stream_refresh_budget(TextureStreamer *streamer)
+{
+    VulkanContext *vk = streamer->vk;
+    
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {0};
+    budgetProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    
+    VkPhysicalDeviceMemoryProperties2 memProperties = {0};
+    memProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    memProperties.pNext = vk->memoryBudget ? &budgetProperties : NULL;
+    
+    vkGetPhysicalDeviceMemoryProperties2(vk->physicalDevice, &memProperties);
+    
+    u32 heap = streamer->heapIndex;
+    VkDeviceSize available =
+        memProperties.memoryProperties.memoryHeaps[heap].size;
+    
+    if (vk->memoryBudget)
+    {
+        // The heap's usage includes ours, which is ours to spend again
+        VkDeviceSize usage = budgetProperties.heapUsage[heap];
+        VkDeviceSize heapBudget = budgetProperties.heapBudget[heap];
+        available = heapBudget > usage ? heapBudget - usage : 0;
+        available += streamer->bytesResident;
+    }
+    
+    streamer->budget = available / 100 * STREAM_BUDGET_PERCENT;
+    if (streamer->budgetCap && streamer->budget > streamer->budgetCap)
+    {
+        streamer->budget = streamer->budgetCap;
+    }
+}
+
+// budgetCap in bytes, 0 to go by the heap alone
+void
+stream_init(TextureStreamer *streamer, VulkanContext *vk,
+            VkDeviceSize budgetCap)
+{
+    memset(streamer, 0, sizeof(*streamer));
+    streamer->vk = vk;
+    streamer->budgetCap = budgetCap;
+    
+    // Images don't narrow it down further on any device we run on
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(vk->physicalDevice, &memProperties);
+    streamer->memoryTypeIndex =
+        vk_find_memory_type(vk, UINT32_MAX,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    streamer->heapIndex =
+        memProperties.memoryTypes[streamer->memoryTypeIndex].heapIndex;
+    
+    stream_refresh_budget(streamer);
+    
+    vk_create_buffer(vk, STREAM_STAGING_SIZE,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &streamer->stagingBuffer, &streamer->stagingMemory);
+    vkMapMemory(vk->device, streamer->stagingMemory, 0, STREAM_STAGING_SIZE,
+                0, (void **)&streamer->staging);
+    
+    VkSamplerCreateInfo samplerInfo =
+    {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        NULL,
+        0,
+        VK_FILTER_LINEAR, // magFilter
+        VK_FILTER_LINEAR, // minFilter
+        VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        0.0f, // mipLodBias
+        VK_FALSE, // anisotropyEnable
+        1.0f, // maxAnisotropy
+        VK_FALSE, // compareEnable
+        VK_COMPARE_OP_ALWAYS,
+        0.0f, // minLod
+        VK_LOD_CLAMP_NONE, // maxLod
+        VK_BORDER_COLOR_INT_OPAQUE_BLACK,
+        VK_FALSE // unnormalizedCoordinates
+    };
+    
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL,
+                        &streamer->sampler) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the streaming sampler");
+    }
+}
+
+VkDeviceSize
+stream_mip_bytes(StreamedTexture *texture, u32 mip)
+{
+    VkDeviceSize side = texture->size >> mip;
+    return side * side * 4;
+}
+
+/* Takes a copy of size x size RGBA8 texels and box filters the rest of the
+   chain from it (in sRGB, close enough for this content). Only touches
+   texture, so textures can be built on any thread and added later. */
+void
+stream_build_texture(StreamedTexture *texture, u32 size, u8 *texels)
+{
+    assert(size && (size & (size - 1)) == 0);
+    
+    memset(texture, 0, sizeof(*texture));
+    texture->size = size;
+    
+    while ((size >> texture->mipCount) > 0)
+    {
+        texture->mipCount++;
+    }
+    assert(texture->mipCount <= STREAM_MAX_MIPS);
+    
+    texture->tailMip = 0;
+    while ((size >> texture->tailMip) > STREAM_TAIL_SIZE)
+    {
+        texture->tailMip++;
+    }
+    
+    texture->mips[0] = (u8 *)malloc((size_t)stream_mip_bytes(texture, 0));
+    memcpy(texture->mips[0], texels, (size_t)stream_mip_bytes(texture, 0));
+    
+    for (u32 mip = 1; mip < texture->mipCount; mip++)
+    {
+        u32 side = size >> mip;
+        u32 parentSide = side * 2;
+        u8 *parent = texture->mips[mip - 1];
+        u8 *out = (u8 *)malloc((size_t)stream_mip_bytes(texture, mip));
+        texture->mips[mip] = out;
+        
+        for (u32 y = 0; y < side; y++)
+        {
+            u8 *row0 = parent + (y * 2) * parentSide * 4;
+            u8 *row1 = row0 + parentSide * 4;
+            
+            for (u32 x = 0; x < side * 4; x++)
+            {
+                u32 c = (x / 4) * 8 + (x % 4);
+                *out++ = (u8)((row0[c] + row0[c + 4] +
+                               row1[c] + row1[c + 4] + 2) / 4);
+            }
+        }
+    }
+    
+    // Nothing resident yet, the tail load counts as growing from here
+    texture->residentMip = texture->mipCount;
+    texture->requestedMip = texture->tailMip;
+}
+
+/* Takes over a texture from stream_build_texture. It isn't drawable before
+   stream_load_tails. */
+u32
+stream_add_texture(TextureStreamer *streamer, StreamedTexture *built,
+                   VkDescriptorSet descriptorSet)
+{
+    assert(streamer->textureCount < STREAM_MAX_TEXTURES);
+    
+    u32 index = streamer->textureCount++;
+    StreamedTexture *texture = &streamer->textures[index];
+    *texture = *built;
+    texture->descriptorSet = descriptorSet;
+    
+    return index;
+}
+
+/*
+*  Rebuilding images
+*/
+
+void
+stream_retire(TextureStreamer *streamer, StreamedTexture *texture)
+{
+    if (!texture->image)
+    {
+        return;
+    }
+    
+    assert(streamer->retiredCount < array_count(streamer->retired));
+    StreamRetired *retired = &streamer->retired[streamer->retiredCount++];
+    retired->image = texture->image;
+    retired->view = texture->view;
+    retired->memory = texture->memory;
+    retired->memorySize = texture->memorySize;
+}
+
+/* Replaces the texture's image with one holding [newMip, mipCount), the
+   copies are recorded by stream_record. Returns false when the levels to
+   upload don't fit in what is left of this frame's staging buffer. */
+bool
+stream_rebuild(TextureStreamer *streamer, StreamedTexture *texture,
+               u32 newMip, u32 frameIndex)
+{
+    VkDevice device = streamer->vk->device;
+    
+    // Growing uploads the new levels, shrinking only copies on the GPU
+    u32 uploadEnd = newMip < texture->residentMip ?
+        texture->residentMip : newMip;
+    
+    VkDeviceSize uploadBytes = 0;
+    for (u32 mip = newMip; mip < uploadEnd; mip++)
+    {
+        uploadBytes += stream_mip_bytes(texture, mip);
+    }
+    
+    if (streamer->rebuildCount == STREAM_MAX_REBUILDS ||
+        streamer->stagingUsed + uploadBytes > STREAM_STAGING_SIZE)
+    {
+        return false;
+    }
+    
+    u32 side = texture->size >> newMip;
+    u32 levels = texture->mipCount - newMip;
+    
+    VkImageCreateInfo imageInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_IMAGE_TYPE_2D,
+        STREAM_FORMAT,
+        { side, side, 1 },
+        levels, // mipLevels
+        1, // arrayLayers
+        VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_TILING_OPTIMAL,
+        // Copied from by the next rebuild
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+        VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL, // queue families ignored
+        VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    VkImage image;
+    if (vkCreateImage(device, &imageInfo, NULL, &image) != VK_SUCCESS)
+    {
+        assert(!"Failed to create a streamed image");
+    }
+    
+    VkMemoryRequirements memRequirements;
+    vkGetImageMemoryRequirements(device, image, &memRequirements);
+    assert(memRequirements.memoryTypeBits & (1 << streamer->memoryTypeIndex));
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        memRequirements.size,
+        streamer->memoryTypeIndex
+    };
+    
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(device, &allocInfo, NULL, &memory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate streamed image memory");
+    }
+    vkBindImageMemory(device, image, memory, 0);
+    
+    VkImageViewCreateInfo viewInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        NULL,
+        0,
+        image,
+        VK_IMAGE_VIEW_TYPE_2D,
+        STREAM_FORMAT,
+        { 0 }, // identity swizzle
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, levels, 0, 1 } // every level
+    };
+    
+    VkImageView view;
+    if (vkCreateImageView(device, &viewInfo, NULL, &view) != VK_SUCCESS)
+    {
+        assert(!"Failed to create a streamed image view");
+    }
+    
+    // The new levels, tightly packed in level order
+    StreamRebuild *rebuild = &streamer->rebuilds[streamer->rebuildCount++];
+    rebuild->texture = texture;
+    rebuild->oldImage = texture->image;
+    rebuild->oldMip = texture->residentMip;
+    rebuild->newImage = image;
+    rebuild->newMip = newMip;
+    rebuild->uploadEnd = uploadEnd;
+    rebuild->stagingOffset = streamer->stagingUsed;
+    
+    for (u32 mip = newMip; mip < uploadEnd; mip++)
+    {
+        VkDeviceSize bytes = stream_mip_bytes(texture, mip);
+        memcpy(streamer->staging + streamer->stagingUsed, texture->mips[mip],
+               (size_t)bytes);
+        streamer->stagingUsed += bytes;
+    }
+    
+    // Loading the tail is neither
+    if (texture->image && newMip < texture->residentMip)
+    {
+        streamer->mipsStreamedIn += texture->residentMip - newMip;
+    }
+    else if (texture->image)
+    {
+        streamer->mipsEvicted += newMip - texture->residentMip;
+    }
+    
+    stream_retire(streamer, texture);
+    
+    texture->image = image;
+    texture->view = view;
+    texture->memory = memory;
+    texture->memorySize = memRequirements.size;
+    texture->residentMip = newMip;
+    texture->rebuiltFrame = frameIndex;
+    streamer->bytesResident += memRequirements.size;
+    
+    // The frame that samples it is recorded after this, the last one that
+    // sampled the old image is done
+    VkDescriptorImageInfo imageDescriptor =
+    {
+        streamer->sampler,
+        view,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+    
+    VkWriteDescriptorSet write =
+    {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        NULL,
+        texture->descriptorSet,
+        0, // dstBinding
+        0, // dstArrayElement
+        1, // descriptorCount
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        &imageDescriptor,
+        NULL, // pBufferInfo
+        NULL // pTexelBufferView
+    };
+    
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+    
+    return true;
+}
+
+// The bytes an image of levels [mip, mipCount) is expected to take
+VkDeviceSize
+stream_chain_bytes(StreamedTexture *texture, u32 mip)
+{
+    VkDeviceSize bytes = 0;
+    for (; mip < texture->mipCount; mip++)
+    {
+        bytes += stream_mip_bytes(texture, mip);
+    }
+    
+    return bytes;
+}
+
+/* The least recently used texture with a level above its tail that it can
+   give up: not requested this frame, or holding finer levels than it was
+   asked for. NULL when there is none. */
+StreamedTexture *
+stream_eviction_candidate(TextureStreamer *streamer, u32 frameIndex)
+{
+    StreamedTexture *oldest = NULL;
+    
+    for (u32 i = 0; i < streamer->textureCount; i++)
+    {
+        StreamedTexture *texture = &streamer->textures[i];
+        
+        bool evictable = texture->residentMip < texture->tailMip &&
+            texture->rebuiltFrame != frameIndex &&
+            (texture->lastUsedFrame != frameIndex ||
+             texture->residentMip < texture->requestedMip);
+        
+        if (evictable &&
+            (!oldest || texture->lastUsedFrame < oldest->lastUsedFrame))
+        {
+            oldest = texture;
+        }
+    }
+    
+    return oldest;
+}
+
+/* Evicts the least recently used top levels until bytes more fit in the
+   budget, as far as this frame's rebuilds allow. projected is what will be
+   resident once the retired images are freed. */
+bool
+stream_make_room(TextureStreamer *streamer, VkDeviceSize *projected,
+                 VkDeviceSize bytes, u32 frameIndex)
+{
+    while (*projected + bytes > streamer->budget)
+    {
+        StreamedTexture *victim = stream_eviction_candidate(streamer,
+                                                            frameIndex);
+        if (!victim)
+        {
+            return false;
+        }
+        
+        VkDeviceSize oldBytes = victim->memorySize;
+        if (!stream_rebuild(streamer, victim, victim->residentMip + 1,
+                            frameIndex))
+        {
+            return false;
+        }
+        
+        *projected = *projected - oldBytes + victim->memorySize;
+    }
+    
+    return true;
+}
+
+/*
+*  Per frame
+*/
+
+// Draws call this with how many pixels the texture covers across
+void
+stream_request(TextureStreamer *streamer, u32 textureIndex, f32 screenSize,
+               u32 frameIndex)
+{
+    StreamedTexture *texture = &streamer->textures[textureIndex];
+    
+    // The coarsest level that still has a texel per pixel
+    u32 mip = 0;
+    while (mip < texture->tailMip &&
+           (f32)(texture->size >> (mip + 1)) >= screenSize)
+    {
+        mip++;
+    }
+    
+    if (texture->lastUsedFrame != frameIndex || mip < texture->requestedMip)
+    {
+        texture->requestedMip = mip;
+    }
+    texture->lastUsedFrame = frameIndex;
+}
+
+// After the frame's requests, before recording
+void
+stream_update(TextureStreamer *streamer, u32 frameIndex)
+{
+    VulkanContext *vk = streamer->vk;
+    
+    assert(streamer->retiredCount == 0); // stream_submitted hands them over
+    streamer->rebuildCount = 0;
+    
+    // Normally long done, the previous frame's uploads are read by now
+    gpu_timeline_wait(vk, streamer->stagingValue);
+    streamer->stagingUsed = 0;
+    
+    if (frameIndex % STREAM_BUDGET_REFRESH == 0)
+    {
+        stream_refresh_budget(streamer);
+    }
+    
+    // Everything alive now is resident next frame, bar what gets retired
+    VkDeviceSize projected = streamer->bytesResident;
+    
+    // The budget may have shrunk under us
+    stream_make_room(streamer, &projected, 0, frameIndex);
+    
+    // One level finer for the most under-resolved requests first
+    for (;;)
+    {
+        StreamedTexture *neediest = NULL;
+        u32 neediestDeficit = 0;
+        
+        for (u32 i = 0; i < streamer->textureCount; i++)
+        {
+            StreamedTexture *texture = &streamer->textures[i];
+            if (texture->lastUsedFrame != frameIndex ||
+                texture->rebuiltFrame == frameIndex ||
+                texture->requestedMip >= texture->residentMip)
+            {
+                continue;
+            }
+            
+            u32 deficit = texture->residentMip - texture->requestedMip;
+            if (deficit > neediestDeficit)
+            {
+                neediest = texture;
+                neediestDeficit = deficit;
+            }
+        }
+        
+        if (!neediest)
+        {
+            break;
+        }
+        
+        // Taken out of the running this frame, whatever happens next
+        neediest->rebuiltFrame = frameIndex;
+        
+        u32 newMip = neediest->residentMip - 1;
+        VkDeviceSize growth = stream_chain_bytes(neediest, newMip) -
+            stream_chain_bytes(neediest, neediest->residentMip);
+        
+        // Both images are alive until next frame, the old one is freed then
+        if (!stream_make_room(streamer, &projected, growth, frameIndex))
+        {
+            continue;
+        }
+        
+        VkDeviceSize oldBytes = neediest->memorySize;
+        if (!stream_rebuild(streamer, neediest, newMip, frameIndex))
+        {
+            break;
+        }
+        projected = projected - oldBytes + neediest->memorySize;
+    }
+}
+
+/* Records the rebuilds of this frame's update. Old images go from shader
+   read to transfer source, new ones from nothing to transfer destination
+   and, once filled, to shader read for the passes that sample them. */
+void
+stream_record(TextureStreamer *streamer, VkCommandBuffer commandBuffer)
+{
+    if (streamer->rebuildCount == 0)
+    {
+        return;
+    }
+    
+    VkImageMemoryBarrier2 barriers[STREAM_MAX_REBUILDS * 2];
+    u32 barrierCount = 0;
+    
+    for (u32 i = 0; i < streamer->rebuildCount; i++)
+    {
+        StreamRebuild *rebuild = &streamer->rebuilds[i];
+        
+        VkImageMemoryBarrier2 toDestination =
+        {
+            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            NULL,
+            VK_PIPELINE_STAGE_2_NONE,
+            VK_ACCESS_2_NONE,
+            VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+            VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+            VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+            rebuild->newImage,
+            { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+        };
+        barriers[barrierCount++] = toDestination;
+        
+        if (rebuild->oldImage)
+        {
+            VkImageMemoryBarrier2 toSource =
+            {
+                VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                NULL,
+                VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+                VK_ACCESS_2_TRANSFER_READ_BIT,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+                VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+                rebuild->oldImage,
+                { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+            };
+            barriers[barrierCount++] = toSource;
+        }
+    }
+    
+    VkDependencyInfo dependencyInfo =
+    {
+        VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        NULL,
+        0, // dependencyFlags
+        0, NULL, // no global memory barriers
+        0, NULL, // no buffer barriers
+        barrierCount, barriers
+    };
+    
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+    
+    for (u32 i = 0; i < streamer->rebuildCount; i++)
+    {
+        StreamRebuild *rebuild = &streamer->rebuilds[i];
+        StreamedTexture *texture = rebuild->texture;
+        
+        VkDeviceSize stagingOffset = rebuild->stagingOffset;
+        for (u32 mip = rebuild->newMip; mip < rebuild->uploadEnd; mip++)
+        {
+            u32 side = texture->size >> mip;
+            
+            VkBufferImageCopy upload =
+            {
+                stagingOffset, // bufferOffset
+                0, // bufferRowLength (tightly packed)
+                0, // bufferImageHeight
+                { VK_IMAGE_ASPECT_COLOR_BIT, mip - rebuild->newMip, 0, 1 },
+                { 0, 0, 0 }, // imageOffset
+                { side, side, 1 } // imageExtent
+            };
+            
+            vkCmdCopyBufferToImage(commandBuffer, streamer->stagingBuffer,
+                                   rebuild->newImage,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1, &upload);
+            
+            stagingOffset += stream_mip_bytes(texture, mip);
+        }
+        
+        if (!rebuild->oldImage)
+        {
+            continue;
+        }
+        
+        // The levels both images hold, one region per level
+        VkImageCopy copies[STREAM_MAX_MIPS];
+        u32 copyCount = 0;
+        
+        for (u32 mip = rebuild->uploadEnd; mip < texture->mipCount; mip++)
+        {
+            u32 side = texture->size >> mip;
+            
+            VkImageCopy copy =
+            {
+                { VK_IMAGE_ASPECT_COLOR_BIT, mip - rebuild->oldMip, 0, 1 },
+                { 0, 0, 0 }, // srcOffset
+                { VK_IMAGE_ASPECT_COLOR_BIT, mip - rebuild->newMip, 0, 1 },
+                { 0, 0, 0 }, // dstOffset
+                { side, side, 1 } // extent
+            };
+            copies[copyCount++] = copy;
+        }
+        
+        vkCmdCopyImage(commandBuffer,
+                       rebuild->oldImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       rebuild->newImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       copyCount, copies);
+    }
+    
+    for (u32 i = 0; i < streamer->rebuildCount; i++)
+    {
+        VkImageMemoryBarrier2 toShaderRead =
+        {
+            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            NULL,
+            VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+            VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+            VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+            VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+            streamer->rebuilds[i].newImage,
+            { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+        };
+        barriers[i] = toShaderRead;
+    }
+    
+    dependencyInfo.imageMemoryBarrierCount = streamer->rebuildCount;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+/* value is the timeline value of the submission that recorded the frame,
+   the images it retired are destroyed once the GPU reaches it */
+void
+stream_submitted(TextureStreamer *streamer, u64 value)
+{
+    for (u32 i = 0; i < streamer->retiredCount; i++)
+    {
+        StreamRetired *retired = &streamer->retired[i];
+        destroy_queue_image(streamer->vk, retired->image, retired->view,
+                            retired->memory, value);
+        streamer->bytesResident -= retired->memorySize;
+    }
+    streamer->retiredCount = 0;
+    
+    if (streamer->stagingUsed)
+    {
+        streamer->stagingValue = value;
+    }
+}
+
+/* Loads every texture's tail with a one-off command buffer, so all of them
+   can be drawn from the first frame. Call once after adding them. */
+void
+stream_load_tails(TextureStreamer *streamer)
+{
+    VkCommandBuffer commandBuffer =
+        vk_begin_single_time_commands(streamer->vk);
+    
+    for (u32 i = 0; i < streamer->textureCount; i++)
+    {
+        StreamedTexture *texture = &streamer->textures[i];
+        
+        if (!stream_rebuild(streamer, texture, texture->tailMip, 0))
+        {
+            // Out of rebuilds or staging, flush what is queued so far
+            stream_record(streamer, commandBuffer);
+            vk_end_single_time_commands(streamer->vk, commandBuffer);
+            
+            commandBuffer = vk_begin_single_time_commands(streamer->vk);
+            streamer->rebuildCount = 0;
+            streamer->stagingUsed = 0;
+            
+            bool loaded = stream_rebuild(streamer, texture, texture->tailMip,
+                                         0);
+            assert(loaded);
+        }
+    }
+    
+    stream_record(streamer, commandBuffer);
+    vk_end_single_time_commands(streamer->vk, commandBuffer);
+    
+    streamer->rebuildCount = 0;
+    streamer->stagingUsed = 0;
+}
+
+// Once the GPU is done with every texture, after the destroy queue flush
+void
+stream_destroy(TextureStreamer *streamer)
+{
+    VkDevice device = streamer->vk->device;
+    
+    for (u32 i = 0; i < streamer->textureCount; i++)
+    {
+        StreamedTexture *texture = &streamer->textures[i];
+        
+        if (texture->image)
+        {
+            vkDestroyImageView(device, texture->view, NULL);
+            vkDestroyImage(device, texture->image, NULL);
+            vkFreeMemory(device, texture->memory, NULL);
+        }
+        
+        for (u32 mip = 0; mip < texture->mipCount; mip++)
+        {
+            free(texture->mips[mip]);
+        }
+    }
+    
+    vkDestroyBuffer(device, streamer->stagingBuffer, NULL);
+    vkFreeMemory(device, streamer->stagingMemory, NULL);
+    vkDestroySampler(device, streamer->sampler, NULL);
+}
@@ -0,0 +1,286 @@
+/*
+*  Chunked tile map
+*
+*  The map is split into square chunks of tiles. Each chunk owns a fixed
+*  slot of one device-local vertex buffer, its geometry is built once and
+*  stays there until a tile in it changes. Edited chunks are queued, and
+*  each frame up to TILEMAP_MAX_UPLOADS of them are rebuilt into a staging
+*  buffer and copied into their slots before the main pass. Drawing is one
+*  draw per non-empty chunk in view, which is found from the view bounds
+*  directly, so a static map costs next to nothing per frame.
+*/
+
+#define TILEMAP_CHUNK_TILES 32 // chunks are 32x32 tiles
+#define TILEMAP_TILE_SIZE 16.0f // in world pixels
+#define TILEMAP_CHUNK_SIZE (TILEMAP_CHUNK_TILES * TILEMAP_TILE_SIZE)
+#define TILEMAP_CHUNK_VERTICES \
+    (TILEMAP_CHUNK_TILES * TILEMAP_CHUNK_TILES * VERTICES_PER_SPRITE)
+#define TILEMAP_MAX_UPLOADS 16 // chunks rebuilt per frame, the rest wait
+
+typedef enum
+{
+    TILE_EMPTY,
+    TILE_CHECKER, // the whole texture
+    TILE_DARK, // its dark texel
+    TILE_RED, // its red texel
+    
+    TILE_TYPE_COUNT
+    
+} TileType;
+
+// Texture rectangles of each type, u0 v0 u1 v1, inset from texel edges
+static f32 tileUVs[TILE_TYPE_COUNT][4] =
+{
+    { 0, 0, 0, 0 }, // TILE_EMPTY
+    { 0.0f, 0.0f, 1.0f, 1.0f }, // TILE_CHECKER
+    { 0.05f, 0.05f, 0.45f, 0.45f }, // TILE_DARK
+    { 0.55f, 0.05f, 0.95f, 0.45f } // TILE_RED
+};
+
+typedef struct
+{
+    u32 vertexCount; // of what is in the chunk's slot right now
+    bool dirty; // queued in dirtyChunks
+    
+} TileChunk;
+
+typedef struct
+{
+    u32 widthInChunks;
+    u32 heightInChunks;
+    u32 widthInTiles;
+    u32 heightInTiles;
+    
+    u8 *tiles; // TileType, row-major
+    TileChunk *chunks;
+    u32 *dirtyChunks; // in the order they were edited
+    u32 dirtyCount;
+    
+    // TILEMAP_CHUNK_VERTICES per chunk, in chunk order
+    VkBuffer vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    
+    // Rebuilt chunks of this frame, TILEMAP_CHUNK_VERTICES each
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    Vertex *staging;
+    
+    VkBufferCopy copies[TILEMAP_MAX_UPLOADS];
+    u32 copyCount;
+    
+} TileMap;
+
+void
+tilemap_init(TileMap *map, u32 widthInChunks, u32 heightInChunks)
+{
+    map->widthInChunks = widthInChunks;
+    map->heightInChunks = heightInChunks;
+    map->widthInTiles = widthInChunks * TILEMAP_CHUNK_TILES;
+    map->heightInTiles = heightInChunks * TILEMAP_CHUNK_TILES;
+    
+    u32 chunkCount = widthInChunks * heightInChunks;
+    map->tiles = (u8 *)calloc(map->widthInTiles * map->heightInTiles, 1);
+    map->chunks = (TileChunk *)calloc(chunkCount, sizeof(TileChunk));
+    map->dirtyChunks = (u32 *)malloc(chunkCount * sizeof(u32));
+    assert(map->tiles && map->chunks && map->dirtyChunks);
+    
+    map->dirtyCount = 0;
+    map->copyCount = 0;
+}
+
+// Queues the tile's chunk for re-upload if the tile actually changed
+void
+tilemap_set_tile(TileMap *map, u32 x, u32 y, TileType type)
+{
+    assert(x < map->widthInTiles && y < map->heightInTiles);
+    
+    u8 *tile = &map->tiles[y * map->widthInTiles + x];
+    if (*tile == (u8)type)
+    {
+        return;
+    }
+    *tile = (u8)type;
+    
+    u32 chunk = (y / TILEMAP_CHUNK_TILES) * map->widthInChunks +
+        x / TILEMAP_CHUNK_TILES;
+    
+    if (!map->chunks[chunk].dirty)
+    {
+        map->chunks[chunk].dirty = true;
+        map->dirtyChunks[map->dirtyCount++] = chunk;
+    }
+}
+
+/* Writes a quad per non-empty tile of chunk to out, in world pixels, and
+   returns the vertex count. Empty tiles take no space. */
+u32
+tilemap_build_chunk(TileMap *map, u32 chunk, Vertex *out)
+{
+    u32 firstX = (chunk % map->widthInChunks) * TILEMAP_CHUNK_TILES;
+    u32 firstY = (chunk / map->widthInChunks) * TILEMAP_CHUNK_TILES;
+    
+    Vertex *start = out;
+    for (u32 y = firstY; y < firstY + TILEMAP_CHUNK_TILES; y++)
+    {
+        u8 *row = map->tiles + y * map->widthInTiles;
+        
+        for (u32 x = firstX; x < firstX + TILEMAP_CHUNK_TILES; x++)
+        {
+            if (row[x] == TILE_EMPTY)
+            {
+                continue;
+            }
+            
+            f32 *uv = tileUVs[row[x]];
+            f32 x0 = (f32)x * TILEMAP_TILE_SIZE;
+            f32 y0 = (f32)y * TILEMAP_TILE_SIZE;
+            f32 x1 = x0 + TILEMAP_TILE_SIZE;
+            f32 y1 = y0 + TILEMAP_TILE_SIZE;
+            
+            Vertex v0 = { x0, y0, uv[0], uv[1] };
+            Vertex v1 = { x1, y0, uv[2], uv[1] };
+            Vertex v2 = { x1, y1, uv[2], uv[3] };
+            Vertex v3 = { x0, y1, uv[0], uv[3] };
+            
+            // Same triangles and winding as emit_sprite_lanes
+            out[0] = v0;
+            out[1] = v1;
+            out[2] = v2;
+            out[3] = v0;
+            out[4] = v2;
+            out[5] = v3;
+            out += VERTICES_PER_SPRITE;
+        }
+    }
+    
+    return (u32)(out - start);
+}
+
+/* Builds every chunk and uploads them all at once through staging, then
+   creates the per-frame staging buffer. Call after filling in the tiles. */
+void
+tilemap_bake(TileMap *map, VulkanContext *vk)
+{
+    u32 chunkCount = map->widthInChunks * map->heightInChunks;
+    VkDeviceSize chunkBytes = sizeof(Vertex) * TILEMAP_CHUNK_VERTICES;
+    VkDeviceSize size = chunkBytes * chunkCount;
+    
+    Vertex *vertices = (Vertex *)malloc((size_t)size);
+    assert(vertices);
+    
+    for (u32 chunk = 0; chunk < chunkCount; chunk++)
+    {
+        map->chunks[chunk].vertexCount =
+            tilemap_build_chunk(map, chunk,
+                                vertices + chunk * TILEMAP_CHUNK_VERTICES);
+        map->chunks[chunk].dirty = false;
+    }
+    map->dirtyCount = 0;
+    
+    vk_create_device_local_buffer(vk, size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                  vertices, &map->vertexBuffer,
+                                  &map->vertexBufferMemory);
+    free(vertices);
+    
+    VkDeviceSize stagingSize = chunkBytes * TILEMAP_MAX_UPLOADS;
+    vk_create_buffer(vk, stagingSize,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &map->stagingBuffer, &map->stagingBufferMemory);
+    
+    vkMapMemory(vk->device, map->stagingBufferMemory, 0, stagingSize, 0,
+                (void **)&map->staging);
+    assert(map->staging);
+}
+
+/* Rebuilds the oldest edited chunks into staging and queues their copies.
+   The GPU must be done with the previous frame's staging contents. */
+void
+tilemap_prepare_uploads(TileMap *map)
+{
+    u32 uploadCount = map->dirtyCount;
+    if (uploadCount > TILEMAP_MAX_UPLOADS)
+    {
+        uploadCount = TILEMAP_MAX_UPLOADS;
+    }
+    
+    map->copyCount = 0;
+    for (u32 i = 0; i < uploadCount; i++)
+    {
+        u32 chunk = map->dirtyChunks[i];
+        Vertex *staging = map->staging + i * TILEMAP_CHUNK_VERTICES;
+        
+        u32 vertexCount = tilemap_build_chunk(map, chunk, staging);
+        map->chunks[chunk].vertexCount = vertexCount;
+        map->chunks[chunk].dirty = false;
+        
+        // A chunk that became empty just stops being drawn
+        if (vertexCount)
+        {
+            VkBufferCopy copy =
+            {
+                sizeof(Vertex) * i * TILEMAP_CHUNK_VERTICES, // srcOffset
+                sizeof(Vertex) * chunk * TILEMAP_CHUNK_VERTICES, // dstOffset
+                sizeof(Vertex) * vertexCount // size
+            };
+            
+            map->copies[map->copyCount++] = copy;
+        }
+    }
+    
+    map->dirtyCount -= uploadCount;
+    memmove(map->dirtyChunks, map->dirtyChunks + uploadCount,
+            map->dirtyCount * sizeof(u32));
+}
+
+// Records the copies queued by tilemap_prepare_uploads
+void
+tilemap_record_uploads(TileMap *map, VkCommandBuffer commandBuffer)
+{
+    if (map->copyCount)
+    {
+        vkCmdCopyBuffer(commandBuffer, map->stagingBuffer, map->vertexBuffer,
+                        map->copyCount, map->copies);
+    }
+}
+
+/* The range of chunks overlapping view, from (*firstX, *firstY) up to but
+   not including (*endX, *endY). Empty when the view is off the map. */
+void
+tilemap_chunks_in_view(TileMap *map, Rect2 view, u32 *firstX, u32 *firstY,
+                       u32 *endX, u32 *endY)
+{
+    f32 mapWidth = (f32)map->widthInChunks * TILEMAP_CHUNK_SIZE;
+    f32 mapHeight = (f32)map->heightInChunks * TILEMAP_CHUNK_SIZE;
+    
+    f32 minX = view.minX < 0 ? 0 : view.minX;
+    f32 minY = view.minY < 0 ? 0 : view.minY;
+    f32 maxX = view.maxX > mapWidth ? mapWidth : view.maxX;
+    f32 maxY = view.maxY > mapHeight ? mapHeight : view.maxY;
+    
+    if (minX >= maxX || minY >= maxY)
+    {
+        *firstX = *firstY = *endX = *endY = 0;
+        return;
+    }
+    
+    *firstX = (u32)(minX / TILEMAP_CHUNK_SIZE);
+    *firstY = (u32)(minY / TILEMAP_CHUNK_SIZE);
+    *endX = (u32)ceilf(maxX / TILEMAP_CHUNK_SIZE);
+    *endY = (u32)ceilf(maxY / TILEMAP_CHUNK_SIZE);
+}
+
+// Once the GPU is done with the map's buffers
+void
+tilemap_destroy(TileMap *map, VulkanContext *vk)
+{
+    vkDestroyBuffer(vk->device, map->vertexBuffer, NULL);
+    vkFreeMemory(vk->device, map->vertexBufferMemory, NULL);
+    vkDestroyBuffer(vk->device, map->stagingBuffer, NULL);
+    vkFreeMemory(vk->device, map->stagingBufferMemory, NULL);
+    
+    free(map->tiles);
+    free(map->chunks);
+    free(map->dirtyChunks);
+}
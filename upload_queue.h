@@ -0,0 +1,519 @@
+/*
+*  Upload request queue
+*
+*  Any thread can ask for a buffer range or an image level to be filled
+*  from staging memory it wrote itself: it pushes a request here and goes
+*  on with its work. The render thread is the only consumer. Once a frame
+*  it drains the queue into the frame's command buffer, batching the
+*  copies and their barriers, so producers never touch a command pool or
+*  the queue, neither of which may be used from two threads at once.
+*
+*  The ring is a bounded multi-producer queue with a sequence number per
+*  slot. A producer claims the next write index with a compare exchange,
+*  fills the slot and publishes it by bumping the slot's sequence, so
+*  producers only ever retry against each other, never wait. A full ring
+*  makes the push fail instead. The consumer stops at the first slot that
+*  was claimed but not yet published, and picks it up next frame. It also
+*  stops after maxPerFrame requests, unless that is raised to the whole
+*  ring, as a replay does so each frame gets exactly its captured uploads.
+*
+*  A request may name an UploadFence, which learns the timeline value of
+*  the frame that copied it. The producer keeps its staging memory alive
+*  until upload_fence_landed says the GPU got there.
+*/
+
+#define UPLOAD_QUEUE_SIZE 1024 // must be a power of two
+#define UPLOAD_MAX_PER_FRAME 256 // default maxPerFrame
+#define UPLOAD_MAX_REGIONS 64 // buffer copies merged into one command
+
+typedef enum
+{
+    UPLOAD_BUFFER,
+    UPLOAD_IMAGE
+    
+} UploadType;
+
+typedef struct
+{
+    volatile LONG64 value; // timeline value of the newest copy submitted
+    volatile LONG count; // copies submitted so far
+    
+} UploadFence;
+
+typedef struct
+{
+    UploadType type;
+    
+    // Written by the producer, needs VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    VkBuffer source;
+    VkDeviceSize sourceOffset;
+    VkDeviceMemory sourceMemory; // if set, the queue destroys the source
+    
+    // UPLOAD_BUFFER, needs VK_BUFFER_USAGE_TRANSFER_DST_BIT
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    
+    /* UPLOAD_IMAGE, color, tightly packed, left in SHADER_READ_ONLY. A
+       level must not be uploaded again before its first upload landed. */
+    VkImage image;
+    VkImageLayout oldLayout; // UNDEFINED when the level's contents can go
+    u32 mipLevel;
+    VkExtent3D extent;
+    
+    UploadFence *fence; // optional
+    
+} UploadRequest;
+
+typedef struct
+{
+    UploadRequest request;
+    volatile LONG sequence; // index + 1 once published, + size once free
+    
+} UploadSlot;
+
+struct UploadQueue
+{
+    UploadSlot slots[UPLOAD_QUEUE_SIZE];
+    volatile LONG writeIndex; // claimed by producers
+    LONG readIndex; // render thread only
+    
+    // Drained into the frame being recorded, render thread only
+    u32 maxPerFrame; // the rest waits for the next frame
+    UploadRequest drained[UPLOAD_QUEUE_SIZE];
+    u32 drainedCount;
+    VkImageMemoryBarrier2 imageBarriers[UPLOAD_QUEUE_SIZE];
+    
+    volatile LONG pushesRejected;
+    u64 uploadedTotal;
+    
+};
+
+void
+upload_queue_init(UploadQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->maxPerFrame = UPLOAD_MAX_PER_FRAME;
+    
+    for (LONG i = 0; i < UPLOAD_QUEUE_SIZE; i++)
+    {
+        queue->slots[i].sequence = i;
+    }
+}
+
+/* Safe from any thread. Returns false without waiting when the ring is
+   full, the producer still owns its staging memory then. */
+bool
+upload_queue_push(UploadQueue *queue, UploadRequest *request)
+{
+    LONG write;
+    UploadSlot *slot;
+    
+    for (;;)
+    {
+        write = queue->writeIndex;
+        slot = &queue->slots[write & (UPLOAD_QUEUE_SIZE - 1)];
+        
+        // Wrapping differences, the indices run past LONG's range
+        LONG lag = (LONG)((ULONG)slot->sequence - (ULONG)write);
+        if (lag < 0)
+        {
+            // Still holding the request from a lap ago
+            InterlockedIncrement(&queue->pushesRejected);
+            return false;
+        }
+        
+        if (lag == 0 &&
+            InterlockedCompareExchange(&queue->writeIndex, write + 1,
+                                       write) == write)
+        {
+            break;
+        }
+        
+        // Another producer got there first, try the next slot
+    }
+    
+    slot->request = *request;
+    
+    // Make the request visible before publishing the slot
+    MemoryBarrier();
+    slot->sequence = write + 1;
+    
+    return true;
+}
+
+// Render thread only, false once nothing more is published
+bool
+upload_queue_pop(UploadQueue *queue, UploadRequest *request)
+{
+    LONG read = queue->readIndex;
+    UploadSlot *slot = &queue->slots[read & (UPLOAD_QUEUE_SIZE - 1)];
+    
+    if (slot->sequence != read + 1)
+    {
+        return false;
+    }
+    
+    // Don't read the slot before the sequence that published it
+    MemoryBarrier();
+    *request = slot->request;
+    
+    // Done with the slot before a producer may claim it again
+    MemoryBarrier();
+    slot->sequence = read + UPLOAD_QUEUE_SIZE;
+    queue->readIndex = read + 1;
+    
+    return true;
+}
+
+/*
+*  Recording, render thread only
+*/
+
+void
+upload_image_barriers(UploadQueue *queue, VkCommandBuffer commandBuffer,
+                      bool toDestination)
+{
+    VkImageMemoryBarrier2 *barriers = queue->imageBarriers;
+    u32 barrierCount = 0;
+    
+    for (u32 i = 0; i < queue->drainedCount; i++)
+    {
+        UploadRequest *request = &queue->drained[i];
+        if (request->type != UPLOAD_IMAGE)
+        {
+            continue;
+        }
+        
+        VkImageMemoryBarrier2 barrier =
+        {
+            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            NULL,
+            VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+            VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_QUEUE_FAMILY_IGNORED, // srcQueueFamilyIndex
+            VK_QUEUE_FAMILY_IGNORED, // dstQueueFamilyIndex
+            request->image,
+            { VK_IMAGE_ASPECT_COLOR_BIT, request->mipLevel, 1, 0, 1 }
+        };
+        
+        if (toDestination)
+        {
+            // Earlier reads of the level finish before it is overwritten
+            barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            barrier.srcAccessMask = VK_ACCESS_2_NONE;
+            barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT;
+            barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            barrier.oldLayout = request->oldLayout;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        }
+        
+        barriers[barrierCount++] = barrier;
+    }
+    
+    /* Buffers get one global barrier each way, the queue doesn't know who
+       reads them */
+    VkMemoryBarrier2 memoryBarrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        NULL,
+        VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, // srcStageMask
+        VK_ACCESS_2_TRANSFER_WRITE_BIT, // srcAccessMask
+        VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, // dstStageMask
+        VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT
+    };
+    
+    if (toDestination)
+    {
+        memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        memoryBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+        memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    }
+    
+    VkDependencyInfo dependencyInfo =
+    {
+        VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        NULL,
+        0, // dependencyFlags
+        1, &memoryBarrier,
+        0, NULL, // no buffer barriers
+        barrierCount, barriers
+    };
+    
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+/* Drains what has been published so far and records its copies. Runs of
+   buffer requests between the same two buffers become one copy command. */
+void
+upload_queue_record(UploadQueue *queue, VkCommandBuffer commandBuffer)
+{
+    assert(queue->drainedCount == 0); // upload_queue_submitted not called
+    
+    assert(queue->maxPerFrame <= UPLOAD_QUEUE_SIZE);
+    while (queue->drainedCount < queue->maxPerFrame &&
+           upload_queue_pop(queue, &queue->drained[queue->drainedCount]))
+    {
+        queue->drainedCount++;
+    }
+    
+    if (queue->drainedCount == 0)
+    {
+        return;
+    }
+    
+    upload_image_barriers(queue, commandBuffer, true);
+    
+    VkBufferCopy regions[UPLOAD_MAX_REGIONS];
+    u32 regionCount = 0;
+    
+    for (u32 i = 0; i < queue->drainedCount; i++)
+    {
+        UploadRequest *request = &queue->drained[i];
+        
+        if (request->type == UPLOAD_IMAGE)
+        {
+            VkBufferImageCopy copy =
+            {
+                request->sourceOffset, // bufferOffset
+                0, // bufferRowLength (tightly packed)
+                0, // bufferImageHeight
+                { VK_IMAGE_ASPECT_COLOR_BIT, request->mipLevel, 0, 1 },
+                { 0, 0, 0 }, // imageOffset
+                request->extent
+            };
+            
+            vkCmdCopyBufferToImage(commandBuffer, request->source,
+                                   request->image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1, &copy);
+            continue;
+        }
+        
+        VkBufferCopy region =
+        {
+            request->sourceOffset,
+            request->offset,
+            request->size
+        };
+        regions[regionCount++] = region;
+        
+        // Flush the run unless the next request continues it
+        UploadRequest *next = i + 1 < queue->drainedCount ?
+            &queue->drained[i + 1] : NULL;
+        
+        if (!next || next->type != UPLOAD_BUFFER ||
+            next->source != request->source ||
+            next->buffer != request->buffer ||
+            regionCount == UPLOAD_MAX_REGIONS)
+        {
+            vkCmdCopyBuffer(commandBuffer, request->source, request->buffer,
+                            regionCount, regions);
+            regionCount = 0;
+        }
+    }
+    
+    upload_image_barriers(queue, commandBuffer, false);
+    
+    queue->uploadedTotal += queue->drainedCount;
+}
+
+/* value is the timeline value of the submission that recorded the frame,
+   the fences of the requests it drained learn it */
+void
+upload_queue_submitted(UploadQueue *queue, VulkanContext *vk, u64 value)
+{
+    for (u32 i = 0; i < queue->drainedCount; i++)
+    {
+        UploadRequest *request = &queue->drained[i];
+        if (request->sourceMemory)
+        {
+            destroy_queue_buffer(vk, request->source, request->sourceMemory,
+                                 value);
+        }
+        
+        UploadFence *fence = request->fence;
+        if (fence)
+        {
+            // The value first, so a matching count implies it
+            InterlockedExchange64(&fence->value, (LONG64)value);
+            InterlockedIncrement(&fence->count);
+        }
+    }
+    
+    queue->drainedCount = 0;
+}
+
+// At exit, frees the sources of requests no frame drained
+void
+upload_queue_destroy(UploadQueue *queue, VulkanContext *vk)
+{
+    assert(queue->drainedCount == 0);
+    
+    UploadRequest request;
+    while (upload_queue_pop(queue, &request))
+    {
+        if (request.sourceMemory)
+        {
+            vkDestroyBuffer(vk->device, request.source, NULL);
+            vkFreeMemory(vk->device, request.sourceMemory, NULL);
+        }
+    }
+}
+
+/* Safe from any thread. True once the GPU has finished the first pushed
+   requests that named fence. */
+bool
+upload_fence_landed(VulkanContext *vk, UploadFence *fence, LONG pushed)
+{
+    if (fence->count != pushed)
+    {
+        return false;
+    }
+    
+    // Don't read the value before the count that implies it
+    MemoryBarrier();
+    
+    // Not gpu_timeline_reached, its cache belongs to the render thread
+    u64 completed;
+    vkGetSemaphoreCounterValue(vk->device, vk->timeline, &completed);
+    
+    return (u64)fence->value <= completed;
+}
+
+/* Safe from any thread. Copies data into a staging buffer of its own,
+   which the queue destroys once the copy is done. For occasional uploads,
+   producers that upload often should fill an UploadStaging instead. */
+bool
+upload_queue_buffer(VulkanContext *vk, VkBuffer buffer, VkDeviceSize offset,
+                    void *data, VkDeviceSize size)
+{
+    UploadRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = UPLOAD_BUFFER;
+    request.buffer = buffer;
+    request.offset = offset;
+    request.size = size;
+    
+    vk_create_buffer(vk, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &request.source, &request.sourceMemory);
+    
+    void *mapped;
+    vkMapMemory(vk->device, request.sourceMemory, 0, size, 0, &mapped);
+    memcpy(mapped, data, (size_t)size);
+    vkUnmapMemory(vk->device, request.sourceMemory);
+    
+    if (!upload_queue_push(vk->uploadQueue, &request))
+    {
+        // Never seen by the GPU, nothing to wait for
+        vkDestroyBuffer(vk->device, request.source, NULL);
+        vkFreeMemory(vk->device, request.sourceMemory, NULL);
+        return false;
+    }
+    
+    return true;
+}
+
+/*
+*  Staging for one producer
+*/
+
+/* A persistently mapped staging buffer filled front to back, for use by
+   one thread. It starts over from the front once everything pushed from
+   it has landed; until then a request that doesn't fit is turned down, so
+   a producer never blocks on the GPU. */
+typedef struct
+{
+    VulkanContext *vk;
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    u8 *mapped;
+    VkDeviceSize size;
+    VkDeviceSize used;
+    
+    UploadFence fence;
+    LONG pushed; // requests pushed with fence
+    
+} UploadStaging;
+
+void
+upload_staging_init(UploadStaging *staging, VulkanContext *vk,
+                    VkDeviceSize size)
+{
+    memset(staging, 0, sizeof(*staging));
+    staging->vk = vk;
+    staging->size = size;
+    
+    vk_create_buffer(vk, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &staging->buffer, &staging->memory);
+    
+    vkMapMemory(vk->device, staging->memory, 0, size, 0,
+                (void **)&staging->mapped);
+}
+
+/* Copies data into staging and asks for it to land in buffer at offset.
+   False when there is no room in staging or in the queue, the caller
+   decides whether to retry later or upload some other way. */
+bool
+upload_staging_buffer(UploadStaging *staging, VkBuffer buffer,
+                      VkDeviceSize offset, void *data, VkDeviceSize size)
+{
+    // Copy offsets are best kept aligned
+    VkDeviceSize start = (staging->used + 15) & ~(VkDeviceSize)15;
+    
+    if (start + size > staging->size)
+    {
+        if (!upload_fence_landed(staging->vk, &staging->fence,
+                                 staging->pushed))
+        {
+            return false;
+        }
+        
+        start = 0;
+        if (size > staging->size)
+        {
+            return false;
+        }
+    }
+    
+    memcpy(staging->mapped + start, data, (size_t)size);
+    
+    UploadRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = UPLOAD_BUFFER;
+    request.source = staging->buffer;
+    request.sourceOffset = start;
+    request.buffer = buffer;
+    request.offset = offset;
+    request.size = size;
+    request.fence = &staging->fence;
+    
+    if (!upload_queue_push(staging->vk->uploadQueue, &request))
+    {
+        return false;
+    }
+    
+    staging->used = start + size;
+    staging->pushed++;
+    
+    return true;
+}
+
+// Once nothing pushed from it can still be copying
+void
+upload_staging_destroy(UploadStaging *staging)
+{
+    VulkanContext *vk = staging->vk;
+    vkUnmapMemory(vk->device, staging->memory);
+    vkDestroyBuffer(vk->device, staging->buffer, NULL);
+    vkFreeMemory(vk->device, staging->memory, NULL);
+}
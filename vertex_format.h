@@ -0,0 +1,340 @@
+/*
+*  Compact vertex formats
+*
+*  The sprite vertex doesn't need two float pairs. Positions can be stored
+*  as 16-bit snorm or half floats, normalized to [-1, 1] by a scale and bias
+*  taken from the bounds they live in, and UVs (only [0, 1]) as 16-bit
+*  unorm or half floats, with an optional RGBA8 color on top. Vertex fetch
+*  turns all of these back into floats, and the scale and bias are
+*  specialization constants of shader.vert, set from the pipeline key.
+*  color.vert is only needed to multiply the color into the tint.
+*/
+
+typedef enum
+{
+    VERTEX_LAYOUT_SPRITE, // Vertex: float position and uv, 16 bytes
+    VERTEX_LAYOUT_SPRITE_SNORM16, // snorm16 position, unorm16 uv, 8 bytes
+    VERTEX_LAYOUT_SPRITE_HALF, // half float position and uv, 8 bytes
+    VERTEX_LAYOUT_SPRITE_SNORM16_COLOR, // snorm16, unorm16, RGBA8, 12 bytes
+    VERTEX_LAYOUT_PULLED, // no vertex input, the shader reads a buffer
+    
+    VERTEX_LAYOUT_COUNT
+    
+} VertexLayout;
+
+typedef struct
+{
+    char *name; // NULL if it can't store vertices
+    u32 stride;
+    VkFormat positionFormat; // location 0, at offset 0, or undefined
+    VkFormat uvFormat; // location 1
+    u32 uvOffset;
+    VkFormat colorFormat; // location 2, VK_FORMAT_UNDEFINED if none
+    u32 colorOffset;
+    
+} VertexLayoutInfo;
+
+VertexLayoutInfo vertexLayouts[VERTEX_LAYOUT_COUNT] =
+{
+    {
+        "float", 16,
+        VK_FORMAT_R32G32_SFLOAT,
+        VK_FORMAT_R32G32_SFLOAT, 8,
+        VK_FORMAT_UNDEFINED, 0
+    },
+    {
+        "snorm16", 8,
+        VK_FORMAT_R16G16_SNORM,
+        VK_FORMAT_R16G16_UNORM, 4,
+        VK_FORMAT_UNDEFINED, 0
+    },
+    {
+        "half", 8,
+        VK_FORMAT_R16G16_SFLOAT,
+        VK_FORMAT_R16G16_SFLOAT, 4,
+        VK_FORMAT_UNDEFINED, 0
+    },
+    {
+        "color", 12,
+        VK_FORMAT_R16G16_SNORM,
+        VK_FORMAT_R16G16_UNORM, 4,
+        VK_FORMAT_R8G8B8A8_UNORM, 8
+    },
+    {
+        NULL, 0,
+        VK_FORMAT_UNDEFINED,
+        VK_FORMAT_UNDEFINED, 0,
+        VK_FORMAT_UNDEFINED, 0
+    }
+};
+
+// Returns VERTEX_LAYOUT_COUNT for an unknown name
+VertexLayout
+vertex_layout_from_name(char *name)
+{
+    u32 layout = 0;
+    for (; layout < VERTEX_LAYOUT_COUNT; layout++)
+    {
+        if (vertexLayouts[layout].name &&
+            strcmp(vertexLayouts[layout].name, name) == 0)
+        {
+            break;
+        }
+    }
+    
+    return (VertexLayout)layout;
+}
+
+/*
+*  Half floats
+*/
+
+// Round to nearest even, overflow goes to infinity
+u16
+f32_to_half(f32 value)
+{
+    u32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    u32 sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    
+    u32 result;
+    if (bits >= 0x47800000) // 65536 and up, infinity and NaN
+    {
+        result = bits > 0x7f800000 ? 0x7e00 : 0x7c00;
+    }
+    else if (bits < 0x38800000) // below the smallest normal half
+    {
+        // Adding 0.5 lines the half's denormal mantissa up with the
+        // float's low bits, and the addition does the rounding
+        u32 magicBits = 126 << 23;
+        f32 magic;
+        memcpy(&magic, &magicBits, sizeof(magic));
+        
+        f32 magnitude;
+        memcpy(&magnitude, &bits, sizeof(magnitude));
+        magnitude += magic;
+        
+        memcpy(&result, &magnitude, sizeof(result));
+        result -= magicBits;
+    }
+    else
+    {
+        u32 mantissaOdd = (bits >> 13) & 1;
+        
+        // Rebias the exponent and round, a carry bumps the exponent
+        bits += ((u32)(15 - 127) << 23) + 0xfff + mantissaOdd;
+        result = bits >> 13;
+    }
+    
+    return (u16)(result | sign);
+}
+
+f32
+half_to_f32(u16 half)
+{
+    u32 sign = (u32)(half & 0x8000) << 16;
+    u32 exponent = (half >> 10) & 0x1f;
+    u32 mantissa = half & 0x3ff;
+    
+    if (exponent == 0)
+    {
+        f32 denormal = (f32)mantissa * (1.0f / 16777216.0f); // 2^-24
+        return sign ? -denormal : denormal;
+    }
+    
+    u32 bits = exponent == 31 ?
+        sign | 0x7f800000 | (mantissa << 13) :
+        sign | ((exponent + 112) << 23) | (mantissa << 13);
+    
+    f32 result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/*
+*  Quantizer
+*/
+
+typedef struct
+{
+    f32 scale[2]; // position = stored * scale + bias
+    f32 bias[2];
+    
+    // Largest difference between a vertex and its decoded version
+    f32 positionError; // in position units
+    f32 uvError;
+    
+} VertexQuantization;
+
+/* Fits the positions of a layout to the box [minX, maxX] x [minY, maxY].
+   Every position quantized later has to stay inside the box. */
+VertexQuantization
+vertex_quantization_make(VertexLayout layout, f32 minX, f32 minY,
+                         f32 maxX, f32 maxY)
+{
+    VertexQuantization result = {0};
+    result.scale[0] = 1;
+    result.scale[1] = 1;
+    
+    if (layout == VERTEX_LAYOUT_SPRITE)
+    {
+        return result; // stored as they are
+    }
+    
+    result.scale[0] = maxX > minX ? 0.5f * (maxX - minX) : 1.0f;
+    result.scale[1] = maxY > minY ? 0.5f * (maxY - minY) : 1.0f;
+    result.bias[0] = 0.5f * (minX + maxX);
+    result.bias[1] = 0.5f * (minY + maxY);
+    
+    f32 scale = result.scale[0] > result.scale[1] ?
+        result.scale[0] : result.scale[1];
+    
+    if (vertexLayouts[layout].positionFormat == VK_FORMAT_R16G16_SFLOAT)
+    {
+        // Half an ulp of the top binade, [0.5, 1)
+        result.positionError = scale / 4096.0f;
+        result.uvError = 1.0f / 4096.0f;
+    }
+    else
+    {
+        // Half a step of the integer grid
+        result.positionError = scale / (2.0f * 32767.0f);
+        result.uvError = 1.0f / (2.0f * 65535.0f);
+    }
+    
+    // Plus the rounding of the decode itself, done in floats
+    f32 largest = fabsf(result.bias[0]) > fabsf(result.bias[1]) ?
+        fabsf(result.bias[0]) : fabsf(result.bias[1]);
+    result.positionError += 4.0f * FLT_EPSILON * (largest + scale);
+    
+    return result;
+}
+
+s16
+quantize_snorm16(f32 value)
+{
+    value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+    return (s16)floorf(value * 32767.0f + 0.5f);
+}
+
+u16
+quantize_unorm16(f32 value)
+{
+    value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+    return (u16)floorf(value * 65535.0f + 0.5f);
+}
+
+/* Writes count vertices to out in layout. color is RGBA8 with red in the
+   low byte, only stored by layouts that have one. */
+void
+vertex_quantize(VertexLayout layout, VertexQuantization *quantization,
+                Vertex *vertices, u32 count, u32 color, void *out)
+{
+    VertexLayoutInfo *info = &vertexLayouts[layout];
+    u8 *at = (u8 *)out;
+    
+    for (u32 i = 0; i < count; i++, at += info->stride)
+    {
+        Vertex *vertex = &vertices[i];
+        
+        if (layout == VERTEX_LAYOUT_SPRITE)
+        {
+            memcpy(at, vertex, sizeof(Vertex));
+            continue;
+        }
+        
+        f32 x = (vertex->x - quantization->bias[0]) / quantization->scale[0];
+        f32 y = (vertex->y - quantization->bias[1]) / quantization->scale[1];
+        
+        u16 *position = (u16 *)at;
+        u16 *uv = (u16 *)(at + info->uvOffset);
+        
+        if (info->positionFormat == VK_FORMAT_R16G16_SFLOAT)
+        {
+            position[0] = f32_to_half(x);
+            position[1] = f32_to_half(y);
+            uv[0] = f32_to_half(vertex->u);
+            uv[1] = f32_to_half(vertex->v);
+        }
+        else
+        {
+            position[0] = (u16)quantize_snorm16(x);
+            position[1] = (u16)quantize_snorm16(y);
+            uv[0] = quantize_unorm16(vertex->u);
+            uv[1] = quantize_unorm16(vertex->v);
+        }
+        
+        if (info->colorFormat != VK_FORMAT_UNDEFINED)
+        {
+            memcpy(at + info->colorOffset, &color, sizeof(color));
+        }
+    }
+}
+
+// Decodes vertex index the way vertex fetch and shader.vert will
+Vertex
+vertex_dequantize(VertexLayout layout, VertexQuantization *quantization,
+                  void *data, u32 index)
+{
+    VertexLayoutInfo *info = &vertexLayouts[layout];
+    u8 *at = (u8 *)data + index * info->stride;
+    
+    Vertex result;
+    if (layout == VERTEX_LAYOUT_SPRITE)
+    {
+        memcpy(&result, at, sizeof(Vertex));
+        return result;
+    }
+    
+    u16 *position = (u16 *)at;
+    u16 *uv = (u16 *)(at + info->uvOffset);
+    
+    f32 x, y;
+    if (info->positionFormat == VK_FORMAT_R16G16_SFLOAT)
+    {
+        x = half_to_f32(position[0]);
+        y = half_to_f32(position[1]);
+        result.u = half_to_f32(uv[0]);
+        result.v = half_to_f32(uv[1]);
+    }
+    else
+    {
+        // -32768 decodes to -1 like -32767
+        x = (f32)(s16)position[0] / 32767.0f;
+        y = (f32)(s16)position[1] / 32767.0f;
+        x = x < -1.0f ? -1.0f : x;
+        y = y < -1.0f ? -1.0f : y;
+        result.u = (f32)uv[0] / 65535.0f;
+        result.v = (f32)uv[1] / 65535.0f;
+    }
+    
+    result.x = x * quantization->scale[0] + quantization->bias[0];
+    result.y = y * quantization->scale[1] + quantization->bias[1];
+    
+    return result;
+}
+
+/* Decodes data again and checks every vertex against the error bounds.
+   Cheap enough to run on everything quantized at load time. */
+bool
+vertex_quantization_check(VertexLayout layout,
+                          VertexQuantization *quantization,
+                          Vertex *vertices, void *data, u32 count)
+{
+    for (u32 i = 0; i < count; i++)
+    {
+        Vertex decoded = vertex_dequantize(layout, quantization, data, i);
+        
+        if (fabsf(decoded.x - vertices[i].x) > quantization->positionError ||
+            fabsf(decoded.y - vertices[i].y) > quantization->positionError ||
+            fabsf(decoded.u - vertices[i].u) > quantization->uvError ||
+            fabsf(decoded.v - vertices[i].v) > quantization->uvError)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}